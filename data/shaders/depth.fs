@@ -0,0 +1,6 @@
+
+void main()
+{
+	//only the depth is written, the color mask is off
+	gl_FragColor = vec4(1.0);
+}
@@ -0,0 +1,17 @@
+attribute vec3 a_vertex;
+
+uniform mat4 u_model;
+uniform mat4 u_viewprojection;
+
+//compact vertex format (see Mesh::tQuantized)
+uniform float u_quantized;
+uniform vec3 u_quantization_min;
+uniform vec3 u_quantization_size;
+
+//only the position for the depth pre-pass, the operations are the same as in basic.vs so the depth is equal
+void main()
+{
+	vec3 vertex = mix(a_vertex, u_quantization_min + a_vertex * u_quantization_size, u_quantized);
+	vec3 world_position = (u_model * vec4( vertex, 1.0) ).xyz;
+	gl_Position = u_viewprojection * vec4( world_position, 1.0 );
+}
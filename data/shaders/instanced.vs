@@ -9,6 +9,19 @@ uniform vec3 u_camera_pos;
 
 uniform mat4 u_viewprojection;
 
+//compact vertex format (see Mesh::tQuantized)
+uniform float u_quantized;
+uniform vec3 u_quantization_min;
+uniform vec3 u_quantization_size;
+
+vec3 octDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
+
 //this will store the color for the pixel shader
 varying vec3 v_position;
 varying vec3 v_world_position;
@@ -17,12 +30,16 @@ varying vec2 v_uv;
 
 void main()
 {	
+	//decode the compact vertex format
+	vec3 vertex = mix(a_vertex, u_quantization_min + a_vertex * u_quantization_size, u_quantized);
+	vec3 normal = u_quantized > 0.0 ? octDecode(a_normal.xy) : a_normal;
+
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
-	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	v_normal = (u_model * vec4( normal, 0.0) ).xyz;
 	
 	//calcule the vertex in object space
-	v_position = a_vertex;
-	v_world_position = (u_model * vec4( a_vertex, 1.0) ).xyz;
+	v_position = vertex;
+	v_world_position = (u_model * vec4( vertex, 1.0) ).xyz;
 	
 	//store the texture coordinates
 	v_uv = a_uv;
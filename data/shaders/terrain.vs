@@ -0,0 +1,36 @@
+attribute vec3 a_vertex;
+
+uniform mat4 u_model;
+uniform mat4 u_viewprojection;
+
+//terrain chunk (see Terrain), xy is the corner in the height map, z the size and w the depth of the skirt
+uniform vec4 u_chunk;
+uniform float u_terrain_size;
+uniform float u_altitude;
+
+uniform sampler2D u_texture;
+
+//this will store the color for the pixel shader
+varying vec3 v_position;
+varying vec3 v_world_position;
+varying vec3 v_normal;
+varying vec2 v_uv;
+varying vec4 v_color;
+
+void main()
+{
+	//place the patch in the height map, x goes with v and z with u like in the subdivided plane
+	v_uv = u_chunk.xy + a_vertex.zx * u_chunk.z;
+
+	vec4 color = texture2D( u_texture, v_uv);
+	float gray = dot(color.rgb, vec3(0.299, 0.587, 0.114));
+
+	//the vertices of the skirt go down to hide the cracks with the neighbours
+	v_position = vec3( (v_uv.y - 0.5) * u_terrain_size, gray * u_altitude - a_vertex.y * u_chunk.w, (v_uv.x - 0.5) * u_terrain_size );
+	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
+	v_normal = (u_model * vec4( 0.0, 1.0, 0.0, 0.0) ).xyz;
+	v_color = vec4(1.0);
+
+	//calcule the position of the vertex using the matrices
+	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
+}
@@ -16,53 +16,205 @@ uniform vec4 u_color;
 uniform vec2 u_resolution = vec2(100.0, 100.0);
 
 uniform bool u_jittering;
+uniform float u_jitter_seed;
 uniform bool u_gradient;
 
+//first hit isosurface
+uniform bool u_isosurface;
+uniform float u_iso_value;
+uniform vec3 u_voxel_size;	//in texture coordinates
+
+//depth of the opaque geometry, the rays end when they reach it
+uniform bool u_use_depth;
+uniform sampler2D u_depth_texture;
+uniform mat4 u_inverse_viewprojection;
+uniform mat4 u_inverse_model;
+
+//region of interest, a box and two planes (a zero plane is disabled)
+uniform vec3 u_clip_min;
+uniform vec3 u_clip_max;
+uniform vec4 u_clip_planes[2];
+
+//adaptive sampling, guided by a coarse volume with the min and max of every brick
+uniform bool u_adaptive;
+uniform sampler3D u_brick_texture;
+uniform vec3 u_brick_dims;
+uniform float u_empty_threshold;	//bricks with a max below this are skipped
+uniform float u_refine_scale;		//how fast the step shrinks when the values of the brick change
+uniform float u_max_step_factor;	//largest step as a multiple of u_quality
+
+//upper bound for the number of samples of a ray, the real count is computed per ray
+#define MAX_STEPS 4096
+
 float random (vec2 st) {
     return fract(sin(dot(st.xy, vec2(12.9898,78.233)))*43758.5453123);
 }
 
+//slab test against an axis aligned box, returns the ray parameters where it enters and leaves the box
+vec2 intersectBox(vec3 origin, vec3 dir, vec3 box_min, vec3 box_max)
+{
+	vec3 inv_dir = 1.0 / dir;
+	vec3 t0 = (box_min - origin) * inv_dir;
+	vec3 t1 = (box_max - origin) * inv_dir;
+	vec3 t_min = min(t0, t1);
+	vec3 t_max = max(t0, t1);
+	float t_entry = max(max(t_min.x, t_min.y), t_min.z);
+	float t_exit = min(min(t_max.x, t_max.y), t_max.z);
+	return vec2(t_entry, t_exit);
+}
+
+float sampleDensity(vec3 origin, vec3 dir, float t)
+{
+	return texture3D(u_texture, (origin + dir * t + 1.0) / 2.0).x;
+}
+
+//march until the iso value is crossed, refine the hit with bisection and shade it with the gradient
+vec4 shadeIsosurface(vec3 ray_origin, vec3 ray_dir, float t, float t_exit)
+{
+	float t_hit = -1.0;
+	float t_prev = t;
+	for(int i = 0; i < MAX_STEPS; i++)
+	{
+		if(t >= t_exit)
+			break;
+		if(sampleDensity(ray_origin, ray_dir, t) >= u_iso_value)
+		{
+			float a = i == 0 ? t : t_prev;
+			float b = t;
+			for(int j = 0; j < 8; j++)
+			{
+				float m = 0.5 * (a + b);
+				if(sampleDensity(ray_origin, ray_dir, m) >= u_iso_value)
+					b = m;
+				else
+					a = m;
+			}
+			t_hit = b;
+			break;
+		}
+		t_prev = t;
+		t += u_quality;
+	}
+
+	if(t_hit < 0.0)
+		return vec4(0.0);
+
+	//the density grows towards the inside, the normal is the opposite of the gradient
+	vec3 p = (ray_origin + ray_dir * t_hit + 1.0) / 2.0;
+	vec3 gradient = vec3(
+		texture3D(u_texture, p + vec3(u_voxel_size.x, 0.0, 0.0)).x - texture3D(u_texture, p - vec3(u_voxel_size.x, 0.0, 0.0)).x,
+		texture3D(u_texture, p + vec3(0.0, u_voxel_size.y, 0.0)).x - texture3D(u_texture, p - vec3(0.0, u_voxel_size.y, 0.0)).x,
+		texture3D(u_texture, p + vec3(0.0, 0.0, u_voxel_size.z)).x - texture3D(u_texture, p - vec3(0.0, 0.0, u_voxel_size.z)).x);
+	float diffuse = 1.0;
+	if(dot(gradient, gradient) > 0.0)
+		diffuse = max(dot(-normalize(gradient), -ray_dir), 0.0);
+
+	return vec4(min(u_color.xyz * (0.2 + 0.8 * diffuse) * u_brightness, vec3(1.0)), 1.0);
+}
+
 void main()
 {
-	vec3 current_sample;
+	//Ray setup: the cube is drawn with its front faces culled so v_position is where the ray leaves the volume,
+	//this way it also works when the camera is inside the volume
+	vec3 ray_origin = u_local_camera_position;
+	vec3 ray_dir = normalize(v_position - ray_origin);
 
-	if(u_jittering)
+	//avoid divisions by zero in the slab test, sign() would keep the exact zeros
+	vec3 tiny_dir = mix(vec3(-0.00001), vec3(0.00001), step(0.0, ray_dir));
+	ray_dir = mix(ray_dir, tiny_dir, step(abs(ray_dir), vec3(0.00001)));
+
+	vec2 t_range = intersectBox(ray_origin, ray_dir, u_clip_min, u_clip_max);
+	t_range.x = max(t_range.x, 0.0); //camera inside the volume starts at the eye
+
+	//each plane cuts the interval where the ray crosses it
+	for(int i = 0; i < 2; i++)
 	{
-		vec2 st = (gl_FragCoord.xy)/(u_resolution.xy);
-    
-		st *= 100.0; // Scale the coordinate system by 10
-		vec2 ipos = floor(st);  // get the integer coords
-		vec2 fpos = fract(st);  // get the fractional coords
-    
-		// Assign a random value based on the integer coord
-		vec3 noise = vec3(random( ipos ));
-		vec3 newUV = v_position + 0.001 * (noise - 0.5);
+		vec4 plane = u_clip_planes[i];
+		if(dot(plane.xyz, plane.xyz) == 0.0)
+			continue;
+		float distance = dot(plane.xyz, ray_origin) + plane.w;
+		float denom = dot(plane.xyz, ray_dir);
+		if(abs(denom) < 0.000001)
+		{
+			if(distance < 0.0)
+				discard;
+		}
+		else if(denom > 0.0)
+			t_range.x = max(t_range.x, -distance / denom);
+		else
+			t_range.y = min(t_range.y, -distance / denom);
+	}
 
-		current_sample = newUV;   //initial position
+	//stop at the opaque surface: unproject its depth and measure it along the ray in local space
+	if(u_use_depth)
+	{
+		vec2 uv = gl_FragCoord.xy / u_resolution;
+		float depth = texture2D(u_depth_texture, uv).x;
+		if(depth < 1.0)
+		{
+			vec4 surface = u_inverse_viewprojection * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+			vec3 local_surface = (u_inverse_model * vec4(surface.xyz / surface.w, 1.0)).xyz;
+			t_range.y = min(t_range.y, dot(local_surface - ray_origin, ray_dir));
+		}
 	}
-	else
-		current_sample = v_position; 
 
-    //Ray
-    vec3 step_vector = normalize(current_sample - u_local_camera_position) * u_quality; //normalize the ray vector
+	if(t_range.y <= t_range.x)
+		discard;
+
+	//exact number of steps needed to cross the volume
+	int num_steps = int(ceil((t_range.y - t_range.x) / u_quality));
+	num_steps = min(num_steps, MAX_STEPS);
+
+	//offset of the first sample inside the first step
+	float offset = 0.5;
+	if(u_jittering)
+	{
+		//a different value for every pixel, so the neighbourhood clamp of the temporal resolve sees the real noise range,
+		//and the seed moves it every frame
+		offset = fract( random( gl_FragCoord.xy ) + u_jitter_seed );
+	}
+
+	float t = t_range.x + u_quality * offset;   //initial position
+
+	if(u_isosurface)
+	{
+		gl_FragColor = shadeIsosurface(ray_origin, ray_dir, t, t_range.y);
+		return;
+	}
 
     //color accumulator
     vec4 color_acc = vec4(0.0, 0.0, 0.0, 0.0);
 
+	//the uniform mode does exactly num_steps samples, the adaptive one stops when it leaves the volume
+	int max_iterations = u_adaptive ? MAX_STEPS : num_steps;
 
     //start loop
-    for(int i = 0; i < 4016; i++)
+    for(int i = 0; i < max_iterations; i++)
     {
-        current_sample += step_vector;     //for every iteration sum the step vector to the sample
-        vec3 current_sample_norm = (current_sample + 1) / 2.0;  //norm of the current sample
-
-        //break the loop if the color alpha value is huge
-        if(color_acc.a > 0.99) 
+        //break the loop if the color alpha value is huge or the ray left the volume
+        if(color_acc.a > 0.99 || t >= t_range.y) 
             break;
 
-        //break the loop if the ray is not inside the volume
-        if (current_sample.x > 1 || current_sample.y > 1 || current_sample.z > 1 || current_sample.x < -1 || current_sample.y < -1 || current_sample.z < -1 ) 
-            break;
+		vec3 current_sample = ray_origin + ray_dir * t;
+        vec3 current_sample_norm = (current_sample + 1.0) / 2.0;  //norm of the current sample
+
+		float dt = u_quality;
+		if(u_adaptive)
+		{
+			vec2 brick = texture3D(u_brick_texture, current_sample_norm).xy; //min and max of the brick
+			if(brick.y <= u_empty_threshold)
+			{
+				//empty brick, jump to where the ray leaves it without sampling
+				vec3 cell = floor(current_sample_norm * u_brick_dims);
+				vec2 t_cell = intersectBox(ray_origin, ray_dir, cell / u_brick_dims * 2.0 - 1.0, (cell + 1.0) / u_brick_dims * 2.0 - 1.0);
+				t = max(t_cell.y, t) + u_quality * 0.01;
+				continue;
+			}
+
+			//homogeneous bricks and almost opaque rays can take larger steps
+			float homogeneity = 1.0 - clamp((brick.y - brick.x) * u_refine_scale, 0.0, 1.0);
+			dt = u_quality * (1.0 + (u_max_step_factor - 1.0) * max(homogeneity, color_acc.a));
+		}
         
 		vec4 color_i;
 
@@ -89,8 +241,12 @@ void main()
 			color_i = vec4(u_color.xyz, color_i.x);
 		}
 
-        color_i.rgb = color_i.rgb * color_i.a;
-        color_acc = length(step_vector) * color_i * (1.0 - color_acc.a) + color_acc;
+		//opacity correction, the same density gives the same result whatever the step length
+		float alpha = 1.0 - exp(-color_i.a * dt);
+        color_acc.rgb += color_i.rgb * alpha * (1.0 - color_acc.a);
+        color_acc.a += alpha * (1.0 - color_acc.a);
+
+        t += dt;     //for every iteration advance the ray
     }
     
 	//Brightness Options
@@ -124,5 +280,6 @@ void main()
         color_acc.z = color_acc.z * u_brightness;
     }
     
-    gl_FragColor = vec4(color_acc.xyz, 1.0);
+    //premultiplied, what is behind the volume shows through where it is not opaque
+    gl_FragColor = color_acc;
 }
\ No newline at end of file
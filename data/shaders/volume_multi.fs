@@ -0,0 +1,172 @@
+varying vec3 v_position;
+
+//the quad is drawn with identity matrices, v_position is the pixel in normalized device coordinates
+uniform mat4 u_inverse_viewprojection;
+uniform vec3 u_camera_position;
+
+uniform int u_num_volumes;
+uniform mat4 u_inverse_models[4];
+uniform vec4 u_colors[4];
+uniform float u_brightness[4];
+
+//region of interest of every volume in its local space, a plane of zeros is disabled
+uniform vec3 u_clip_mins[4];
+uniform vec3 u_clip_maxs[4];
+uniform vec4 u_clip_planes[8];
+
+//one texture unit per volume, samplers can not be indexed so they are chosen with ifs
+uniform sampler3D u_texture0;
+uniform sampler3D u_texture1;
+uniform sampler3D u_texture2;
+uniform sampler3D u_texture3;
+
+uniform float u_step;	//in world units
+uniform bool u_jittering;
+uniform vec2 u_resolution;
+
+#define MAX_VOLUMES 4
+#define MAX_STEPS 4096
+
+float random (vec2 st) {
+    return fract(sin(dot(st.xy, vec2(12.9898,78.233)))*43758.5453123);
+}
+
+//slab test against an axis aligned box, returns the ray parameters where it enters and leaves the box
+vec2 intersectBox(vec3 origin, vec3 dir, vec3 box_min, vec3 box_max)
+{
+	vec3 inv_dir = 1.0 / dir;
+	vec3 t0 = (box_min - origin) * inv_dir;
+	vec3 t1 = (box_max - origin) * inv_dir;
+	vec3 t_min = min(t0, t1);
+	vec3 t_max = max(t0, t1);
+	float t_entry = max(max(t_min.x, t_min.y), t_min.z);
+	float t_exit = min(min(t_max.x, t_max.y), t_max.z);
+	return vec2(t_entry, t_exit);
+}
+
+float sampleVolume(int index, vec3 position)
+{
+	if(index == 0)
+		return texture3D(u_texture0, position).x;
+	else if(index == 1)
+		return texture3D(u_texture1, position).x;
+	else if(index == 2)
+		return texture3D(u_texture2, position).x;
+	return texture3D(u_texture3, position).x;
+}
+
+void main()
+{
+	//world space ray through the pixel
+	vec4 far_point = u_inverse_viewprojection * vec4(v_position.xy, 1.0, 1.0);
+	vec3 ray_dir = normalize(far_point.xyz / far_point.w - u_camera_position);
+
+	//the local directions are not normalized, so the ray parameter is the same world distance for every volume
+	vec3 local_origins[MAX_VOLUMES];
+	vec3 local_dirs[MAX_VOLUMES];
+	vec2 t_ranges[MAX_VOLUMES];
+	float t_start = 1.0e10;
+	float t_end = 0.0;
+
+	for(int i = 0; i < MAX_VOLUMES; i++)
+	{
+		t_ranges[i] = vec2(1.0, 0.0);
+		if(i >= u_num_volumes)
+			break;
+
+		local_origins[i] = (u_inverse_models[i] * vec4(u_camera_position, 1.0)).xyz;
+		local_dirs[i] = (u_inverse_models[i] * vec4(ray_dir, 0.0)).xyz;
+		vec3 tiny_dir = mix(vec3(-0.00001), vec3(0.00001), step(0.0, local_dirs[i]));
+		local_dirs[i] = mix(local_dirs[i], tiny_dir, step(abs(local_dirs[i]), vec3(0.00001)));
+
+		vec2 t_range = intersectBox(local_origins[i], local_dirs[i], u_clip_mins[i], u_clip_maxs[i]);
+		t_range.x = max(t_range.x, 0.0);
+
+		//each plane cuts the interval where the ray crosses it
+		for(int j = 0; j < 2; j++)
+		{
+			vec4 plane = u_clip_planes[i * 2 + j];
+			if(dot(plane.xyz, plane.xyz) == 0.0)
+				continue;
+			float distance = dot(plane.xyz, local_origins[i]) + plane.w;
+			float denom = dot(plane.xyz, local_dirs[i]);
+			if(abs(denom) < 0.000001)
+			{
+				if(distance < 0.0)
+					t_range = vec2(1.0, 0.0);
+			}
+			else if(denom > 0.0)
+				t_range.x = max(t_range.x, -distance / denom);
+			else
+				t_range.y = min(t_range.y, -distance / denom);
+		}
+		if(t_range.y <= t_range.x)
+			continue;
+
+		t_ranges[i] = t_range;
+		t_start = min(t_start, t_range.x);
+		t_end = max(t_end, t_range.y);
+	}
+
+	if(t_end <= t_start)
+		discard;
+
+	float offset = 0.5;
+	if(u_jittering)
+		offset = random(floor(gl_FragCoord.xy / u_resolution * 100.0));
+
+	float t = t_start + u_step * offset;
+	vec4 color_acc = vec4(0.0);
+
+	for(int step = 0; step < MAX_STEPS; step++)
+	{
+		if(color_acc.a > 0.99 || t >= t_end)
+			break;
+
+		//the extinction and the color of the overlapping volumes are added at this point of the ray
+		float extinction = 0.0;
+		vec3 emission = vec3(0.0);
+		bool inside = false;
+		float next_entry = t_end;
+
+		for(int i = 0; i < MAX_VOLUMES; i++)
+		{
+			if(i >= u_num_volumes)
+				break;
+
+			if(t < t_ranges[i].x)
+			{
+				next_entry = min(next_entry, t_ranges[i].x);
+				continue;
+			}
+			if(t >= t_ranges[i].y)
+				continue;
+
+			inside = true;
+			vec3 position = (local_origins[i] + local_dirs[i] * t + 1.0) / 2.0;
+
+			//density per local unit, like the single volume shader
+			float density = sampleVolume(i, position) * length(local_dirs[i]);
+			extinction += density;
+			emission += min(u_colors[i].xyz * u_brightness[i], vec3(1.0)) * density;
+		}
+
+		//gap between volumes, jump to the next one
+		if(!inside)
+		{
+			t = next_entry + u_step * offset;
+			continue;
+		}
+
+		if(extinction > 0.0)
+		{
+			float alpha = 1.0 - exp(-extinction * u_step);
+			color_acc.rgb += emission / extinction * alpha * (1.0 - color_acc.a);
+			color_acc.a += alpha * (1.0 - color_acc.a);
+		}
+
+		t += u_step;
+	}
+
+	gl_FragColor = vec4(color_acc.xyz, 1.0);
+}
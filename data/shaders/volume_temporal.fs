@@ -0,0 +1,57 @@
+varying vec3 v_position;
+varying vec3 v_world_position;
+
+uniform sampler2D u_current_texture;
+uniform sampler2D u_history_texture;
+
+uniform vec2 u_size;
+uniform vec3 u_local_camera_position;
+uniform mat4 u_model;
+uniform mat4 u_prev_viewprojection;
+uniform float u_blend;
+uniform bool u_clamp_history; //off for the running average of a still camera, there is no ghosting to avoid
+
+//slab test against an axis aligned box, returns the ray parameters where it enters and leaves the box
+vec2 intersectBox(vec3 origin, vec3 dir, vec3 box_min, vec3 box_max)
+{
+	vec3 inv_dir = 1.0 / dir;
+	vec3 t0 = (box_min - origin) * inv_dir;
+	vec3 t1 = (box_max - origin) * inv_dir;
+	vec3 t_min = min(t0, t1);
+	vec3 t_max = max(t0, t1);
+	return vec2(max(max(t_min.x, t_min.y), t_min.z), min(min(t_max.x, t_max.y), t_max.z));
+}
+
+void main()
+{
+	vec2 uv = gl_FragCoord.xy / u_size;
+	vec4 current = texture2D(u_current_texture, uv);
+
+	//range of colors around the pixel in the new frame, the history is clamped to it to avoid ghosting
+	vec4 color_min = current;
+	vec4 color_max = current;
+	for(int j = -1; j <= 1; j++)
+		for(int i = -1; i <= 1; i++)
+		{
+			vec4 neighbour = texture2D(u_current_texture, uv + vec2(float(i), float(j)) / u_size);
+			color_min = min(color_min, neighbour);
+			color_max = max(color_max, neighbour);
+		}
+
+	//reproject the point where the ray enters the volume to the previous frame
+	vec3 ray_origin = u_local_camera_position;
+	vec3 ray_dir = normalize(v_position - ray_origin);
+	vec2 t_range = intersectBox(ray_origin, ray_dir, vec3(-1.0), vec3(1.0));
+	vec3 entry = ray_origin + ray_dir * max(t_range.x, 0.0);
+	vec4 prev_clip = u_prev_viewprojection * u_model * vec4(entry, 1.0);
+	vec2 prev_uv = prev_clip.xy / prev_clip.w * 0.5 + 0.5;
+
+	float blend = u_blend;
+	if(prev_clip.w <= 0.0 || prev_uv.x < 0.0 || prev_uv.y < 0.0 || prev_uv.x > 1.0 || prev_uv.y > 1.0)
+		blend = 1.0;
+
+	vec4 history = texture2D(u_history_texture, prev_uv);
+	if(u_clamp_history)
+		history = clamp(history, color_min, color_max);
+	gl_FragColor = mix(history, current, blend);
+}
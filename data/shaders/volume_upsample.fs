@@ -0,0 +1,75 @@
+varying vec3 v_position;
+varying vec3 v_world_position;
+
+//result of the low resolution volume pass
+uniform sampler2D u_color_texture;
+uniform sampler2D u_depth_texture;
+
+//full resolution depth of the opaque geometry, the rays end there
+uniform bool u_use_opaque_depth;
+uniform sampler2D u_opaque_depth_texture;
+
+uniform vec2 u_lowres_size;
+uniform vec2 u_screen_size;
+uniform vec2 u_camera_near_far;
+uniform float u_depth_sigma;
+
+float linearizeDepth(float depth)
+{
+	float near = u_camera_near_far.x;
+	float far = u_camera_near_far.y;
+	float z_ndc = depth * 2.0 - 1.0;
+	return 2.0 * near * far / (far + near - z_ndc * (far - near));
+}
+
+//where the ray of this point of the screen stops: the back of the cube or the opaque geometry in front of it
+float rayEndDepth(float cube_depth, vec2 uv)
+{
+	if(u_use_opaque_depth)
+		cube_depth = min(cube_depth, texture2D(u_opaque_depth_texture, uv).x);
+	return linearizeDepth(cube_depth);
+}
+
+void main()
+{
+	//position of this fragment inside the low resolution buffer, in texels
+	vec2 uv = gl_FragCoord.xy / u_screen_size;
+	vec2 texel = uv * u_lowres_size - 0.5;
+	vec2 base = floor(texel);
+	vec2 f = texel - base;
+
+	float depth = rayEndDepth(gl_FragCoord.z, uv);
+
+	//bilateral filter: bilinear weights of the 4 closest texels, rejecting the ones at a different depth
+	vec4 color_sum = vec4(0.0);
+	float weight_sum = 0.0;
+	vec4 nearest_color = vec4(0.0);
+	float nearest_distance = 1.0e10;
+
+	for(int j = 0; j < 2; j++)
+		for(int i = 0; i < 2; i++)
+		{
+			vec2 sample_uv = (base + vec2(float(i), float(j)) + 0.5) / u_lowres_size;
+			vec4 sample_color = texture2D(u_color_texture, sample_uv);
+			float sample_depth = rayEndDepth(texture2D(u_depth_texture, sample_uv).x, sample_uv);
+
+			float distance = abs(depth - sample_depth) / depth;
+			float bilinear = (i == 0 ? 1.0 - f.x : f.x) * (j == 0 ? 1.0 - f.y : f.y);
+			float weight = bilinear * exp(-distance * u_depth_sigma);
+
+			color_sum += sample_color * weight;
+			weight_sum += weight;
+
+			if(distance < nearest_distance)
+			{
+				nearest_distance = distance;
+				nearest_color = sample_color;
+			}
+		}
+
+	//all the texels belong to other surfaces, use the closest one in depth
+	if(weight_sum < 0.0001)
+		gl_FragColor = nearest_color;
+	else
+		gl_FragColor = color_sum / weight_sum;
+}
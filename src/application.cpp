@@ -7,6 +7,7 @@
 #include "shader.h"
 #include "input.h"
 #include "animation.h"
+#include "terrain.h"
 #include "extra/hdre.h"
 #include "includes.h"
 
@@ -27,6 +28,34 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	render_jittering = false;
 	render_gradient = false;
 
+	dynamic_resolution_scale = 1.0f;
+	target_frame_time = 1.0f / 50.0f;
+	smoothed_frame_time = target_frame_time;
+
+	render_scene_with_volume = false;
+	opaque_depth_fbo = NULL;
+
+	depth_prepass = false;
+	samples_query_ids[0] = samples_query_ids[1] = 0;
+	samples_query_pending[0] = samples_query_pending[1] = false;
+	samples_query_prepass[0] = samples_query_prepass[1] = false;
+	samples_query_index = 0;
+	samples_passed[0] = samples_passed[1] = 0;
+
+	progressive_rendering = false;
+	interacting = true;
+	idle_frames = 0;
+	progressive_frames = 32;
+	last_volume_index = -1;
+	frame_cache_fbo = NULL;
+	frame_cached = false;
+
+	multi_volume_renderer = NULL;
+
+	terrain = NULL;
+	camera_follow_ground = false;
+	camera_ground_distance = 2.0f;
+
 	fps = 0;
 	frame = 0;
 	time = 0.0f;
@@ -84,13 +113,18 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	Volume* v_smoke = new Volume(32,32,32);
 	v_smoke->fillNoise(2, 4, 1);
 
-	//Create textures from each previously created volume
+	//Create textures from each previously created volume, the materials upload the voxels of their region of interest
 	Texture* t_abdomen = new Texture();
-	t_abdomen->create3D(v_abdomen->width, v_abdomen->height, v_abdomen->depth, GL_RED, GL_UNSIGNED_BYTE, false, v_abdomen->data, GL_RED);
+	t_abdomen->create3D(v_abdomen->width, v_abdomen->height, v_abdomen->depth, GL_RED, GL_UNSIGNED_BYTE, false, NULL, GL_RED);
 	Texture* t_orange = new Texture();
-	t_orange->create3D(v_orange->width, v_orange->height, v_orange->depth, GL_RED, GL_UNSIGNED_BYTE, false, v_orange->data, GL_RED);
+	t_orange->create3D(v_orange->width, v_orange->height, v_orange->depth, GL_RED, GL_UNSIGNED_BYTE, false, NULL, GL_RED);
 	Texture* t_smoke = new Texture();
-	t_smoke->create3D(v_smoke->width, v_smoke->height, v_smoke->depth, GL_RED, GL_UNSIGNED_BYTE, false, v_smoke->data, GL_RED);
+	t_smoke->create3D(v_smoke->width, v_smoke->height, v_smoke->depth, GL_RED, GL_UNSIGNED_BYTE, false, NULL, GL_RED);
+
+	//Keep the volumes in the materials, the CPU reference raymarcher needs them
+	abdomen_material->volume = v_abdomen;
+	orange_material->volume = v_orange;
+	smoke_material->volume = v_smoke;
 
 	//Assign textures to nodes
 	abdomen->material->texture = t_abdomen;
@@ -105,13 +139,14 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 
 	//Full scene with map, clouds and light
 	//Map
-	SceneNode * map = new SceneNode("Rendered Menorca");
+	//chunks of the height map with levels of detail instead of a plane at full density
+	Terrain * map = new Terrain("data/textures/Menorca_gray.tga", 100.0f, 9.0f);
+	map->name = "Rendered Menorca";
 	root.push_back(map);
-	Mesh * plane = new Mesh();
-	plane->createSubdividedPlane(100.0, 512, true);
-	map->mesh = plane;
 	map->model.setScale(1, 1, 1);
+	terrain = map;
 	HeightMapMaterial * map_material = new HeightMapMaterial();
+	map_material->shader = Shader::Get("data/shaders/terrain.vs", "data/shaders/texture.fs");
 	//map_material->color = vec4(1.0, 0.0, 0.0, 1.0);
 	map_material->texture = Texture::Get("data/textures/Menorca_gray.tga");
 	map_material->beauty = Texture::Get("data/textures/Menorca_color.tga");
@@ -137,6 +172,15 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 //what to do when the image has to be draw
 void Application::render(void)
 {
+	//nothing changed since the image converged, show the cached frame instead of drawing it again
+	if (isConverged() && frame_cached)
+	{
+		glDisable(GL_DEPTH_TEST);
+		frame_cache_fbo->color_textures[0]->toViewport();
+		glEnable(GL_DEPTH_TEST);
+		return;
+	}
+
 	//set the clear color (the background color)
 	glClearColor(0.725, 0.886, 0.961, 1.0);
 
@@ -150,6 +194,47 @@ void Application::render(void)
 	glDisable(GL_BLEND);
 	glEnable(GL_DEPTH_TEST);
 
+	bool mixed_scene = render_scene_with_volume && volume_index >= 1 && volume_index <= 3;
+	if (mixed_scene)
+		renderOpaqueDepth();
+
+	//the depth of the map and the cloud first, so the texture fetches and the lighting run once per pixel
+	bool prepass = depth_prepass && (mixed_scene || volume_index == 4);
+	if (prepass)
+		renderDepthPrepass();
+
+	//samples of the main pass that pass the depth test, the results are only read once available so it doesn't stall
+	if (samples_query_ids[0] == 0)
+		glGenQueries(2, samples_query_ids);
+	for (int i = 0; i < 2; ++i)
+	{
+		if (!samples_query_pending[i])
+			continue;
+		GLuint available = 0;
+		glGetQueryObjectuiv(samples_query_ids[i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			continue;
+		glGetQueryObjectuiv(samples_query_ids[i], GL_QUERY_RESULT, &samples_passed[samples_query_prepass[i] ? 1 : 0]);
+		samples_query_pending[i] = false;
+	}
+	samples_query_index = 1 - samples_query_index;
+	samples_query_prepass[samples_query_index] = prepass;
+	samples_query_pending[samples_query_index] = true;
+	glBeginQuery(GL_SAMPLES_PASSED, samples_query_ids[samples_query_index]);
+
+	//the map and the cloud, once per frame and before the volume so it is composited over them
+	if (mixed_scene || volume_index == 4)
+		renderOpaqueNodes(prepass);
+
+	//All the volume nodes composited in the same raymarch
+	if (volume_index == 5)
+	{
+		if (!multi_volume_renderer)
+			multi_volume_renderer = new MultiVolumeRenderer();
+		multi_volume_renderer->jittering = render_jittering;
+		multi_volume_renderer->render(root, camera);
+	}
+
 	//Iterate over all nodes
 	for (int i = 0; i < size(root); i++) {
 		root[4]->material->time = time;
@@ -159,29 +244,51 @@ void Application::render(void)
 			root[i]->material->jittering = render_jittering;
 			root[i]->material->gradient = render_gradient;
 
-			root[i]->render(camera);
+			VolumeMaterial* volume_material = dynamic_cast<VolumeMaterial*>(root[i]->material);
+			if (volume_material)
+				volume_material->opaque_depth = mixed_scene ? opaque_depth_fbo->depth_texture : NULL;
+
+			//Render the volume, the full scene was already drawn
+			if (i != 3)
+				root[i]->render(camera);
 
 			if (render_wireframe)
 				root[i]->renderWireframe(camera);
 
-			//Render full scene
-			if (i == 3)
-				root[i + 1]->render(camera);
-			
-
 			if (render_wireframe && i == 3)
 				root[i + 1]->renderWireframe(camera);
 			
 		}
 	}
 
+	glEndQuery(GL_SAMPLES_PASSED);
+
 	//Draw the floor grid
 	if(render_debug)
 		drawGrid();
+
+	//keep the converged frame (without the debugger) to reuse it while nothing changes
+	if (isConverged())
+	{
+		if (!frame_cache_fbo || frame_cache_fbo->width != window_width || frame_cache_fbo->height != window_height)
+		{
+			if (frame_cache_fbo)
+				delete frame_cache_fbo;
+			frame_cache_fbo = new FBO();
+			frame_cache_fbo->create(window_width, window_height);
+		}
+		frame_cache_fbo->color_textures[0]->bind();
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, window_width, window_height);
+		frame_cache_fbo->color_textures[0]->unbind();
+		frame_cached = true;
+	}
 }
 
 void Application::update(double seconds_elapsed)
 {
+	//the meshes requested with Mesh::GetAsync are sent to the VRAM here, in the GL thread
+	Mesh::processUploads();
+
 	float speed = seconds_elapsed * 10; //the speed is defined by the seconds_elapsed so it goes constant
 	float orbit_speed = seconds_elapsed * 0.5;
 	
@@ -191,11 +298,14 @@ void Application::update(double seconds_elapsed)
 		//root[i]->model.rotate(angle, Vector3(0,1,0));
 	}
 
+	updateDynamicResolution(seconds_elapsed);
+
 	//Change which node has to be rendered
 	if (Input::isKeyPressed(SDL_SCANCODE_1))		volume_index = 1;
 	else if (Input::isKeyPressed(SDL_SCANCODE_2))	volume_index = 2;
 	else if (Input::isKeyPressed(SDL_SCANCODE_3))	volume_index = 3;
 	else if (Input::isKeyPressed(SDL_SCANCODE_4))	volume_index = 4;
+	else if (Input::isKeyPressed(SDL_SCANCODE_5))	volume_index = 5;
 
 	//mouse input to rotate the cam
 	if ((Input::mouse_state & SDL_BUTTON_LEFT && !ImGui::IsAnyWindowHovered() 
@@ -212,11 +322,117 @@ void Application::update(double seconds_elapsed)
 	if (Input::isKeyPressed(SDL_SCANCODE_D) || Input::isKeyPressed(SDL_SCANCODE_RIGHT)) camera->move(Vector3(-1.0f, 0.0f, 0.0f) * speed);
 	if (Input::isKeyPressed(SDL_SCANCODE_SPACE)) camera->moveGlobal(Vector3(0.0f, -1.0f, 0.0f) * speed);
 	if (Input::isKeyPressed(SDL_SCANCODE_LCTRL)) camera->moveGlobal(Vector3(0.0f,  1.0f, 0.0f) * speed);
+
+	if (camera_follow_ground && terrain)
+		terrain->followGround(camera, camera_ground_distance);
 	
 
 	//to navigate with the mouse fixed in the middle
 	if (mouse_locked)
 		Input::centerMouse();
+
+	updateInteraction();
+}
+
+//Any change of the camera, the selected node or the debugger values restarts the progressive refinement
+void Application::updateInteraction()
+{
+	bool camera_changed = memcmp(last_viewprojection.m, camera->viewprojection_matrix.m, sizeof(last_viewprojection.m)) != 0;
+	interacting = camera_changed || volume_index != last_volume_index || ImGui::IsAnyItemActive();
+
+	last_viewprojection = camera->viewprojection_matrix;
+	last_volume_index = volume_index;
+
+	if (interacting)
+	{
+		idle_frames = 0;
+		frame_cached = false;
+	}
+	else
+		idle_frames++;
+}
+
+//The volumes have accumulated all their frames (plus one to draw the final image)
+bool Application::isConverged()
+{
+	//only the volumes accumulate, the other scenes are drawn every frame
+	bool volume_scene = (volume_index >= 1 && volume_index <= 3) || volume_index == 5;
+	if (!progressive_rendering || !volume_scene)
+		return false;
+
+	//materials animated with the time change every frame, so a frame with them is never final
+	bool opaque_visible = render_scene_with_volume && volume_index <= 3;
+	for (int i = 3; opaque_visible && i < (int)root.size(); ++i)
+		if (dynamic_cast<CloudMaterial*>(root[i]->material))
+			return false;
+
+	return idle_frames > progressive_frames + 1;
+}
+
+//Depth pre-pass of the opaque nodes (map and cloud), used by the volumes to end the rays at them
+void Application::renderOpaqueDepth()
+{
+	if (!opaque_depth_fbo || opaque_depth_fbo->width != window_width || opaque_depth_fbo->height != window_height)
+	{
+		if (opaque_depth_fbo)
+			delete opaque_depth_fbo;
+		opaque_depth_fbo = new FBO();
+		opaque_depth_fbo->create(window_width, window_height);
+	}
+
+	opaque_depth_fbo->bind();
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	root[3]->renderDepth(camera);
+	root[4]->renderDepth(camera);
+
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	opaque_depth_fbo->unbind();
+}
+
+void Application::renderDepthPrepass()
+{
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	root[3]->renderDepth(camera);
+	root[4]->renderDepth(camera);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+//The map and the cloud. After the pre-pass only the closest fragment of every pixel passes the depth test
+void Application::renderOpaqueNodes(bool after_prepass)
+{
+	if (after_prepass)
+	{
+		glDepthFunc(GL_EQUAL);
+		glDepthMask(GL_FALSE);
+	}
+
+	root[3]->render(camera);
+	root[4]->render(camera);
+
+	if (after_prepass)
+	{
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+	}
+}
+
+//Scales the resolution of the volumes in dynamic mode so the frame time stays close to the target
+void Application::updateDynamicResolution(double seconds_elapsed)
+{
+	if (seconds_elapsed <= 0.0)
+		return;
+
+	//smooth it so a single slow frame does not make it oscillate
+	smoothed_frame_time = lerp(smoothed_frame_time, (float)seconds_elapsed, 0.1f);
+
+	if (smoothed_frame_time > target_frame_time * 1.05f)
+		dynamic_resolution_scale *= 0.95f;
+	else if (smoothed_frame_time < target_frame_time * 0.85f)
+		dynamic_resolution_scale *= 1.02f;
+
+	dynamic_resolution_scale = clamp(dynamic_resolution_scale, 0.25f, 1.0f);
 }
 
 //Keyboard event handler (sync input)
@@ -282,5 +498,7 @@ void Application::onResize(int width, int height)
 	camera->aspect =  width / (float)height;
 	window_width = width;
 	window_height = height;
+	idle_frames = 0;
+	frame_cached = false;
 }
 
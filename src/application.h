@@ -9,6 +9,10 @@
 #include "camera.h"
 #include "utils.h"
 #include "scenenode.h"
+#include "volumerenderer.h"
+
+class FBO;
+class Terrain;
 
 class Application
 {
@@ -33,6 +37,38 @@ public:
 	bool render_jittering;
 	bool render_gradient;
 
+	//dynamic resolution of the volume pass, adjusted to hold the target frame time
+	float dynamic_resolution_scale;
+	float target_frame_time;
+	float smoothed_frame_time;
+
+	//show the map and the cloud together with the volumes, their depth is written first so the rays stop at them
+	bool render_scene_with_volume;
+	FBO* opaque_depth_fbo;
+
+	//the opaque nodes write only their depth first, then the main pass shades just the visible fragments (GL_EQUAL)
+	bool depth_prepass;
+	unsigned int samples_query_ids[2]; //double buffered, the one of the previous frame is read while the other runs
+	bool samples_query_pending[2];
+	bool samples_query_prepass[2]; //mode of each query, to know which result it updates
+	int samples_query_index;
+	unsigned int samples_passed[2]; //samples of the main pass that pass the depth test, without and with the pre-pass
+
+	//progressive refinement: coarse frames while there is input, the volumes converge while idle and the frame is reused
+	bool progressive_rendering;
+	bool interacting;
+	int idle_frames;
+	int progressive_frames; //accumulated frames until the image is considered converged
+	Matrix44 last_viewprojection;
+	int last_volume_index;
+	FBO* frame_cache_fbo;
+	bool frame_cached;
+
+	//the camera can't go under the ground of the map
+	Terrain* terrain;
+	bool camera_follow_ground;
+	float camera_ground_distance;
+
 	//some vars
 	static Camera* camera; //our GLOBAL camera
 	bool mouse_locked; //tells if the mouse is locked (not seen)
@@ -42,7 +78,13 @@ public:
 
 	//main functions
 	void render( void );
+	void renderOpaqueDepth( void );
+	void renderDepthPrepass( void );
+	void renderOpaqueNodes( bool after_prepass );
 	void update( double dt );
+	void updateDynamicResolution( double dt );
+	void updateInteraction();
+	bool isConverged();
 
 	//events
 	void onKeyDown( SDL_KeyboardEvent event );
@@ -56,6 +98,9 @@ public:
 
 	//Change volumes
 	int volume_index = 1; 
+
+	//key 5 shows all the volumes together in a single pass
+	MultiVolumeRenderer* multi_volume_renderer;
 };
 
 
@@ -0,0 +1,513 @@
+#include "bvh.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <thread>
+#include <cfloat>
+#include <cmath>
+#include <xmmintrin.h>
+
+#define BVH_BINS 16
+#define BVH_PARALLEL_MIN_TRIANGLES 4096 //smaller subtrees are not worth a task
+
+//the framework ones are not inlined and the traversal calls them a lot
+static inline Vector3 sub(const Vector3& a, const Vector3& b) { return Vector3(a.x - b.x, a.y - b.y, a.z - b.z); }
+static inline float dot3(const Vector3& a, const Vector3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline Vector3 cross3(const Vector3& a, const Vector3& b) { return Vector3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x); }
+
+struct sBuildTriangle {
+	Vector3 min;
+	Vector3 max;
+	Vector3 centroid;
+};
+
+//binary node, only used while building
+struct sBuildNode {
+	Vector3 min;
+	Vector3 max;
+	unsigned int first;
+	unsigned int count;
+	sBuildNode* children[2];
+
+	sBuildNode(unsigned int first, unsigned int count) { this->first = first; this->count = count; children[0] = children[1] = NULL; }
+	~sBuildNode() { delete children[0]; delete children[1]; }
+	bool isLeaf() const { return children[0] == NULL; }
+	float area() const;
+};
+
+static inline float boxArea(const Vector3& min, const Vector3& max)
+{
+	Vector3 d = sub(max, min);
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static inline void growBox(Vector3& min, Vector3& max, const Vector3& other_min, const Vector3& other_max)
+{
+	min.set(std::min(min.x, other_min.x), std::min(min.y, other_min.y), std::min(min.z, other_min.z));
+	max.set(std::max(max.x, other_max.x), std::max(max.y, other_max.y), std::max(max.z, other_max.z));
+}
+
+float sBuildNode::area() const { return boxArea(min, max); }
+
+static void computeNodeBounds(sBuildNode* node, const std::vector<sBuildTriangle>& bounds, const std::vector<unsigned int>& order)
+{
+	node->min.set(FLT_MAX, FLT_MAX, FLT_MAX);
+	node->max.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (unsigned int i = node->first; i < node->first + node->count; ++i)
+		growBox(node->min, node->max, bounds[order[i]].min, bounds[order[i]].max);
+}
+
+//binned SAH split, returns false if the node should stay as a leaf
+static bool splitNode(sBuildNode* node, const std::vector<sBuildTriangle>& bounds, std::vector<unsigned int>& order)
+{
+	if (node->count <= BVH_MAX_LEAF_TRIANGLES)
+		return false;
+
+	Vector3 cmin(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vector3 cmax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (unsigned int i = node->first; i < node->first + node->count; ++i)
+		growBox(cmin, cmax, bounds[order[i]].centroid, bounds[order[i]].centroid);
+
+	//cost of a leaf against two children, the traversal of a node costs like one triangle
+	float best_cost = node->count * node->area();
+	int best_axis = -1;
+	int best_split = 0;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float extent = cmax.v[axis] - cmin.v[axis];
+		if (extent <= 0.0f)
+			continue;
+		float to_bin = BVH_BINS / extent;
+
+		unsigned int bin_count[BVH_BINS] = { 0 };
+		Vector3 bin_min[BVH_BINS];
+		Vector3 bin_max[BVH_BINS];
+		for (int b = 0; b < BVH_BINS; ++b)
+		{
+			bin_min[b].set(FLT_MAX, FLT_MAX, FLT_MAX);
+			bin_max[b].set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		}
+		for (unsigned int i = node->first; i < node->first + node->count; ++i)
+		{
+			const sBuildTriangle& t = bounds[order[i]];
+			int b = std::min(BVH_BINS - 1, (int)((t.centroid.v[axis] - cmin.v[axis]) * to_bin));
+			bin_count[b]++;
+			growBox(bin_min[b], bin_max[b], t.min, t.max);
+		}
+
+		//sweep from the right to have the cost of every right side, then from the left
+		float right_area[BVH_BINS];
+		unsigned int right_count[BVH_BINS];
+		Vector3 accum_min(FLT_MAX, FLT_MAX, FLT_MAX);
+		Vector3 accum_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		unsigned int count = 0;
+		for (int b = BVH_BINS - 1; b > 0; --b)
+		{
+			growBox(accum_min, accum_max, bin_min[b], bin_max[b]);
+			count += bin_count[b];
+			right_count[b] = count;
+			right_area[b] = count ? boxArea(accum_min, accum_max) : 0.0f;
+		}
+
+		accum_min.set(FLT_MAX, FLT_MAX, FLT_MAX);
+		accum_max.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		count = 0;
+		for (int b = 0; b < BVH_BINS - 1; ++b)
+		{
+			growBox(accum_min, accum_max, bin_min[b], bin_max[b]);
+			count += bin_count[b];
+			if (!count || !right_count[b + 1])
+				continue;
+			float cost = node->area() + boxArea(accum_min, accum_max) * count + right_area[b + 1] * right_count[b + 1];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b + 1;
+			}
+		}
+	}
+
+	unsigned int* begin = &order[node->first];
+	unsigned int* end = begin + node->count;
+	unsigned int* middle = NULL;
+	if (best_axis != -1)
+	{
+		float to_bin = BVH_BINS / (cmax.v[best_axis] - cmin.v[best_axis]);
+		middle = std::partition(begin, end, [&](unsigned int t) {
+			return std::min(BVH_BINS - 1, (int)((bounds[t].centroid.v[best_axis] - cmin.v[best_axis]) * to_bin)) < best_split;
+		});
+	}
+	else if (node->count > BVH_MAX_LEAF_TRIANGLES * 4)
+	{
+		//no split is better than a leaf but it is too big, split in half by the longest axis
+		Vector3 extent = sub(cmax, cmin);
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		middle = begin + node->count / 2;
+		std::nth_element(begin, middle, end, [&](unsigned int a, unsigned int b) { return bounds[a].centroid.v[axis] < bounds[b].centroid.v[axis]; });
+	}
+	else
+		return false;
+
+	unsigned int left_count = middle - begin;
+	if (left_count == 0 || left_count == node->count)
+		left_count = node->count / 2;
+
+	node->children[0] = new sBuildNode(node->first, left_count);
+	node->children[1] = new sBuildNode(node->first + left_count, node->count - left_count);
+	computeNodeBounds(node->children[0], bounds, order);
+	computeNodeBounds(node->children[1], bounds, order);
+	return true;
+}
+
+static void buildSubtree(sBuildNode* node, const std::vector<sBuildTriangle>& bounds, std::vector<unsigned int>& order)
+{
+	if (!splitNode(node, bounds, order))
+		return;
+	buildSubtree(node->children[0], bounds, order);
+	buildSubtree(node->children[1], bounds, order);
+}
+
+//collapses the binary tree in nodes of 4 children, stored depth first so the children are close to their parent
+static int flattenNode(const sBuildNode* node, BVH* bvh, const std::vector<BVH::sTriangle>& source, const std::vector<unsigned int>& order, int level)
+{
+	bvh->depth = std::max(bvh->depth, level);
+	std::vector<const sBuildNode*> children;
+	if (node->isLeaf())
+		children.push_back(node);
+	else
+	{
+		children.push_back(node->children[0]);
+		children.push_back(node->children[1]);
+	}
+
+	//open the biggest inner children until there are 4
+	while (children.size() < 4)
+	{
+		int best = -1;
+		for (size_t i = 0; i < children.size(); ++i)
+			if (!children[i]->isLeaf() && (best == -1 || children[i]->area() > children[best]->area()))
+				best = i;
+		if (best == -1)
+			break;
+		const sBuildNode* opened = children[best];
+		children[best] = opened->children[0];
+		children.push_back(opened->children[1]);
+	}
+
+	int index = bvh->nodes.size();
+	bvh->nodes.push_back(BVH::sNode());
+	for (int i = 0; i < 4; ++i)
+	{
+		BVH::sNode& n = bvh->nodes[index];
+		if (i >= (int)children.size())
+		{
+			n.min_x[i] = n.min_y[i] = n.min_z[i] = FLT_MAX;
+			n.max_x[i] = n.max_y[i] = n.max_z[i] = -FLT_MAX;
+			n.child[i] = 0;
+			n.count[i] = -1;
+			continue;
+		}
+
+		const sBuildNode* c = children[i];
+		n.min_x[i] = c->min.x; n.min_y[i] = c->min.y; n.min_z[i] = c->min.z;
+		n.max_x[i] = c->max.x; n.max_y[i] = c->max.y; n.max_z[i] = c->max.z;
+		if (c->isLeaf())
+		{
+			n.child[i] = bvh->triangles.size();
+			n.count[i] = c->count;
+			for (unsigned int j = c->first; j < c->first + c->count; ++j)
+			{
+				bvh->triangles.push_back(source[order[j]]);
+				bvh->triangle_ids.push_back(order[j]);
+			}
+		}
+		else
+		{
+			int child = flattenNode(c, bvh, source, order, level + 1); //nodes can be reallocated here
+			bvh->nodes[index].child[i] = child;
+			bvh->nodes[index].count[i] = 0;
+		}
+	}
+	return index;
+}
+
+bool BVH::build(const Vector3* vertices, unsigned int stride, const unsigned int* indices, unsigned int num_triangles)
+{
+	nodes.clear();
+	triangles.clear();
+	triangle_ids.clear();
+	depth = 0;
+	if (!vertices || !num_triangles)
+		return false;
+
+	#define VERTEX(i) (*(const Vector3*)((const char*)vertices + (size_t)(indices ? indices[i] : (i)) * stride))
+
+	std::vector<sTriangle> source(num_triangles);
+	std::vector<sBuildTriangle> bounds(num_triangles);
+	std::vector<unsigned int> order(num_triangles);
+	for (unsigned int i = 0; i < num_triangles; ++i)
+	{
+		const Vector3& a = VERTEX(i * 3);
+		const Vector3& b = VERTEX(i * 3 + 1);
+		const Vector3& c = VERTEX(i * 3 + 2);
+		source[i].v0 = a;
+		source[i].edge1 = sub(b, a);
+		source[i].edge2 = sub(c, a);
+		bounds[i].min.set(std::min(a.x, std::min(b.x, c.x)), std::min(a.y, std::min(b.y, c.y)), std::min(a.z, std::min(b.z, c.z)));
+		bounds[i].max.set(std::max(a.x, std::max(b.x, c.x)), std::max(a.y, std::max(b.y, c.y)), std::max(a.z, std::max(b.z, c.z)));
+		bounds[i].centroid.set((a.x + b.x + c.x) / 3.0f, (a.y + b.y + c.y) / 3.0f, (a.z + b.z + c.z) / 3.0f);
+		order[i] = i;
+	}
+	#undef VERTEX
+
+	sBuildNode root(0, num_triangles);
+	computeNodeBounds(&root, bounds, order);
+
+	//the top levels are split here until there are enough subtrees to keep all the cores busy
+	size_t num_tasks = std::max(1u, std::thread::hardware_concurrency()) * 4;
+	std::vector<sBuildNode*> pending(1, &root);
+	while (pending.size() < num_tasks)
+	{
+		size_t biggest = 0;
+		for (size_t i = 1; i < pending.size(); ++i)
+			if (pending[i]->count > pending[biggest]->count)
+				biggest = i;
+		sBuildNode* node = pending[biggest];
+		if (node->count < BVH_PARALLEL_MIN_TRIANGLES)
+			break;
+		pending.erase(pending.begin() + biggest);
+		if (splitNode(node, bounds, order))
+		{
+			pending.push_back(node->children[0]);
+			pending.push_back(node->children[1]);
+		}
+	}
+
+	//every subtree works on its own range of the order, so they can be built at the same time
+	parallelFor((int)pending.size(), [&](int i) {
+		buildSubtree(pending[i], bounds, order);
+	});
+
+	nodes.reserve(num_triangles / 4 + 1);
+	triangles.reserve(num_triangles);
+	triangle_ids.reserve(num_triangles);
+	flattenNode(&root, this, source, order, 1);
+	return true;
+}
+
+static inline bool rayTriangle(const BVH::sTriangle& tri, const Vector3& origin, const Vector3& direction, float& t)
+{
+	//Moller-Trumbore, both sides
+	Vector3 pvec = cross3(direction, tri.edge2);
+	float det = dot3(tri.edge1, pvec);
+	if (fabs(det) < 1e-12f)
+		return false;
+	float inv_det = 1.0f / det;
+	Vector3 tvec = sub(origin, tri.v0);
+	float u = dot3(tvec, pvec) * inv_det;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+	Vector3 qvec = cross3(tvec, tri.edge1);
+	float v = dot3(direction, qvec) * inv_det;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+	t = dot3(tri.edge2, qvec) * inv_det;
+	return t >= 0.0f;
+}
+
+bool BVH::testRay(const Vector3& origin, const Vector3& direction, float max_t, float& t, unsigned int& triangle) const
+{
+	if (nodes.empty())
+		return false;
+
+	//a zero component would give infinities and NaNs in the slabs
+	Vector3 inv_dir;
+	for (int i = 0; i < 3; ++i)
+		inv_dir.v[i] = fabs(direction.v[i]) > 1e-20f ? 1.0f / direction.v[i] : (direction.v[i] >= 0.0f ? 1e20f : -1e20f);
+
+	__m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	__m128 ix = _mm_set1_ps(inv_dir.x), iy = _mm_set1_ps(inv_dir.y), iz = _mm_set1_ps(inv_dir.z);
+	__m128 zero = _mm_setzero_ps();
+
+	float best = max_t;
+	bool found = false;
+	//every level leaves at most 3 siblings waiting, deeper trees than the local stack use the heap
+	int local_stack[64];
+	std::vector<int> heap_stack;
+	int* stack = local_stack;
+	if (3 * depth + 1 > 64)
+	{
+		heap_stack.resize(3 * depth + 1);
+		stack = heap_stack.data();
+	}
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		const sNode& node = nodes[stack[--stack_size]];
+
+		//the 4 slab tests at once
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x), ox), ix);
+		__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_x), ox), ix);
+		__m128 tmin = _mm_min_ps(t1, t2);
+		__m128 tmax = _mm_max_ps(t1, t2);
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y), oy), iy);
+		t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_y), oy), iy);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z), oz), iz);
+		t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_z), oz), iz);
+		tmin = _mm_max_ps(_mm_max_ps(tmin, _mm_min_ps(t1, t2)), zero);
+		tmax = _mm_min_ps(_mm_min_ps(tmax, _mm_max_ps(t1, t2)), _mm_set1_ps(best));
+		int hits = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+		if (!hits)
+			continue;
+
+		float entry[4];
+		_mm_storeu_ps(entry, tmin);
+
+		//leaves are tested now, inner nodes are pushed with the closest on top
+		int inner[4];
+		int num_inner = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (!(hits & (1 << i)) || node.count[i] < 0)
+				continue;
+			if (node.count[i] == 0)
+			{
+				inner[num_inner++] = i;
+				continue;
+			}
+			for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+			{
+				float hit_t;
+				if (rayTriangle(triangles[j], origin, direction, hit_t) && hit_t < best)
+				{
+					best = hit_t;
+					triangle = j;
+					found = true;
+				}
+			}
+		}
+
+		std::sort(inner, inner + num_inner, [&](int a, int b) { return entry[a] > entry[b]; });
+		for (int i = 0; i < num_inner; ++i)
+			if (entry[inner[i]] <= best)
+				stack[stack_size++] = node.child[inner[i]];
+	}
+
+	t = best;
+	return found;
+}
+
+//closest point of a triangle to p (Ericson, Real-Time Collision Detection 5.1.5)
+static Vector3 closestPointInTriangle(const Vector3& p, const BVH::sTriangle& tri)
+{
+	const Vector3& a = tri.v0;
+	const Vector3& ab = tri.edge1;
+	const Vector3& ac = tri.edge2;
+	Vector3 ap = sub(p, a);
+	float d1 = dot3(ab, ap), d2 = dot3(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f)
+		return a;
+
+	Vector3 bp = sub(ap, ab);
+	float d3 = dot3(ab, bp), d4 = dot3(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3)
+		return Vector3(a.x + ab.x, a.y + ab.y, a.z + ab.z);
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+	{
+		float v = d1 / (d1 - d3);
+		return Vector3(a.x + ab.x * v, a.y + ab.y * v, a.z + ab.z * v);
+	}
+
+	Vector3 cp = sub(ap, ac);
+	float d5 = dot3(ab, cp), d6 = dot3(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6)
+		return Vector3(a.x + ac.x, a.y + ac.y, a.z + ac.z);
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+	{
+		float w = d2 / (d2 - d6);
+		return Vector3(a.x + ac.x * w, a.y + ac.y * w, a.z + ac.z * w);
+	}
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+	{
+		float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		return Vector3(a.x + ab.x + (ac.x - ab.x) * w, a.y + ab.y + (ac.y - ab.y) * w, a.z + ab.z + (ac.z - ab.z) * w);
+	}
+
+	float denom = 1.0f / (va + vb + vc);
+	float v = vb * denom;
+	float w = vc * denom;
+	return Vector3(a.x + ab.x * v + ac.x * w, a.y + ab.y * v + ac.y * w, a.z + ab.z * v + ac.z * w);
+}
+
+bool BVH::testSphere(const Vector3& center, float radius, Vector3& collision, unsigned int& triangle) const
+{
+	if (nodes.empty())
+		return false;
+
+	__m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+	__m128 zero = _mm_setzero_ps();
+
+	float best = radius * radius;
+	bool found = false;
+	//every level leaves at most 3 siblings waiting, deeper trees than the local stack use the heap
+	int local_stack[64];
+	std::vector<int> heap_stack;
+	int* stack = local_stack;
+	if (3 * depth + 1 > 64)
+	{
+		heap_stack.resize(3 * depth + 1);
+		stack = heap_stack.data();
+	}
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		const sNode& node = nodes[stack[--stack_size]];
+
+		//squared distance from the center to the 4 boxes
+		__m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x), cx), _mm_sub_ps(cx, _mm_loadu_ps(node.max_x))), zero);
+		__m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y), cy), _mm_sub_ps(cy, _mm_loadu_ps(node.max_y))), zero);
+		__m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z), cz), _mm_sub_ps(cz, _mm_loadu_ps(node.max_z))), zero);
+		__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		int hits = _mm_movemask_ps(_mm_cmple_ps(dist2, _mm_set1_ps(best)));
+
+		for (int i = 0; i < 4; ++i)
+		{
+			if (!(hits & (1 << i)) || node.count[i] < 0)
+				continue;
+			if (node.count[i] == 0)
+			{
+				stack[stack_size++] = node.child[i];
+				continue;
+			}
+			for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+			{
+				Vector3 point = closestPointInTriangle(center, triangles[j]);
+				Vector3 d = sub(point, center);
+				float d2 = dot3(d, d);
+				if (d2 <= best)
+				{
+					best = d2;
+					collision = point;
+					triangle = j;
+					found = true;
+				}
+			}
+		}
+	}
+
+	return found;
+}
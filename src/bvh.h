@@ -0,0 +1,43 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "framework.h"
+#include <vector>
+
+#define BVH_MAX_LEAF_TRIANGLES 4
+
+//Bounding volume hierarchy of the triangles of a mesh, used for the ray and sphere collisions
+//It is built with the surface area heuristic and stored as a flat array of nodes with 4 children,
+//so one SSE test checks the 4 boxes at once
+class BVH
+{
+public:
+	//the boxes of the 4 children, as SoA so they can be loaded in SSE registers
+	struct sNode {
+		float min_x[4], min_y[4], min_z[4];
+		float max_x[4], max_y[4], max_z[4];
+		int child[4]; //node index for inner children, first triangle for leaves
+		int count[4]; //triangles of a leaf, 0 for an inner child, -1 for an empty slot
+	};
+
+	//triangle ready for the intersection test
+	struct sTriangle {
+		Vector3 v0;
+		Vector3 edge1;
+		Vector3 edge2;
+	};
+
+	std::vector<sNode> nodes; //the root is the first one
+	std::vector<sTriangle> triangles; //in the order of the leaves
+	std::vector<unsigned int> triangle_ids; //original index of every triangle
+	int depth = 0; //levels of nodes, the traversal stack needs 3 * depth + 1 entries
+
+	//indices can be NULL for triangle soups, stride is the distance in bytes between vertices
+	bool build(const Vector3* vertices, unsigned int stride, const unsigned int* indices, unsigned int num_triangles);
+
+	//in object space, t is in units of direction. triangle is the index in triangles, triangle_ids has the original one
+	bool testRay(const Vector3& origin, const Vector3& direction, float max_t, float& t, unsigned int& triangle) const;
+	bool testSphere(const Vector3& center, float radius, Vector3& collision, unsigned int& triangle) const;
+};
+
+#endif
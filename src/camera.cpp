@@ -307,6 +307,11 @@ float Camera::getProjectedScale(Vector3 pos3D, float radius) {
 	return ((float)sin(fov*DEG2RAD) / dist) * radius * 200.0f; //100 is to compensate width in pixels
 }
 
+float Camera::getProjectedPixels(Vector3 pos3D, float size, float window_height) {
+	float dist = eye.distance(pos3D);
+	return size * window_height / (2.0f * (float)tan(fov * 0.5f * DEG2RAD) * dist);
+}
+
 
 char Camera::testSphereInFrustum( const Vector3& v, float radius)
 {
@@ -1213,6 +1213,37 @@ Vector3 RayPlaneCollision(const Vector3& plane_pos, const Vector3& plane_normal,
 	return ray_origin + ray_dir * t;
 }
 
+bool RayBoxCollision(const Vector3& box_min, const Vector3& box_max, const Vector3& ray_origin, const Vector3& ray_dir, float& t_entry, float& t_exit)
+{
+	t_entry = -3.4e+38F;
+	t_exit = 3.4e+38F;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		if (fabs(ray_dir.v[i]) < 1e-8)
+		{
+			//parallel to the slab, it must start inside it
+			if (ray_origin.v[i] < box_min.v[i] || ray_origin.v[i] > box_max.v[i])
+				return false;
+			continue;
+		}
+
+		float inv_dir = 1.0f / ray_dir.v[i];
+		float t0 = (box_min.v[i] - ray_origin.v[i]) * inv_dir;
+		float t1 = (box_max.v[i] - ray_origin.v[i]) * inv_dir;
+		if (t0 > t1)
+		{
+			float tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+		t_entry = t0 > t_entry ? t0 : t_entry;
+		t_exit = t1 < t_exit ? t1 : t_exit;
+	}
+
+	return t_exit >= t_entry && t_exit >= 0.0f;
+}
+
 Vector3 normalize(Vector3 n)
 {
 	return n.normalize();
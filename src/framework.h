@@ -367,6 +367,7 @@ int planeBoxOverlap( const Vector4& plane, const Vector3& center, const Vector3&
 float ComputeSignedAngle( Vector2 a, Vector2 b); //returns the angle between both vectors in radians
 inline float ease(float f) { return f*f*f*(f*(f*6.0f - 15.0f) + 10.0f); }
 Vector3 RayPlaneCollision( const Vector3& plane_pos, const Vector3& plane_normal, const Vector3& ray_origin, const Vector3& ray_dir );
+bool RayBoxCollision( const Vector3& box_min, const Vector3& box_max, const Vector3& ray_origin, const Vector3& ray_dir, float& t_entry, float& t_exit ); //slab test, returns the ray parameters where it enters and leaves the box
 Vector3 reflect(const Vector3& I, const Vector3& N);
 
 //value between 0 and 1
@@ -0,0 +1,293 @@
+#include "heightfield.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+bool HeightField::create(Image* image, float size, float altitude)
+{
+	assert(image && image->data && "image without data");
+	this->size = size;
+	this->altitude = altitude;
+	width = image->width;
+	height = image->height;
+
+	//same height than the one computed in the shaders
+	heights.resize(width * height);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+		{
+			Color c = image->getPixel(x, y);
+			heights[y * width + x] = ((c.x * 0.299f + c.y * 0.587f + c.z * 0.114f) / 255.0f) * altitude;
+		}
+
+	buildMaxMips();
+	return true;
+}
+
+void HeightField::buildMaxMips()
+{
+	mips.clear();
+	min_height = *std::min_element(heights.begin(), heights.end());
+
+	sMaxMip cells;
+	cells.width = std::max(width - 1, 1);
+	cells.height = std::max(height - 1, 1);
+	cells.max_heights.resize(cells.width * cells.height);
+	for (int y = 0; y < cells.height; ++y)
+		for (int x = 0; x < cells.width; ++x)
+		{
+			int x1 = std::min(x + 1, width - 1), y1 = std::min(y + 1, height - 1);
+			cells.max_heights[y * cells.width + x] = std::max(std::max(getPixel(x, y), getPixel(x1, y)), std::max(getPixel(x, y1), getPixel(x1, y1)));
+		}
+	mips.push_back(cells);
+
+	//every level halves the previous one until there is only one cell
+	while (mips.back().width > 1 || mips.back().height > 1)
+	{
+		const sMaxMip& prev = mips.back();
+		sMaxMip mip;
+		mip.width = (prev.width + 1) / 2;
+		mip.height = (prev.height + 1) / 2;
+		mip.max_heights.resize(mip.width * mip.height);
+		for (int y = 0; y < mip.height; ++y)
+			for (int x = 0; x < mip.width; ++x)
+			{
+				float max_height = -FLT_MAX;
+				for (int j = y * 2; j < std::min(y * 2 + 2, prev.height); ++j)
+					for (int i = x * 2; i < std::min(x * 2 + 2, prev.width); ++i)
+						max_height = std::max(max_height, prev.max_heights[j * prev.width + i]);
+				mip.max_heights[y * mip.width + x] = max_height;
+			}
+		mips.push_back(mip);
+	}
+}
+
+float HeightField::getPixelHeight(float x, float y) const
+{
+	x = clamp(x, 0.0f, (float)(width - 1));
+	y = clamp(y, 0.0f, (float)(height - 1));
+	int x0 = (int)x, y0 = (int)y;
+	int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+	float fx = x - x0, fy = y - y0;
+	float h0 = getPixel(x0, y0) * (1.0f - fx) + getPixel(x1, y0) * fx;
+	float h1 = getPixel(x0, y1) * (1.0f - fx) + getPixel(x1, y1) * fx;
+	return h0 * (1.0f - fy) + h1 * fy;
+}
+
+float HeightField::getHeight(float x, float z) const
+{
+	return getPixelHeight((z / size + 0.5f) * width - 0.5f, (x / size + 0.5f) * height - 0.5f);
+}
+
+Vector3 HeightField::getNormal(float x, float z) const
+{
+	float gx = clamp((z / size + 0.5f) * width - 0.5f, 0.0f, (float)(width - 1));
+	float gy = clamp((x / size + 0.5f) * height - 0.5f, 0.0f, (float)(height - 1));
+	int x0 = (int)gx, y0 = (int)gy;
+	int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+	float fx = gx - x0, fy = gy - y0;
+
+	//slope of the bilinear patch along the columns (z) and the rows (x)
+	float slope_z = ((getPixel(x1, y0) - getPixel(x0, y0)) * (1.0f - fy) + (getPixel(x1, y1) - getPixel(x0, y1)) * fy) * width / size;
+	float slope_x = ((getPixel(x0, y1) - getPixel(x0, y0)) * (1.0f - fx) + (getPixel(x1, y1) - getPixel(x1, y0)) * fx) * height / size;
+	Vector3 normal(-slope_x, 1.0f, -slope_z);
+	return normal.normalize();
+}
+
+//bilinear of 4 positions in pixels at once
+static __m128 sampleBilinear4(const HeightField& field, __m128 gx, __m128 gy)
+{
+	__m128 zero = _mm_setzero_ps();
+	gx = _mm_min_ps(_mm_max_ps(gx, zero), _mm_set1_ps((float)(field.width - 1)));
+	gy = _mm_min_ps(_mm_max_ps(gy, zero), _mm_set1_ps((float)(field.height - 1)));
+	__m128i ix = _mm_cvttps_epi32(gx);
+	__m128i iy = _mm_cvttps_epi32(gy);
+	__m128 fx = _mm_sub_ps(gx, _mm_cvtepi32_ps(ix));
+	__m128 fy = _mm_sub_ps(gy, _mm_cvtepi32_ps(iy));
+
+	//there is no gather in SSE, the 4 corners are read one by one
+	int x0[4], y0[4];
+	_mm_storeu_si128((__m128i*)x0, ix);
+	_mm_storeu_si128((__m128i*)y0, iy);
+	float h00[4], h10[4], h01[4], h11[4];
+	for (int k = 0; k < 4; ++k)
+	{
+		int x1 = std::min(x0[k] + 1, field.width - 1), y1 = std::min(y0[k] + 1, field.height - 1);
+		h00[k] = field.getPixel(x0[k], y0[k]);
+		h10[k] = field.getPixel(x1, y0[k]);
+		h01[k] = field.getPixel(x0[k], y1);
+		h11[k] = field.getPixel(x1, y1);
+	}
+
+	__m128 a = _mm_loadu_ps(h00), b = _mm_loadu_ps(h10), c = _mm_loadu_ps(h01), d = _mm_loadu_ps(h11);
+	__m128 h0 = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), fx));
+	__m128 h1 = _mm_add_ps(c, _mm_mul_ps(_mm_sub_ps(d, c), fx));
+	return _mm_add_ps(h0, _mm_mul_ps(_mm_sub_ps(h1, h0), fy));
+}
+
+void HeightField::getHeights(const Vector3* points, float* result, int count) const
+{
+	__m128 scale_x = _mm_set1_ps(width / size), offset_x = _mm_set1_ps(width * 0.5f - 0.5f);
+	__m128 scale_y = _mm_set1_ps(height / size), offset_y = _mm_set1_ps(height * 0.5f - 0.5f);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		float xs[4], zs[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			xs[k] = points[i + k].x;
+			zs[k] = points[i + k].z;
+		}
+
+		//columns go with z and rows with x
+		__m128 gx = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(zs), scale_x), offset_x);
+		__m128 gy = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(xs), scale_y), offset_y);
+		_mm_storeu_ps(result + i, sampleBilinear4(*this, gx, gy));
+	}
+
+	for (; i < count; ++i)
+		result[i] = getHeight(points[i].x, points[i].z);
+}
+
+void HeightField::getHeightsAtUVs(const Vector2* uvs, unsigned int stride, float* result, int count) const
+{
+	__m128 scale_x = _mm_set1_ps((float)width), scale_y = _mm_set1_ps((float)height), half = _mm_set1_ps(0.5f);
+	const char* data = (const char*)uvs;
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		float us[4], vs[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			const Vector2& uv = *(const Vector2*)(data + (i + k) * stride);
+			us[k] = uv.x;
+			vs[k] = uv.y;
+		}
+		__m128 gx = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(us), scale_x), half);
+		__m128 gy = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(vs), scale_y), half);
+		_mm_storeu_ps(result + i, sampleBilinear4(*this, gx, gy));
+	}
+
+	for (; i < count; ++i)
+	{
+		const Vector2& uv = *(const Vector2*)(data + i * stride);
+		result[i] = getPixelHeight(uv.x * width - 0.5f, uv.y * height - 0.5f);
+	}
+}
+
+static bool rayBox(const Vector3& origin, const Vector3& inv_direction, const Vector3& box_min, const Vector3& box_max, float max_t, float& t)
+{
+	float t1 = (box_min.x - origin.x) * inv_direction.x, t2 = (box_max.x - origin.x) * inv_direction.x;
+	float tmin = std::min(t1, t2), tmax = std::max(t1, t2);
+	t1 = (box_min.y - origin.y) * inv_direction.y; t2 = (box_max.y - origin.y) * inv_direction.y;
+	tmin = std::max(tmin, std::min(t1, t2)); tmax = std::min(tmax, std::max(t1, t2));
+	t1 = (box_min.z - origin.z) * inv_direction.z; t2 = (box_max.z - origin.z) * inv_direction.z;
+	tmin = std::max(tmin, std::min(t1, t2)); tmax = std::min(tmax, std::max(t1, t2));
+	tmin = std::max(tmin, 0.0f);
+	tmax = std::min(tmax, max_t);
+	t = tmin;
+	return tmin <= tmax;
+}
+
+static bool rayTriangle(const Vector3& origin, const Vector3& direction, const Vector3& v0, const Vector3& v1, const Vector3& v2, float& t)
+{
+	Vector3 edge1 = v1 - v0, edge2 = v2 - v0;
+	Vector3 p = direction.cross(edge2);
+	float det = edge1.dot(p);
+	if (fabs(det) < 1e-12f)
+		return false;
+	float inv_det = 1.0f / det;
+	Vector3 s = origin - v0;
+	float u = s.dot(p) * inv_det;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+	Vector3 q = s.cross(edge1);
+	float v = direction.dot(q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+	t = edge2.dot(q) * inv_det;
+	return t >= 0.0f;
+}
+
+bool HeightField::testRay(const Vector3& ray_origin, const Vector3& ray_direction, float max_t, float& t) const
+{
+	if (!mips.size())
+		return false;
+
+	//the ray in the space of the pixels (x column, y height, z row), t does not change
+	Vector3 origin((ray_origin.z / size + 0.5f) * width - 0.5f, ray_origin.y, (ray_origin.x / size + 0.5f) * height - 0.5f);
+	Vector3 direction(ray_direction.z * width / size, ray_direction.y, ray_direction.x * height / size);
+	Vector3 inv_direction;
+	for (int i = 0; i < 3; ++i)
+		inv_direction.v[i] = fabs(direction.v[i]) > 1e-12f ? 1.0f / direction.v[i] : (direction.v[i] < 0.0f ? -1e30f : 1e30f);
+
+	struct sStackNode {
+		int level, x, y;
+		float t;
+	};
+	sStackNode stack[64];
+	int stack_size = 0;
+
+	float best = max_t;
+	bool found = false;
+	float entry;
+	int top = (int)mips.size() - 1;
+	if (!rayBox(origin, inv_direction, Vector3(0.0f, min_height, 0.0f), Vector3((float)(width - 1), mips[top].max_heights[0], (float)(height - 1)), best, entry))
+		return false;
+	stack[stack_size++] = { top, 0, 0, entry };
+
+	while (stack_size)
+	{
+		sStackNode node = stack[--stack_size];
+		if (node.t > best)
+			continue;
+
+		//a single cell, the two triangles of the patch
+		if (node.level == 0)
+		{
+			int x1 = std::min(node.x + 1, width - 1), y1 = std::min(node.y + 1, height - 1);
+			Vector3 p00((float)node.x, getPixel(node.x, node.y), (float)node.y);
+			Vector3 p10((float)x1, getPixel(x1, node.y), (float)node.y);
+			Vector3 p01((float)node.x, getPixel(node.x, y1), (float)y1);
+			Vector3 p11((float)x1, getPixel(x1, y1), (float)y1);
+			float hit_t;
+			if (rayTriangle(origin, direction, p00, p10, p11, hit_t) && hit_t < best)
+			{
+				best = hit_t;
+				found = true;
+			}
+			if (rayTriangle(origin, direction, p00, p11, p01, hit_t) && hit_t < best)
+			{
+				best = hit_t;
+				found = true;
+			}
+			continue;
+		}
+
+		//the children whose box is under the ray are pushed with the closest on top
+		const sMaxMip& mip = mips[node.level - 1];
+		int cell_size = 1 << (node.level - 1);
+		sStackNode children[4];
+		int num_children = 0;
+		for (int y = node.y * 2; y < std::min(node.y * 2 + 2, mip.height); ++y)
+			for (int x = node.x * 2; x < std::min(node.x * 2 + 2, mip.width); ++x)
+			{
+				Vector3 box_min((float)(x * cell_size), min_height, (float)(y * cell_size));
+				Vector3 box_max((float)std::min((x + 1) * cell_size, width - 1), mip.max_heights[y * mip.width + x], (float)std::min((y + 1) * cell_size, height - 1));
+				if (rayBox(origin, inv_direction, box_min, box_max, best, entry))
+					children[num_children++] = { node.level - 1, x, y, entry };
+			}
+		std::sort(children, children + num_children, [](const sStackNode& a, const sStackNode& b) { return a.t > b.t; });
+		for (int i = 0; i < num_children && stack_size < 64; ++i)
+			stack[stack_size++] = children[i];
+	}
+
+	t = best;
+	return found;
+}
@@ -0,0 +1,46 @@
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include "framework.h"
+#include <vector>
+
+class Image;
+
+//Heights of a height map in the CPU, laid like Mesh::createSubdividedPlane (centered, x goes with the rows and z with the columns)
+//Rays are tested against a max-mip pyramid so whole regions under the ray are skipped at once
+class HeightField
+{
+public:
+	//max height of every group of 2^level x 2^level cells, a cell is the square between 4 pixels
+	struct sMaxMip {
+		int width;
+		int height;
+		std::vector<float> max_heights;
+	};
+
+	int width = 0;
+	int height = 0;
+	float size = 1.0f;
+	float altitude = 1.0f;
+	float min_height = 0.0f;
+	std::vector<float> heights; //one per pixel, already scaled by the altitude
+	std::vector<sMaxMip> mips;
+
+	bool create(Image* image, float size, float altitude);
+
+	//in pixels
+	float getPixel(int x, int y) const { return heights[y * width + x]; }
+	float getPixelHeight(float x, float y) const; //bilinear like the GPU does, the center of the first pixel is 0,0
+
+	//in object space
+	float getHeight(float x, float z) const;
+	Vector3 getNormal(float x, float z) const;
+	void getHeights(const Vector3* points, float* result, int count) const; //4 points at a time with SSE
+	void getHeightsAtUVs(const Vector2* uvs, unsigned int stride, float* result, int count) const; //like the texture, stride in bytes
+	bool testRay(const Vector3& origin, const Vector3& direction, float max_t, float& t) const; //t is in units of direction
+
+private:
+	void buildMaxMips();
+};
+
+#endif
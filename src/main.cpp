@@ -101,10 +101,40 @@ void renderDebug(SDL_Window* window, Application * game)
 
 		//System stats
 		ImGui::Text(getGPUStats().c_str());					   // Display some text (you can use a format strings too)
+		ImGui::Text(getMemoryStats().c_str());
+		if (ImGui::Button("Print memory report"))
+			printMemoryReport();
+
+		//Samples per ray of the visible volume
+		if (game->volume_index >= 1 && game->volume_index <= 3)
+		{
+			VolumeMaterial* volume_material = dynamic_cast<VolumeMaterial*>(game->root[game->volume_index - 1]->material);
+			if (volume_material && volume_material->volume && volume_material->adaptive)
+				ImGui::Text("Volume samples/ray: %.1f (uniform: %.1f)", volume_material->avg_samples_per_ray, volume_material->avg_uniform_samples_per_ray);
+		}
+
+		if (game->volume_index == 5 && game->multi_volume_renderer)
+			ImGui::Text("Volumes in the pass: %d", game->multi_volume_renderer->num_rendered);
+
+		//Dynamic resolution of the volumes
+		float target_ms = Application::instance->target_frame_time * 1000.0f;
+		if (ImGui::SliderFloat("Target frame time (ms)", &target_ms, 5.0f, 100.0f))
+			Application::instance->target_frame_time = target_ms * 0.001f;
+		ImGui::Text("Dynamic volume resolution: %.2f", Application::instance->dynamic_resolution_scale);
 		
 		ImGui::Checkbox("Render Wireframe", &Application::instance->render_wireframe);
 		ImGui::Checkbox("Render Jittering", &Application::instance->render_jittering);
 		ImGui::Checkbox("Render Gradient", &Application::instance->render_gradient);
+		ImGui::Checkbox("Show map with the volume", &Application::instance->render_scene_with_volume);
+		ImGui::Checkbox("Depth pre-pass", &Application::instance->depth_prepass);
+		ImGui::Text("Samples passing depth: %u without pre-pass, %u with it", Application::instance->samples_passed[0], Application::instance->samples_passed[1]);
+		ImGui::Checkbox("Progressive refinement", &Application::instance->progressive_rendering);
+		ImGui::Checkbox("Meshlet culling", &Mesh::meshlet_culling);
+		ImGui::SliderFloat("LOD pixel error", &Mesh::lod_pixel_error, 0.0f, 10.0f);
+		ImGui::Checkbox("Camera follows the ground", &Application::instance->camera_follow_ground);
+		ImGui::SliderFloat("Distance to the ground", &Application::instance->camera_ground_distance, 0.1f, 20.0f);
+		if (Application::instance->progressive_rendering)
+			ImGui::Text(Application::instance->isConverged() ? "Converged" : "Refining (%d/%d)", Application::instance->idle_frames, Application::instance->progressive_frames);
 
 		if (ImGui::TreeNode("Camera")) {
 			game->camera->renderInMenu();
@@ -222,6 +252,10 @@ void mainLoop(SDL_Window* window)
 		if (game->render_debug)
 			renderDebug(window, game);
 
+		//the image is not changing, do not spin at full speed redrawing the cached frame
+		if (game->isConverged())
+			SDL_Delay(10);
+
 		//check errors in opengl only when working in debug
 		#ifdef _DEBUG
 				checkGLErrors();
@@ -237,6 +271,35 @@ void mainLoop(SDL_Window* window)
 
 int main(int argc, char **argv)
 {
+	//benchmark of the OBJ parsers, it does not need a window
+	if (argc > 1 && strcmp(argv[1], "--bench-obj") == 0)
+	{
+		Mesh::benchmarkOBJ(argc > 2 ? argv[2] : "data/meshes/cloud.obj");
+		return 0;
+	}
+
+	//benchmark of the ray collisions, BVH against coldet
+	if (argc > 1 && strcmp(argv[1], "--bench-rays") == 0)
+	{
+		Mesh::benchmarkCollision(argc > 2 ? argv[2] : "data/meshes/cloud.obj");
+		return 0;
+	}
+
+	//benchmark of the mesh loading, one after the other against all in parallel
+	if (argc > 1 && strcmp(argv[1], "--bench-load") == 0)
+	{
+		std::vector<std::string> filenames(argv + 2, argv + argc);
+		if (filenames.empty())
+			filenames = { "data/meshes/box.ASE", "data/meshes/cloud.obj", "data/meshes/cloud_low.obj", "data/meshes/sphere.obj" };
+		Mesh::benchmarkLoading(filenames);
+		Mesh::shutdownLoaders();
+		return 0;
+	}
+
+	//the volumes keep their voxels in the CPU, for the reference raymarcher and the sample stats
+	if (argc > 1 && strcmp(argv[1], "--keep-volumes") == 0)
+		Volume::default_residency = RESIDENCY_KEEP;
+
 	std::cout << "Initiating game..." << std::endl;
 
 	//prepare SDL
@@ -278,6 +341,7 @@ int main(int argc, char **argv)
 	mainLoop(window);
 
 	//save state and free memory
+	Mesh::shutdownLoaders();
 	// Cleanup
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplSDL2_Shutdown();
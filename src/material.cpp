@@ -2,6 +2,11 @@
 #include "texture.h"
 #include "application.h"
 #include "extra/hdre.h"
+#include "utils.h"
+#include "fbo.h"
+
+#include <cassert>
+#include <algorithm>
 
 StandardMaterial::StandardMaterial()
 {
@@ -103,6 +108,26 @@ void VolumeMaterial::setUniforms(Camera* camera, Matrix44 model)
 	model.inverse();
 	Vector3 local_camera_position = vec3((model * vec4(camera->eye, 1.0)).x, (model * vec4(camera->eye, 1.0)).y, (model * vec4(camera->eye, 1.0)).z) * (1 / (model * vec4(camera->eye, 1.0)).w);
 
+	//the rays end at the opaque geometry, the reference raymarcher knows nothing about it
+	shader->setUniform("u_use_depth", opaque_depth != NULL && !compare_with_reference);
+	if (opaque_depth && !compare_with_reference)
+	{
+		Matrix44 inverse_viewprojection = camera->viewprojection_matrix;
+		inverse_viewprojection.inverse();
+		shader->setUniform("u_depth_texture", opaque_depth);
+		shader->setUniform("u_inverse_viewprojection", inverse_viewprojection);
+		shader->setUniform("u_inverse_model", model);
+	}
+
+	//region of interest
+	float planes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < 2; ++i)
+		if (clipping && clip_plane_enabled[i])
+			memcpy(planes + i * 4, &clip_planes[i], sizeof(float) * 4);
+	shader->setUniform("u_clip_min", clipping ? clip_min : Vector3(-1, -1, -1));
+	shader->setUniform("u_clip_max", clipping ? clip_max : Vector3(1, 1, 1));
+	shader->setUniform4Array("u_clip_planes", planes, 2);
+
 	//passing the local camerea position and the color to the shader
 	shader->setUniform("u_local_camera_position", local_camera_position);
 	shader->setUniform("u_color", color);
@@ -116,25 +141,123 @@ void VolumeMaterial::setUniforms(Camera* camera, Matrix44 model)
 		shader->setUniform("u_texture", texture);	//texture
 	}
 
-	shader->setUniform("u_jittering", jittering);
+	shader->setUniform("u_jittering", jittering || temporal || accumulating);
+	//golden ratio sequence, each frame of the temporal accumulation uses a different offset
+	shader->setUniform("u_jitter_seed", (temporal || accumulating) ? fmod(frame_index * 0.618034f, 1.0f) : 0.0f);
 	shader->setUniform("u_gradient", gradient);
+
+	shader->setUniform("u_isosurface", isosurface);
+	shader->setUniform("u_iso_value", iso_value);
+	if (texture)
+		shader->setUniform("u_voxel_size", Vector3(1.0f / texture->width, 1.0f / texture->height, 1.0f / texture->depth));
+
+	shader->setUniform("u_adaptive", adaptive && brick_texture);
+	if (adaptive && brick_texture)
+	{
+		shader->setUniform("u_brick_texture", brick_texture);
+		shader->setUniform("u_brick_dims", Vector3(brick_texture->width, brick_texture->height, brick_texture->depth));
+		shader->setUniform("u_empty_threshold", 1.0f / 255.0f);
+		shader->setUniform("u_refine_scale", 4.0f);
+		shader->setUniform("u_max_step_factor", 1.0f + 7.0f * adaptive_target);
+	}
 }
 
 void VolumeMaterial::render(Mesh* mesh, Matrix44 model, Camera* camera)
 {
 	if (mesh && shader)
 	{
-		//enable shader
-		shader->enable();
-
-		//upload uniforms
-		setUniforms(camera, model);
-
-		//do the draw call
-		mesh->render(GL_TRIANGLES);
-
-		//disable shader
-		shader->disable();
+		//the reference only covers the plain compositing path
+		bool prev_jittering = jittering;
+		bool prev_gradient = gradient;
+		bool prev_temporal = temporal;
+		if (compare_with_reference)
+			jittering = gradient = temporal = false;
+
+		if (adaptive && !brick_texture && volume && volume->data)
+			createBricks();
+
+		//upload the voxels of the region of interest that are not in the texture yet
+		updateResidentRegion();
+
+		float scale = 1.0f;
+		if (resolution_mode == RESOLUTION_HALF)
+			scale = 0.5f;
+		else if (resolution_mode == RESOLUTION_QUARTER)
+			scale = 0.25f;
+		else if (resolution_mode == RESOLUTION_DYNAMIC)
+			scale = Application::instance->dynamic_resolution_scale;
+
+		//progressive refinement: coarse frames while the user interacts, then accumulate jittered full resolution frames
+		float prev_quality = quality;
+		accumulating = false;
+		if (Application::instance->progressive_rendering && !compare_with_reference)
+		{
+			if (Application::instance->interacting)
+			{
+				scale = scale < 0.5f ? scale : 0.5f;
+				quality *= 4.0f;
+				accumulated_frames = 0;
+			}
+			else
+			{
+				scale = 1.0f;
+				accumulating = true;
+			}
+		}
+
+		//the rays already stop at the opaque geometry, the depth test would also hide the part in front of it
+		if (opaque_depth)
+			glDisable(GL_DEPTH_TEST);
+
+		//the comparison reads the screen, it needs the full resolution result
+		if ((scale < 1.0f || temporal || accumulating) && !compare_with_reference)
+			renderOffscreen(mesh, model, camera, scale);
+		else
+		{
+			//enable shader
+			shader->enable();
+
+			//upload uniforms
+			setUniforms(camera, model);
+			shader->setUniform("u_resolution", Vector2(Application::instance->window_width, Application::instance->window_height));
+
+			//rasterize the back faces so the volume is still visible with the camera inside it
+			glCullFace(GL_FRONT);
+
+			//the output is premultiplied, the comparison reads the volume alone
+			if (!compare_with_reference)
+			{
+				glEnable(GL_BLEND);
+				glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+			}
+
+			//do the draw call
+			mesh->render(GL_TRIANGLES);
+
+			glDisable(GL_BLEND);
+			glCullFace(GL_BACK);
+
+			//disable shader
+			shader->disable();
+		}
+
+		glEnable(GL_DEPTH_TEST);
+		quality = prev_quality;
+
+		if (compare_with_reference)
+		{
+			compareWithReference(camera, model);
+			compare_with_reference = false;
+			jittering = prev_jittering;
+			gradient = prev_gradient;
+			temporal = prev_temporal;
+		}
+
+		//refresh the samples per ray twice per second, it marches on the CPU so only when the debugger shows them,
+		//and the grid is spread over several frames so there are no hitches
+		float now = Application::instance->time;
+		if (adaptive && Application::instance->render_debug && volume && volume->data && !Application::instance->isConverged() && (stats_row > 0 || last_stats_time < 0.0f || now - last_stats_time > 0.5f))
+			updateSampleStats(camera, model);
 	}
 }
 
@@ -143,6 +266,583 @@ void VolumeMaterial::renderInMenu()
 	ImGui::ColorEdit3("Color", (float*)&color); // Edit 3 floats representing a color
 	ImGui::SliderFloat("Brightness", (float*)&brightness, 0.0, 2.0);	//Edit the brightness
 	ImGui::SliderFloat("Step size", (float*)&quality, 0.001, 1.0);	//Edit the step size
+	ImGui::Combo("Resolution", &resolution_mode, "Full\0Half\0Quarter\0Dynamic\0");
+	ImGui::Checkbox("Temporal accumulation", &temporal);
+	if (temporal)
+		ImGui::SliderFloat("History blend", &temporal_blend, 0.02, 1.0);
+	ImGui::Checkbox("Isosurface", &isosurface);
+	if (isosurface)
+		ImGui::SliderFloat("Iso value", &iso_value, 0.0, 1.0);
+	ImGui::Checkbox("Adaptive steps", &adaptive);
+	if (adaptive)
+		ImGui::SliderFloat("Quality / Performance", &adaptive_target, 0.0, 1.0);
+	ImGui::Checkbox("Clip", &clipping);
+	if (clipping)
+	{
+		ImGui::SliderFloat3("Clip min", (float*)&clip_min, -1.0, 1.0);
+		ImGui::SliderFloat3("Clip max", (float*)&clip_max, -1.0, 1.0);
+		ImGui::Checkbox("Clip plane 1", &clip_plane_enabled[0]);
+		if (clip_plane_enabled[0])
+			ImGui::DragFloat4("Plane 1", (float*)&clip_planes[0], 0.01f);
+		ImGui::Checkbox("Clip plane 2", &clip_plane_enabled[1]);
+		if (clip_plane_enabled[1])
+			ImGui::DragFloat4("Plane 2", (float*)&clip_planes[1], 0.01f);
+	}
+	if (volume)
+		ImGui::Text("Resident voxels: %dx%dx%d (last upload %d KB)", resident_max[0] - resident_min[0], resident_max[1] - resident_min[1], resident_max[2] - resident_min[2], uploaded_bytes / 1024);
+	if (volume && volume->data && ImGui::Button("Compare with CPU reference"))
+		compare_with_reference = true;
+	else if (volume && !volume->data)
+		ImGui::Text("Voxels freed after the upload (--keep-volumes keeps them)");
+}
+
+void VolumeMaterial::renderOffscreen(Mesh* mesh, Matrix44 model, Camera* camera, float scale)
+{
+	int screen_width = Application::instance->window_width;
+	int screen_height = Application::instance->window_height;
+	int width = (int)(screen_width * scale);
+	int height = (int)(screen_height * scale);
+	width = width > 1 ? width : 1;
+	height = height > 1 ? height : 1;
+
+	if (!volume_fbo || volume_fbo->width != width || volume_fbo->height != height)
+	{
+		if (volume_fbo)
+			delete volume_fbo;
+		volume_fbo = new FBO();
+		volume_fbo->create(width, height, GL_RGBA, GL_UNSIGNED_BYTE);
+		accumulated_frames = 0;
+	}
+
+	//the accumulated image has converged, only the composite is needed
+	bool converged = accumulating && accumulated_frames >= Application::instance->progressive_frames;
+
+	//raymarch into the offscreen buffer, empty pixels stay transparent
+	Texture* result = volume_fbo->color_textures[0];
+	if (converged)
+		result = history_fbo[history_index]->color_textures[0];
+	else
+	{
+		float clear_color[4];
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+
+		volume_fbo->bind();
+		glClearColor(0.0, 0.0, 0.0, 0.0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		shader->enable();
+		setUniforms(camera, model);
+		shader->setUniform("u_resolution", Vector2(width, height));
+		glCullFace(GL_FRONT);
+		mesh->render(GL_TRIANGLES);
+		shader->disable();
+
+		volume_fbo->unbind();
+		glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+
+		//running average of all the frames since the camera stopped
+		if (accumulating)
+		{
+			result = resolveTemporal(mesh, model, camera, 1.0f / (accumulated_frames + 1));
+			accumulated_frames++;
+		}
+		else if (temporal)
+			result = resolveTemporal(mesh, model, camera, temporal_blend);
+	}
+
+	//composite: draw the cube again at full resolution and upsample with a depth aware filter
+	Shader* upsample_shader = Shader::Get("data/shaders/basic.vs", "data/shaders/volume_upsample.fs");
+	upsample_shader->enable();
+	upsample_shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	upsample_shader->setUniform("u_model", model);
+	upsample_shader->setUniform("u_color_texture", result);
+	upsample_shader->setUniform("u_depth_texture", volume_fbo->depth_texture);
+	upsample_shader->setUniform("u_use_opaque_depth", opaque_depth != NULL);
+	if (opaque_depth)
+		upsample_shader->setUniform("u_opaque_depth_texture", opaque_depth);
+	upsample_shader->setUniform("u_lowres_size", Vector2(width, height));
+	upsample_shader->setUniform("u_screen_size", Vector2(screen_width, screen_height));
+	upsample_shader->setUniform("u_camera_near_far", Vector2(camera->near_plane, camera->far_plane));
+	upsample_shader->setUniform("u_depth_sigma", 20.0f);
+
+	//back faces like the raymarch, so it works from inside the cube and the depths match (also when the march was skipped)
+	glCullFace(GL_FRONT);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA); //the raymarch output is premultiplied
+	mesh->render(GL_TRIANGLES);
+	glDisable(GL_BLEND);
+	glCullFace(GL_BACK);
+
+	upsample_shader->disable();
+}
+
+//Blends the frame just marched in volume_fbo with the history of the previous frames, returns the accumulated result
+Texture* VolumeMaterial::resolveTemporal(Mesh* mesh, Matrix44 model, Camera* camera, float blend)
+{
+	int width = volume_fbo->width;
+	int height = volume_fbo->height;
+
+	//the history is stored in half floats, small contributions would be lost with 8 bits
+	for (int i = 0; i < 2; ++i)
+	{
+		if (history_fbo[i] && history_fbo[i]->width == width && history_fbo[i]->height == height)
+			continue;
+		if (history_fbo[i])
+		{
+			delete history_fbo[i]->color_textures[0];
+			delete history_fbo[i];
+		}
+		history_fbo[i] = new FBO();
+		history_fbo[i]->createFromTextures(new Texture(width, height, GL_RGBA, GL_FLOAT, false, NULL, GL_RGBA16F), NULL, NULL);
+		history_valid = false;
+	}
+
+	//nothing to reuse after a camera cut or if the node was not rendered in the last frames
+	float now = Application::instance->time;
+	if (isCameraCut(camera) || last_render_time < 0.0f || now - last_render_time > 0.25f)
+		history_valid = false;
+
+	FBO* prev_history = history_fbo[history_index];
+	FBO* next_history = history_fbo[1 - history_index];
+
+	Matrix44 inv_model = model;
+	inv_model.inverse();
+
+	next_history->bind();
+	glClearColor(0.0, 0.0, 0.0, 0.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	Shader* temporal_shader = Shader::Get("data/shaders/basic.vs", "data/shaders/volume_temporal.fs");
+	temporal_shader->enable();
+	temporal_shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	temporal_shader->setUniform("u_model", model);
+	temporal_shader->setUniform("u_local_camera_position", inv_model * camera->eye);
+	temporal_shader->setUniform("u_prev_viewprojection", prev_viewprojection);
+	temporal_shader->setUniform("u_current_texture", volume_fbo->color_textures[0]);
+	temporal_shader->setUniform("u_history_texture", prev_history->color_textures[0]);
+	temporal_shader->setUniform("u_size", Vector2(width, height));
+	temporal_shader->setUniform("u_blend", history_valid ? blend : 1.0f);
+	temporal_shader->setUniform("u_clamp_history", !accumulating); //the progressive frames restart when anything changes
+
+	glCullFace(GL_FRONT);
+	mesh->render(GL_TRIANGLES);
+	glCullFace(GL_BACK);
+
+	temporal_shader->disable();
+	next_history->unbind();
+
+	history_index = 1 - history_index;
+	history_valid = true;
+	prev_viewprojection = camera->viewprojection_matrix;
+	prev_eye = camera->eye;
+	prev_center = camera->center;
+	last_render_time = now;
+	frame_index++;
+
+	return next_history->color_textures[0];
+}
+
+//A big jump of the camera makes the reprojected history useless, better to start again
+bool VolumeMaterial::isCameraCut(Camera* camera)
+{
+	if (!history_valid)
+		return false;
+
+	float distance = (prev_center - prev_eye).length();
+	if ((camera->eye - prev_eye).length() > 0.25f * distance)
+		return true;
+
+	Vector3 prev_front = (prev_center - prev_eye).normalize();
+	Vector3 front = (camera->center - camera->eye).normalize();
+	return prev_front.dot(front) < cos(30.0f * DEG2RAD);
+}
+
+//Interval of the ray inside the volume and the region of interest, the same as the ray setup of volume.fs
+bool VolumeMaterial::clipRay(const Vector3& ray_origin, const Vector3& ray_dir, float& t_entry, float& t_exit)
+{
+	Vector3 box_min = clipping ? clip_min : Vector3(-1, -1, -1);
+	Vector3 box_max = clipping ? clip_max : Vector3(1, 1, 1);
+	if (!RayBoxCollision(box_min, box_max, ray_origin, ray_dir, t_entry, t_exit))
+		return false;
+	t_entry = t_entry > 0.0f ? t_entry : 0.0f;
+
+	for (int i = 0; i < 2 && clipping; ++i)
+	{
+		if (!clip_plane_enabled[i])
+			continue;
+		Vector3 normal(clip_planes[i].x, clip_planes[i].y, clip_planes[i].z);
+		if (normal.dot(normal) == 0.0f)
+			continue;
+		float distance = normal.dot(ray_origin) + clip_planes[i].w;
+		float denom = normal.dot(ray_dir);
+		if (fabs(denom) < 0.000001f)
+		{
+			if (distance < 0.0f)
+				return false;
+		}
+		else if (denom > 0.0f)
+			t_entry = std::max(t_entry, -distance / denom);
+		else
+			t_exit = std::min(t_exit, -distance / denom);
+	}
+
+	return t_exit > t_entry;
+}
+
+//Sends to the texture the voxels of the region of interest that are missing, as slabs around the previous region
+void VolumeMaterial::updateResidentRegion()
+{
+	if (!volume || !volume->data || !texture)
+		return;
+
+	int dims[3] = { (int)volume->width, (int)volume->height, (int)volume->depth };
+	float box_min[3] = { -1, -1, -1 };
+	float box_max[3] = { 1, 1, 1 };
+	//the voxels are freed after the upload, so the whole volume has to be sent the first time
+	bool drop = volume->residency == RESIDENCY_DROP;
+	if (clipping && !drop)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			box_min[a] = clip_min.v[a];
+			box_max[a] = clip_max.v[a];
+		}
+
+		//planes aligned with an axis also shrink the region
+		for (int i = 0; i < 2; ++i)
+		{
+			if (!clip_plane_enabled[i])
+				continue;
+			for (int a = 0; a < 3; ++a)
+			{
+				float n = (&clip_planes[i].x)[a];
+				if (n == 0.0f || (&clip_planes[i].x)[(a + 1) % 3] != 0.0f || (&clip_planes[i].x)[(a + 2) % 3] != 0.0f)
+					continue;
+				if (n > 0.0f)
+					box_min[a] = std::max(box_min[a], -clip_planes[i].w / n);
+				else
+					box_max[a] = std::min(box_max[a], -clip_planes[i].w / n);
+			}
+		}
+	}
+
+	//voxels touched by the linear filter inside the box, with one voxel of margin
+	int new_min[3], new_max[3];
+	for (int a = 0; a < 3; ++a)
+	{
+		new_min[a] = (int)clamp(floor((box_min[a] + 1.0f) * 0.5f * dims[a]) - 1, 0, dims[a]);
+		new_max[a] = (int)clamp(ceil((box_max[a] + 1.0f) * 0.5f * dims[a]) + 1, 0, dims[a]);
+		new_max[a] = std::max(new_max[a], new_min[a]);
+	}
+
+	if (!memcmp(new_min, resident_min, sizeof(new_min)) && !memcmp(new_max, resident_max, sizeof(new_max)))
+		return;
+
+	bool overlap = true;
+	for (int a = 0; a < 3; ++a)
+		overlap = overlap && new_min[a] < resident_max[a] && resident_min[a] < new_max[a];
+
+	int format = volume->channels == 1 ? GL_RED : volume->channels == 2 ? GL_RG : volume->channels == 3 ? GL_RGB : GL_RGBA;
+	int bytes = 0;
+	int cur_min[3] = { new_min[0], new_min[1], new_min[2] };
+	int cur_max[3] = { new_max[0], new_max[1], new_max[2] };
+
+	if (overlap)
+	{
+		//peel the parts of the new box outside the old one, what is left was already uploaded
+		for (int a = 0; a < 3; ++a)
+		{
+			int slab_min[3] = { cur_min[0], cur_min[1], cur_min[2] };
+			int slab_max[3] = { cur_max[0], cur_max[1], cur_max[2] };
+			if (cur_min[a] < resident_min[a])
+			{
+				slab_max[a] = resident_min[a];
+				texture->upload3DRegion(format, GL_UNSIGNED_BYTE, volume->data, dims[0], dims[1], slab_min[0], slab_min[1], slab_min[2], slab_max[0] - slab_min[0], slab_max[1] - slab_min[1], slab_max[2] - slab_min[2]);
+				bytes += (slab_max[0] - slab_min[0]) * (slab_max[1] - slab_min[1]) * (slab_max[2] - slab_min[2]) * volume->channels;
+				cur_min[a] = resident_min[a];
+			}
+			slab_min[a] = cur_min[a];
+			slab_max[a] = cur_max[a];
+			if (cur_max[a] > resident_max[a])
+			{
+				slab_min[a] = resident_max[a];
+				texture->upload3DRegion(format, GL_UNSIGNED_BYTE, volume->data, dims[0], dims[1], slab_min[0], slab_min[1], slab_min[2], slab_max[0] - slab_min[0], slab_max[1] - slab_min[1], slab_max[2] - slab_min[2]);
+				bytes += (slab_max[0] - slab_min[0]) * (slab_max[1] - slab_min[1]) * (slab_max[2] - slab_min[2]) * volume->channels;
+				cur_max[a] = resident_max[a];
+			}
+		}
+	}
+	else
+	{
+		texture->upload3DRegion(format, GL_UNSIGNED_BYTE, volume->data, dims[0], dims[1], new_min[0], new_min[1], new_min[2], new_max[0] - new_min[0], new_max[1] - new_min[1], new_max[2] - new_min[2]);
+		bytes = (new_max[0] - new_min[0]) * (new_max[1] - new_min[1]) * (new_max[2] - new_min[2]) * volume->channels;
+	}
+
+	memcpy(resident_min, new_min, sizeof(new_min));
+	memcpy(resident_max, new_max, sizeof(new_max));
+	uploaded_bytes = bytes;
+
+	//the bricks are built from the voxels, they must exist before freeing them
+	if (drop)
+	{
+		if (!brick_volume)
+			createBricks();
+		volume->applyResidency();
+	}
+}
+
+bool VolumeMaterial::raymarchReference(const Vector3& ray_origin, const Vector3& ray_dir, Vector4& result, int* num_samples)
+{
+	assert(volume && volume->data && "the CPU reference needs the volume data");
+
+	//same ray setup as volume.fs
+	float t_entry, t_exit;
+	if (!clipRay(ray_origin, ray_dir, t_entry, t_exit))
+		return false;
+
+	if (isosurface)
+		return raymarchIsosurface(ray_origin, ray_dir, t_entry, t_exit, result, num_samples);
+
+	int num_steps = (int)ceil((t_exit - t_entry) / quality);
+	num_steps = num_steps < 4096 ? num_steps : 4096;
+
+	bool use_bricks = adaptive && brick_volume;
+	int max_iterations = use_bricks ? 4096 : num_steps;
+	float max_step_factor = 1.0f + 7.0f * adaptive_target;
+
+	float t = t_entry + quality * 0.5f;
+	Vector4 color_acc(0, 0, 0, 0);
+	int samples = 0;
+
+	for (int i = 0; i < max_iterations; ++i)
+	{
+		if (color_acc.w > 0.99f || t >= t_exit)
+			break;
+
+		Vector3 current_sample = ray_origin + ray_dir * t;
+		Vector3 uvw = (current_sample + Vector3(1, 1, 1)) * 0.5f;
+
+		float dt = quality;
+		if (use_bricks)
+		{
+			//nearest texel of the brick volume
+			int bx = (int)clamp(floor(uvw.x * brick_volume->width), 0, brick_volume->width - 1);
+			int by = (int)clamp(floor(uvw.y * brick_volume->height), 0, brick_volume->height - 1);
+			int bz = (int)clamp(floor(uvw.z * brick_volume->depth), 0, brick_volume->depth - 1);
+			Uint8* brick = &brick_volume->data[VOLPOS(bx, by, bz, (int)brick_volume->width, (int)brick_volume->height, (int)brick_volume->depth, 2)];
+			float brick_min = brick[0] / 255.0f;
+			float brick_max = brick[1] / 255.0f;
+
+			if (brick_max <= 1.0f / 255.0f)
+			{
+				//empty brick, jump to where the ray leaves it
+				Vector3 dims((float)brick_volume->width, (float)brick_volume->height, (float)brick_volume->depth);
+				Vector3 cell_min(bx / dims.x * 2.0f - 1.0f, by / dims.y * 2.0f - 1.0f, bz / dims.z * 2.0f - 1.0f);
+				Vector3 cell_max((bx + 1) / dims.x * 2.0f - 1.0f, (by + 1) / dims.y * 2.0f - 1.0f, (bz + 1) / dims.z * 2.0f - 1.0f);
+				float t_cell_entry, t_cell_exit;
+				RayBoxCollision(cell_min, cell_max, ray_origin, ray_dir, t_cell_entry, t_cell_exit);
+				t = (t_cell_exit > t ? t_cell_exit : t) + quality * 0.01f;
+				continue;
+			}
+
+			float homogeneity = 1.0f - clamp((brick_max - brick_min) * 4.0f, 0.0f, 1.0f);
+			dt = quality * (1.0f + (max_step_factor - 1.0f) * (homogeneity > color_acc.w ? homogeneity : color_acc.w));
+		}
+
+		float density = volume->getVoxelInterpolated(uvw.x, uvw.y, uvw.z);
+		samples++;
+
+		//opacity correction, as in the shader
+		float alpha = 1.0f - exp(-density * dt);
+		float weight = alpha * (1.0f - color_acc.w);
+		color_acc = color_acc + Vector4(color.x * weight, color.y * weight, color.z * weight, weight);
+
+		t += dt;
+	}
+
+	//brightness, as in the shader
+	for (int i = 0; i < 3; ++i)
+		color_acc.v[i] = 1.0f < color_acc.v[i] * brightness ? 1.0f : color_acc.v[i] * brightness;
+
+	result = color_acc;
+	if (num_samples)
+		*num_samples = samples;
+	return true;
+}
+
+//Mirror of shadeIsosurface in volume.fs
+bool VolumeMaterial::raymarchIsosurface(const Vector3& ray_origin, const Vector3& ray_dir, float t_entry, float t_exit, Vector4& result, int* num_samples)
+{
+	float t = t_entry + quality * 0.5f;
+	float t_prev = t;
+	float t_hit = -1.0f;
+	int samples = 0;
+
+	for (int i = 0; i < 4096 && t < t_exit; ++i)
+	{
+		Vector3 uvw = (ray_origin + ray_dir * t + Vector3(1, 1, 1)) * 0.5f;
+		samples++;
+		if (volume->getVoxelInterpolated(uvw.x, uvw.y, uvw.z) >= iso_value)
+		{
+			float a = i == 0 ? t : t_prev;
+			float b = t;
+			for (int j = 0; j < 8; ++j)
+			{
+				float m = 0.5f * (a + b);
+				Vector3 p = (ray_origin + ray_dir * m + Vector3(1, 1, 1)) * 0.5f;
+				if (volume->getVoxelInterpolated(p.x, p.y, p.z) >= iso_value)
+					b = m;
+				else
+					a = m;
+			}
+			samples += 8;
+			t_hit = b;
+			break;
+		}
+		t_prev = t;
+		t += quality;
+	}
+
+	if (num_samples)
+		*num_samples = samples;
+
+	if (t_hit < 0.0f)
+	{
+		result = Vector4(0, 0, 0, 1);
+		return true;
+	}
+
+	Vector3 p = (ray_origin + ray_dir * t_hit + Vector3(1, 1, 1)) * 0.5f;
+	Vector3 h(1.0f / volume->width, 1.0f / volume->height, 1.0f / volume->depth);
+	Vector3 gradient(
+		volume->getVoxelInterpolated(p.x + h.x, p.y, p.z) - volume->getVoxelInterpolated(p.x - h.x, p.y, p.z),
+		volume->getVoxelInterpolated(p.x, p.y + h.y, p.z) - volume->getVoxelInterpolated(p.x, p.y - h.y, p.z),
+		volume->getVoxelInterpolated(p.x, p.y, p.z + h.z) - volume->getVoxelInterpolated(p.x, p.y, p.z - h.z));
+	float diffuse = 1.0f;
+	if (gradient.dot(gradient) > 0.0f)
+	{
+		gradient.normalize();
+		diffuse = std::max(gradient.dot(ray_dir), 0.0f);
+	}
+
+	result = Vector4(0, 0, 0, 1);
+	for (int i = 0; i < 3; ++i)
+		result.v[i] = std::min(color.v[i] * (0.2f + 0.8f * diffuse) * brightness, 1.0f);
+	return true;
+}
+
+void VolumeMaterial::compareWithReference(Camera* camera, Matrix44 model)
+{
+	int width = Application::instance->window_width;
+	int height = Application::instance->window_height;
+
+	std::vector<float> pixels(width * height * 3);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_FLOAT, &pixels[0]);
+
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+	Matrix44 inv_model = model;
+	inv_model.inverse();
+	Vector3 local_eye = inv_model * camera->eye;
+
+	long time = getTime();
+	int num_pixels = 0;
+	double total_error = 0.0;
+	float max_error = 0.0f;
+
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+		{
+			//ray through the center of the pixel
+			Vector4 far_point = inv_vp * Vector4((x + 0.5f) / width * 2.0f - 1.0f, (y + 0.5f) / height * 2.0f - 1.0f, 1.0f, 1.0f);
+			Vector3 world_point = far_point.xyz * (1.0f / far_point.w);
+			Vector3 ray_dir = normalize((inv_model * world_point) - local_eye);
+
+			//skip silhouette pixels, multisampling blends them with the background
+			float t_entry, t_exit;
+			if (!RayBoxCollision(Vector3(-1, -1, -1), Vector3(1, 1, 1), local_eye, ray_dir, t_entry, t_exit) || t_exit - (t_entry > 0.0f ? t_entry : 0.0f) < 2.0f * quality)
+				continue;
+
+			Vector4 reference;
+			if (!raymarchReference(local_eye, ray_dir, reference))
+				continue;
+
+			float* gpu = &pixels[(y * width + x) * 3];
+			for (int i = 0; i < 3; ++i)
+			{
+				float error = fabs(gpu[i] - reference.v[i]);
+				total_error += error;
+				max_error = error > max_error ? error : max_error;
+			}
+			num_pixels++;
+		}
+
+	std::cout << " + Volume CPU reference: " << num_pixels << " pixels, mean error: " << (num_pixels ? total_error / (num_pixels * 3) : 0.0) << " max error: " << max_error << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+}
+
+void VolumeMaterial::createBricks(int brick_size)
+{
+	assert(volume && volume->data);
+
+	if (brick_volume)
+		delete brick_volume;
+	brick_volume = volume->createMinMaxVolume(brick_size);
+
+	if (!brick_texture)
+		brick_texture = new Texture();
+	brick_texture->create3D(brick_volume->width, brick_volume->height, brick_volume->depth, GL_RG, GL_UNSIGNED_BYTE, false, brick_volume->data, GL_RG8);
+
+	//the min and max of a brick must not be interpolated with the neighbours
+	brick_texture->bind();
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	brick_texture->unbind();
+}
+
+//Marches num_rows rows of the grid, the averages are updated when the whole grid is done
+void VolumeMaterial::updateSampleStats(Camera* camera, Matrix44 model, int num_rows)
+{
+	const int grid_width = 32;
+	const int grid_height = 24;
+
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+	Matrix44 inv_model = model;
+	inv_model.inverse();
+	Vector3 local_eye = inv_model * camera->eye;
+
+	bool prev_adaptive = adaptive;
+	int last_row = std::min(stats_row + num_rows, grid_height);
+
+	for (int y = stats_row; y < last_row; ++y)
+		for (int x = 0; x < grid_width; ++x)
+		{
+			Vector4 far_point = inv_vp * Vector4((x + 0.5f) / grid_width * 2.0f - 1.0f, (y + 0.5f) / grid_height * 2.0f - 1.0f, 1.0f, 1.0f);
+			Vector3 ray_dir = normalize((inv_model * (far_point.xyz * (1.0f / far_point.w))) - local_eye);
+
+			Vector4 result;
+			int samples = 0;
+			adaptive = false;
+			if (!raymarchReference(local_eye, ray_dir, result, &samples))
+				continue;
+			stats_uniform_samples += samples;
+
+			adaptive = prev_adaptive && brick_volume;
+			raymarchReference(local_eye, ray_dir, result, &samples);
+			stats_adaptive_samples += samples;
+			stats_rays++;
+		}
+
+	adaptive = prev_adaptive;
+	stats_row = last_row;
+	if (stats_row < grid_height)
+		return;
+
+	avg_samples_per_ray = stats_rays ? stats_adaptive_samples / (float)stats_rays : 0.0f;
+	avg_uniform_samples_per_ray = stats_rays ? stats_uniform_samples / (float)stats_rays : 0.0f;
+	stats_row = stats_rays = 0;
+	stats_adaptive_samples = stats_uniform_samples = 0;
+	last_stats_time = Application::instance->time;
 }
 
 CloudMaterial::CloudMaterial()
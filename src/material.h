@@ -9,6 +9,7 @@
 #include "volume.h"
 
 class My_Light;
+class FBO;
 
 class Material {
 public:
@@ -62,12 +63,80 @@ public:
 
 class VolumeMaterial : public Material {
 public:
+	bool compare_with_reference = false; //read back the next frame and compare it against the CPU raymarcher
+
+	//first hit isosurface instead of compositing
+	bool isosurface = false;
+	float iso_value = 0.3f;
+
+	//adaptive sampling
+	bool adaptive = false;
+	float adaptive_target = 0.5f; //0 favours quality, 1 favours performance
+	Volume* brick_volume = NULL; //min/max of every brick, used to choose the step
+	Texture* brick_texture = NULL;
+
+	//samples per ray measured with the CPU raymarcher on a coarse grid of rays, a few rows per frame
+	float avg_samples_per_ray = 0.0f;
+	float avg_uniform_samples_per_ray = 0.0f;
+	float last_stats_time = -1.0f;
+	int stats_row = 0; //next row of the grid, 0 when no measure is running
+	int stats_rays = 0;
+	long stats_adaptive_samples = 0;
+	long stats_uniform_samples = 0;
+
+	//resolution of the raymarching pass, the result is upsampled to the screen
+	enum { RESOLUTION_FULL, RESOLUTION_HALF, RESOLUTION_QUARTER, RESOLUTION_DYNAMIC };
+	int resolution_mode = RESOLUTION_FULL;
+	FBO* volume_fbo = NULL;
+
+	//depth of the opaque geometry drawn before the volume (NULL if there is none)
+	Texture* opaque_depth = NULL;
+
+	//temporal accumulation: every frame marches with a different jitter and is blended with the reprojected history
+	bool temporal = false;
+	float temporal_blend = 0.1f; //weight of the new frame
+	FBO* history_fbo[2] = { NULL, NULL };
+	int history_index = 0;
+	bool history_valid = false;
+	int frame_index = 0;
+	float last_render_time = -1.0f;
+	Matrix44 prev_viewprojection;
+	Vector3 prev_eye;
+	Vector3 prev_center;
+
+	//progressive refinement while the camera is idle, see Application::progressive_rendering
+	bool accumulating = false;
+	int accumulated_frames = 0;
+
+	//region of interest in the local space of the cube, the rays and the uploaded voxels are limited to it
+	bool clipping = false;
+	Vector3 clip_min = Vector3(-1, -1, -1);
+	Vector3 clip_max = Vector3(1, 1, 1);
+	bool clip_plane_enabled[2] = { false, false };
+	Vector4 clip_planes[2] = { Vector4(1, 0, 0, 0), Vector4(0, 1, 0, 0) }; //keeps the side where dot(n, p) + d >= 0
+	int resident_min[3] = { 0, 0, 0 }; //voxels already in the texture, the max is exclusive
+	int resident_max[3] = { 0, 0, 0 };
+	int uploaded_bytes = 0; //sent in the last change of the region
+
 	VolumeMaterial();
 	~VolumeMaterial();
 
 	void setUniforms(Camera* camera, Matrix44 model);
 	void render(Mesh* mesh, Matrix44 model, Camera * camera);
 	void renderInMenu();
+
+	//CPU version of volume.fs, ray in local space of the volume, returns false if the ray misses the volume
+	bool raymarchIsosurface(const Vector3& ray_origin, const Vector3& ray_dir, float t_entry, float t_exit, Vector4& result, int* num_samples = NULL);
+	bool raymarchReference(const Vector3& ray_origin, const Vector3& ray_dir, Vector4& result, int* num_samples = NULL);
+	void compareWithReference(Camera* camera, Matrix44 model);
+
+	void renderOffscreen(Mesh* mesh, Matrix44 model, Camera* camera, float scale);
+	Texture* resolveTemporal(Mesh* mesh, Matrix44 model, Camera* camera, float blend);
+	bool isCameraCut(Camera* camera);
+	void createBricks(int brick_size = 8);
+	void updateResidentRegion();
+	bool clipRay(const Vector3& ray_origin, const Vector3& ray_dir, float& t_entry, float& t_exit);
+	void updateSampleStats(Camera* camera, Matrix44 model, int num_rows = 2);
 };
 
 class CloudMaterial : public Material {
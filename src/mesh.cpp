@@ -9,19 +9,60 @@
 #include <iostream>
 #include <limits>
 #include <sys/stat.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <cstddef>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <deque>
+#include <sstream>
 
 #include "camera.h"
 #include "texture.h"
 #include "animation.h"
+#include "bvh.h"
+#include "heightfield.h"
 #include "extra/coldet/coldet.h"
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
+std::vector<Mesh*> Mesh::sInstances;
+std::map<std::string, std::shared_future<Mesh*>> Mesh::sMeshesLoading;
+std::vector<Mesh*> Mesh::sUploadQueue;
+std::recursive_mutex Mesh::sMutex;
 bool Mesh::use_binary = true;
 bool Mesh::auto_upload_to_vram = true;
 bool Mesh::interleave_meshes = true;
+bool Mesh::weld_meshes = true;
+bool Mesh::optimize_meshes = true;
+bool Mesh::quantize_meshes = true;
+bool Mesh::build_meshlets = true;
+bool Mesh::meshlet_culling = true;
+long Mesh::num_triangles_culled = 0;
+bool Mesh::build_lods = true;
+float Mesh::lod_pixel_error = 1.0f;
+bool Mesh::generate_tangents = true;
+float Mesh::crease_angle = 60.0f;
+bool Mesh::position_streams = true;
+eResidency Mesh::default_residency = RESIDENCY_COLLISION;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
 
+//what a loader thread prints while processing a mesh, finishLoad moves it to the mesh so the loads don't mix their output
+static thread_local std::stringstream loader_log;
+
+static std::ostream& loadLog()
+{
+	if (in_loader_thread)
+		return loader_log;
+	return std::cout;
+}
+
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
 #define FORMAT_MBIN 3
@@ -30,14 +71,29 @@ long Mesh::num_triangles_rendered = 0;
 Mesh::Mesh()
 {
 	radius = 0;
-	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = quantized_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = tangents_vbo_id = positions_vbo_id = 0;
+	visible_indices_vbo_id = 0;
+	num_visible_triangles = -1;
+	lod_indices_vbo_id = 0;
+	current_lod = 0;
 	collision_model = NULL;
+	bvh = NULL;
+	bin_file = NULL;
+	residency = RESIDENCY_KEEP;
 	clear();
+	if (in_loader_thread)
+		return; //still being filled, finishLoad registers it
+	std::lock_guard<std::recursive_mutex> lock(sMutex);
+	sInstances.push_back(this);
 }
 
 Mesh::~Mesh()
 {
 	clear();
+	std::lock_guard<std::recursive_mutex> lock(sMutex);
+	std::vector<Mesh*>::iterator it = std::find(sInstances.begin(), sInstances.end(), this);
+	if (it != sInstances.end()) //a failed load is never registered
+		sInstances.erase(it);
 }
 
 
@@ -54,15 +110,29 @@ void Mesh::clear()
 		glDeleteBuffersARB(1,&colors_vbo_id);
 	if (interleaved_vbo_id)
 		glDeleteBuffersARB(1, &interleaved_vbo_id);
+	if (quantized_vbo_id)
+		glDeleteBuffersARB(1, &quantized_vbo_id);
 	if (indices_vbo_id)
 		glDeleteBuffersARB(1, &indices_vbo_id);
 	if (bones_vbo_id)
 		glDeleteBuffersARB(1, &bones_vbo_id);
 	if (weights_vbo_id)
 		glDeleteBuffersARB(1, &weights_vbo_id);
+	if (tangents_vbo_id)
+		glDeleteBuffersARB(1, &tangents_vbo_id);
+	if (positions_vbo_id)
+		glDeleteBuffersARB(1, &positions_vbo_id);
+	if (visible_indices_vbo_id)
+		glDeleteBuffersARB(1, &visible_indices_vbo_id);
+	visible_indices_vbo_id = 0;
+	if (lod_indices_vbo_id)
+		glDeleteBuffersARB(1, &lod_indices_vbo_id);
+	lod_indices_vbo_id = 0;
+	num_visible_triangles = -1;
 
 	//VBOs ids
-	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = 0;
+	vram_bytes = 0;
+	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = quantized_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = tangents_vbo_id = positions_vbo_id = 0;
 
 	//buffers
 	vertices.clear();
@@ -70,12 +140,20 @@ void Mesh::clear()
 	uvs.clear();
 	colors.clear();
 	interleaved.clear();
+	quantized.clear();
 	indices.clear();
+	meshlets.clear();
+	visible_indices.clear();
+	lods.clear();
+	lod_indices.clear();
 	bones.clear();
 	weights.clear();
+	tangents.clear();
 
-	if (collision_model)
-		delete collision_model;
+	releaseMappedFile();
+	num_vertices = num_indices = 0;
+
+	releaseCollisionModel();
 }
 
 int vertex_location = 1;
@@ -84,6 +162,7 @@ int uv_location = 1;
 int color_location = -1;
 int bones_location = -1;
 int weights_location = -1;
+int tangent_location = -1;
 
 void Mesh::enableBuffers(Shader* sh)
 {
@@ -97,7 +176,7 @@ void Mesh::enableBuffers(Shader* sh)
 	int offset_normal = 0;
 	int offset_uv = 0;
 
-	if (interleaved.size())
+	if (interleaved.size() || interleaved_vbo_id)
 	{
 		spacing = sizeof(tInterleaved);
 		offset_normal = sizeof(Vector3);
@@ -106,50 +185,77 @@ void Mesh::enableBuffers(Shader* sh)
 
 	glEnableVertexAttribArray(vertex_location);
 
-	if (vertices_vbo_id || interleaved_vbo_id)
+	//the compact format is decoded in the vertex shader
+	sh->setUniform("u_quantized", quantized_vbo_id ? 1.0f : 0.0f);
+	if (quantized_vbo_id)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : vertices_vbo_id);
-		glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, 0);
-	}
-	else
-		glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].vertex : &vertices[0]);
+		sh->setUniform("u_quantization_min", quantization_min);
+		sh->setUniform("u_quantization_size", quantization_size);
+
+		glBindBuffer(GL_ARRAY_BUFFER, quantized_vbo_id);
+		glVertexAttribPointer(vertex_location, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(tQuantized), 0);
 
-	normal_location = -1;
-	if (normals.size() || spacing)
-	{
 		normal_location = sh->getAttribLocation("a_normal");
 		if (normal_location != -1)
 		{
 			glEnableVertexAttribArray(normal_location);
-			if (normals_vbo_id || interleaved_vbo_id)
-			{
-				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
-				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
-			}
-			else
-				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].normal : &normals[0]);
+			glVertexAttribPointer(normal_location, 2, GL_SHORT, GL_TRUE, sizeof(tQuantized), (void*)offsetof(tQuantized, normal));
 		}
-	}
 
-	uv_location = -1;
-	if (uvs.size() || spacing)
-	{
 		uv_location = sh->getAttribLocation("a_uv");
 		if (uv_location != -1)
 		{
 			glEnableVertexAttribArray(uv_location);
-			if (uvs_vbo_id || interleaved_vbo_id)
+			glVertexAttribPointer(uv_location, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(tQuantized), (void*)offsetof(tQuantized, uv));
+		}
+	}
+	else
+	{
+		if (vertices_vbo_id || interleaved_vbo_id)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : vertices_vbo_id);
+			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, 0);
+		}
+		else
+			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].vertex : &vertices[0]);
+
+		normal_location = -1;
+		if (normals.size() || normals_vbo_id || spacing)
+		{
+			normal_location = sh->getAttribLocation("a_normal");
+			if (normal_location != -1)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
-				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
+				glEnableVertexAttribArray(normal_location);
+				if (normals_vbo_id || interleaved_vbo_id)
+				{
+					glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
+					glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
+				}
+				else
+					glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].normal : &normals[0]);
+			}
+		}
+
+		uv_location = -1;
+		if (uvs.size() || uvs_vbo_id || spacing)
+		{
+			uv_location = sh->getAttribLocation("a_uv");
+			if (uv_location != -1)
+			{
+				glEnableVertexAttribArray(uv_location);
+				if (uvs_vbo_id || interleaved_vbo_id)
+				{
+					glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
+					glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
+				}
+				else
+					glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].uv : &uvs[0]);
 			}
-			else
-				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].uv : &uvs[0]);
 		}
 	}
 
 	color_location = -1;
-	if (colors.size())
+	if (colors.size() || colors_vbo_id)
 	{
 		color_location = sh->getAttribLocation("a_color");
 		if (color_location != -1)
@@ -166,7 +272,7 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	bones_location = -1;
-	if (bones.size())
+	if (bones.size() || bones_vbo_id)
 	{
 		bones_location = sh->getAttribLocation("a_bones");
 		if (bones_location != -1)
@@ -182,7 +288,7 @@ void Mesh::enableBuffers(Shader* sh)
 		}
 	}
 	weights_location = -1;
-	if (weights.size())
+	if (weights.size() || weights_vbo_id)
 	{
 		weights_location = sh->getAttribLocation("a_weights");
 		if (weights_location != -1)
@@ -197,6 +303,22 @@ void Mesh::enableBuffers(Shader* sh)
 				glVertexAttribPointer(weights_location, 4, GL_FLOAT, GL_FALSE, 0, &weights[0]);
 		}
 	}
+	tangent_location = -1;
+	if (tangents.size() || tangents_vbo_id)
+	{
+		tangent_location = sh->getAttribLocation("a_tangent");
+		if (tangent_location != -1)
+		{
+			glEnableVertexAttribArray(tangent_location);
+			if (tangents_vbo_id)
+			{
+				glBindBuffer(GL_ARRAY_BUFFER, tangents_vbo_id);
+				glVertexAttribPointer(tangent_location, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+			}
+			else
+				glVertexAttribPointer(tangent_location, 4, GL_FLOAT, GL_FALSE, 0, &tangents[0]);
+		}
+	}
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -210,7 +332,10 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	//a binary mesh that was not uploaded is rendered from the vectors
+	if (bin_file && !vertices_vbo_id && !interleaved_vbo_id && !quantized_vbo_id)
+		loadMappedStreams();
+	assert(getNumVertices() && "No vertices in this mesh");
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
@@ -222,14 +347,57 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	disableBuffers(shader);
 }
 
+void Mesh::renderDepth(unsigned int primitive, int submesh_id)
+{
+	Shader* shader = Shader::current;
+	if (!shader || !shader->compiled)
+	{
+		assert(0 && "no shader or shader not compiled or enabled");
+		return;
+	}
+
+	//not in the VRAM, the normal path reads the position from the vectors
+	unsigned int vbo_id = positions_vbo_id ? positions_vbo_id : (interleaved_vbo_id || quantized_vbo_id ? 0 : vertices_vbo_id);
+	if (!vbo_id)
+	{
+		render(primitive, submesh_id);
+		return;
+	}
+
+	vertex_location = shader->getAttribLocation("a_vertex");
+	if (vertex_location == -1)
+		return;
+
+	//same decoding than the main pass, so the depth matches exactly
+	shader->setUniform("u_quantized", quantized_vbo_id ? 1.0f : 0.0f);
+	if (quantized_vbo_id)
+	{
+		shader->setUniform("u_quantization_min", quantization_min);
+		shader->setUniform("u_quantization_size", quantization_size);
+	}
+
+	glEnableVertexAttribArray(vertex_location);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_id);
+	if (quantized_vbo_id)
+		glVertexAttribPointer(vertex_location, 3, GL_UNSIGNED_SHORT, GL_TRUE, 4 * sizeof(unsigned short), 0);
+	else
+		glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	drawCall(primitive, submesh_id, 0);
+
+	glDisableVertexAttribArray(vertex_location);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 {
 	int start = 0;
-	int size = vertices.size();
-	if (indices.size())
-		size = indices.size();
-	else if (interleaved.size())
-		size = interleaved.size();
+	int size = getNumVertices();
+	if (getNumIndices())
+		size = getNumIndices();
+	bool only_visible = num_visible_triangles >= 0 && submesh_id == 0 && num_instances == 0;
+	bool simplified = current_lod > 0 && current_lod <= (int)lods.size() && submesh_id == 0 && num_instances == 0;
 
 	if (submesh_id > 0)
 	{
@@ -240,7 +408,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	}
 
 	//DRAW
-	if (indices.size())
+	if (getNumIndices())
 	{
 		if (num_instances > 0)
 		{
@@ -251,7 +419,29 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		}
 		else
 		{
-			if (indices_vbo_id)
+			//a simplified level, its triangles are in their own buffer
+			if (simplified)
+			{
+				const sMeshLOD& lod = lods[current_lod - 1];
+				size = lod.triangle_count;
+				if (lod_indices_vbo_id)
+				{
+					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lod_indices_vbo_id);
+					glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(lod.triangle_offset * sizeof(Vector3u)));
+					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+				}
+				else
+					glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(&lod_indices[0] + lod.triangle_offset));
+			}
+			//only the meshlets that passed the culling
+			else if (only_visible)
+			{
+				size = num_visible_triangles;
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, visible_indices_vbo_id);
+				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, 0);
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			}
+			else if (indices_vbo_id)
 			{
 				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)));
@@ -271,7 +461,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 
 	assert(glGetError() == GL_NO_ERROR);
 
-	num_triangles_rendered += (size / 3) * (num_instances ? num_instances : 1);
+	num_triangles_rendered += (getNumIndices() ? size : size / 3) * (num_instances ? num_instances : 1);
 	num_meshes_rendered++;
 }
 
@@ -283,6 +473,7 @@ void Mesh::disableBuffers(Shader* shader)
 	if (color_location != -1) glDisableVertexAttribArray(color_location);
 	if (bones_location != -1) glDisableVertexAttribArray(bones_location);
 	if (weights_location != -1) glDisableVertexAttribArray(weights_location);
+	if (tangent_location != -1) glDisableVertexAttribArray(tangent_location);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
 	assert(glGetError() == GL_NO_ERROR);
 }
@@ -332,6 +523,7 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 //super obsolete rendering method, do not use
 void Mesh::renderFixedPipeline(int primitive)
 {
+	loadMappedStreams();
 	assert((vertices.size() || interleaved.size()) && "No vertices in this mesh");
 
 	int interleave_offset = interleaved.size() ? sizeof(tInterleaved) : 0;
@@ -403,7 +595,7 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 {
 	Shader* shader = Shader::current;
 	std::vector<Matrix44> bone_matrices;
-	assert(bones.size());
+	assert(bones.size() || bones_vbo_id);
 	int bones_loc = shader->getUniformLocation("u_bones");
 	if (bones_loc != -1)
 	{
@@ -414,9 +606,36 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 	render(primitive);
 }
 
+//The data of a stream is in the vector or, for binary meshes not loaded to RAM, in the mapped file
+template<typename T> static const T* getStreamData(const std::vector<T>& vector, const Mesh::tStreamView<T>& view, unsigned int& count)
+{
+	if (vector.size())
+	{
+		count = vector.size();
+		return &vector[0];
+	}
+	count = view.size;
+	return view.data;
+}
+
 void Mesh::uploadToVRAM()
 {
-	assert(vertices.size() || interleaved.size());
+	unsigned int num_interleaved, num_vertices_stream, num_normals, num_uvs, num_colors, num_bones, num_weights, num_indices_stream;
+	unsigned int num_quantized;
+	const tQuantized* quantized_data = getStreamData(quantized, mapped.quantized, num_quantized);
+	const tInterleaved* interleaved_data = getStreamData(interleaved, mapped.interleaved, num_interleaved);
+	const Vector3* vertices_data = getStreamData(vertices, mapped.vertices, num_vertices_stream);
+	const Vector3* normals_data = getStreamData(normals, mapped.normals, num_normals);
+	const Vector2* uvs_data = getStreamData(uvs, mapped.uvs, num_uvs);
+	const Vector4* colors_data = getStreamData(colors, mapped.colors, num_colors);
+	const Vector4ub* bones_data = getStreamData(bones, mapped.bones, num_bones);
+	const Vector4* weights_data = getStreamData(weights, mapped.weights, num_weights);
+	unsigned int num_tangents;
+	const Vector4* tangents_data = getStreamData(tangents, mapped.tangents, num_tangents);
+	const Vector3u* indices_data = getStreamData(indices, mapped.indices, num_indices_stream);
+	unsigned int num_lod_indices;
+	const Vector3u* lod_indices_data = getStreamData(lod_indices, mapped.lod_indices, num_lod_indices);
+	assert(num_vertices_stream || num_interleaved || num_quantized);
 
 	if (glGenBuffersARB == 0)
 	{
@@ -424,13 +643,21 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
-	if (interleaved.size())
+	if (num_quantized)
+	{
+		// Compact Vertex,Normal,UV
+		if (quantized_vbo_id == 0)
+			glGenBuffersARB(1, &quantized_vbo_id);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, quantized_vbo_id);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_quantized * sizeof(tQuantized), quantized_data, GL_STATIC_DRAW_ARB);
+	}
+	else if (num_interleaved)
 	{
 		// Vertex,Normal,UV
 		if (interleaved_vbo_id == 0)
 			glGenBuffersARB(1, &interleaved_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_interleaved * sizeof(tInterleaved), interleaved_data, GL_STATIC_DRAW_ARB);
 	}
 	else
 	{
@@ -438,63 +665,115 @@ void Mesh::uploadToVRAM()
 		if (vertices_vbo_id == 0)
 			glGenBuffersARB(1, &vertices_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(Vector3), &vertices[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices_stream * sizeof(Vector3), vertices_data, GL_STATIC_DRAW_ARB);
 
 		// UVs
-		if (uvs.size())
+		if (num_uvs)
 		{
 			if (uvs_vbo_id == 0)
 				glGenBuffersARB(1, &uvs_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2), &uvs[0], GL_STATIC_DRAW_ARB);
+			glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_uvs * sizeof(Vector2), uvs_data, GL_STATIC_DRAW_ARB);
 		}
 
 		// Normals
-		if (normals.size())
+		if (num_normals)
 		{
 			if (normals_vbo_id == 0)
 				glGenBuffersARB(1, &normals_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3), &normals[0], GL_STATIC_DRAW_ARB);
+			glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_normals * sizeof(Vector3), normals_data, GL_STATIC_DRAW_ARB);
 		}
 	}
 
 	// Colors
-	if (colors.size())
+	if (num_colors)
 	{
 		if (colors_vbo_id == 0)
 			glGenBuffersARB(1, &colors_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, colors_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(Vector4), &colors[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_colors * sizeof(Vector4), colors_data, GL_STATIC_DRAW_ARB);
 	}
 
-	if (bones.size())
+	if (num_bones)
 	{
 		if (bones_vbo_id == 0)
 			glGenBuffersARB(1, &bones_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(Vector4ub), &bones[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_bones * sizeof(Vector4ub), bones_data, GL_STATIC_DRAW_ARB);
 	}
-	if (weights.size())
+	if (num_weights)
 	{
 		if (weights_vbo_id == 0)
 			glGenBuffersARB(1, &weights_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, weights_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, weights.size() * sizeof(Vector4), &weights[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_weights * sizeof(Vector4), weights_data, GL_STATIC_DRAW_ARB);
+	}
+	if (num_tangents)
+	{
+		if (tangents_vbo_id == 0)
+			glGenBuffersARB(1, &tangents_vbo_id);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, tangents_vbo_id);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_tangents * sizeof(Vector4), tangents_data, GL_STATIC_DRAW_ARB);
+	}
+
+	// Positions only, the depth pre-pass fetches 8 or 12 bytes per vertex instead of the whole vertex
+	if (position_streams && (num_quantized || num_interleaved))
+	{
+		if (positions_vbo_id == 0)
+			glGenBuffersARB(1, &positions_vbo_id);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, positions_vbo_id);
+		if (num_quantized)
+		{
+			std::vector<unsigned short> positions(num_quantized * 4);
+			for (unsigned int i = 0; i < num_quantized; ++i)
+				for (int j = 0; j < 4; ++j)
+					positions[i * 4 + j] = quantized_data[i].vertex[j];
+			glBufferDataARB(GL_ARRAY_BUFFER_ARB, positions.size() * sizeof(unsigned short), &positions[0], GL_STATIC_DRAW_ARB);
+		}
+		else
+		{
+			std::vector<Vector3> positions(num_interleaved);
+			for (unsigned int i = 0; i < num_interleaved; ++i)
+				positions[i] = interleaved_data[i].vertex;
+			glBufferDataARB(GL_ARRAY_BUFFER_ARB, positions.size() * sizeof(Vector3), &positions[0], GL_STATIC_DRAW_ARB);
+		}
 	}
 
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
 	// Indices
-	if (indices.size())
+	if (num_indices_stream)
 	{
 		if (indices_vbo_id == 0)
 			glGenBuffersARB(1, &indices_vbo_id);
 		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(Vector3u), &indices[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, num_indices_stream * sizeof(Vector3u), indices_data, GL_STATIC_DRAW_ARB);
+	}
+
+	// Simplified levels
+	if (num_lod_indices)
+	{
+		if (lod_indices_vbo_id == 0)
+			glGenBuffersARB(1, &lod_indices_vbo_id);
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, lod_indices_vbo_id);
+		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, num_lod_indices * sizeof(Vector3u), lod_indices_data, GL_STATIC_DRAW_ARB);
 	}
+
+	num_vertices = num_quantized ? num_quantized : num_interleaved ? num_interleaved : num_vertices_stream;
+	num_indices = num_indices_stream;
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+	//for the memory report
+	if (num_quantized)
+		vram_bytes = num_quantized * sizeof(tQuantized) + (positions_vbo_id ? num_quantized * 4 * sizeof(unsigned short) : 0);
+	else if (num_interleaved)
+		vram_bytes = num_interleaved * sizeof(tInterleaved) + (positions_vbo_id ? num_interleaved * sizeof(Vector3) : 0);
+	else
+		vram_bytes = num_vertices_stream * sizeof(Vector3) + num_uvs * sizeof(Vector2) + num_normals * sizeof(Vector3);
+	vram_bytes += num_colors * sizeof(Vector4) + num_bones * sizeof(Vector4ub) + num_weights * sizeof(Vector4) + num_tangents * sizeof(Vector4);
+	vram_bytes += (num_indices_stream + num_lod_indices) * sizeof(Vector3u);
+
 
 
 	checkGLErrors();
@@ -502,11 +781,104 @@ void Mesh::uploadToVRAM()
 	//clear buffers to save memory
 }
 
+template<typename T> static size_t vectorBytes(const std::vector<T>& v) { return v.capacity() * sizeof(T); }
+template<typename T> static void freeVector(std::vector<T>& v) { std::vector<T>().swap(v); }
+
+void Mesh::applyResidency()
+{
+	if (!vertices_vbo_id && !interleaved_vbo_id && !quantized_vbo_id)
+		return;
+
+	//the mapping would lock the .mbin (on Windows it can't be written again), everything is kept in the vectors
+	if (residency == RESIDENCY_KEEP)
+	{
+		loadMappedStreams();
+
+		//the quantized vertices are the only copy, the floats are decoded again when the CPU needs them
+		if (quantized_vbo_id && quantized.size())
+		{
+			freeVector(interleaved);
+			freeVector(vertices);
+			freeVector(normals);
+			freeVector(uvs);
+		}
+		return;
+	}
+
+	bool keep_positions = residency == RESIDENCY_COLLISION;
+	bool keep_indices = keep_positions || meshlets.size(); //the meshlet culling builds the visible indices from them
+
+	//the mapped file is closed, the streams that stay are copied to the vectors
+	if (keep_positions || keep_indices)
+		loadMappedStreams();
+	releaseMappedFile();
+
+	//the collisions only read the positions, they don't need the rest of the interleaved vertex
+	if (keep_positions && vertices.empty() && interleaved.size())
+	{
+		vertices.resize(interleaved.size());
+		for (unsigned int i = 0; i < interleaved.size(); ++i)
+			vertices[i] = interleaved[i].vertex;
+	}
+
+	if (!keep_positions)
+		freeVector(vertices);
+	if (!keep_indices)
+		freeVector(indices);
+	freeVector(normals);
+	freeVector(uvs);
+	freeVector(colors);
+	freeVector(interleaved);
+	freeVector(quantized);
+	freeVector(lod_indices);
+	freeVector(bones);
+	freeVector(weights);
+	freeVector(tangents);
+}
+
+size_t Mesh::getCPUMemory()
+{
+	size_t bytes = vectorBytes(vertices) + vectorBytes(normals) + vectorBytes(uvs) + vectorBytes(colors) + vectorBytes(interleaved) + vectorBytes(quantized);
+	bytes += vectorBytes(indices) + vectorBytes(visible_indices) + vectorBytes(lod_indices) + vectorBytes(meshlets) + vectorBytes(lods);
+	bytes += vectorBytes(bones) + vectorBytes(weights) + vectorBytes(tangents);
+	if (bvh)
+		bytes += vectorBytes(bvh->nodes) + vectorBytes(bvh->triangles) + vectorBytes(bvh->triangle_ids);
+	if (bin_file)
+		bytes += bin_file->size;
+	return bytes;
+}
+
 bool Mesh::createCollisionModel(bool is_static)
+{
+	if (bvh)
+		return true;
+
+	loadMappedStreams();
+
+	const Vector3* positions = interleaved.size() ? &interleaved[0].vertex : (vertices.size() ? &vertices[0] : NULL);
+	unsigned int stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3);
+	if (!positions)
+	{
+		assert(0 && "mesh without vertices, cannot create collision model");
+		return false;
+	}
+
+	bvh = new BVH();
+	if (indices.size()) //indexed
+		bvh->build(positions, stride, &indices[0].x, indices.size());
+	else //triangle soup, interleaved or not
+		bvh->build(positions, stride, NULL, getNumVertices() / 3);
+	return true;
+}
+
+//old collision model, only kept to compare it with the BVH
+bool Mesh::createColdetModel(bool is_static)
 {
 	if (collision_model)
 		return true;
 
+	loadMappedStreams();
+
 	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
 
 	if (indices.size()) //indexed
@@ -562,67 +934,206 @@ bool Mesh::createCollisionModel(bool is_static)
 	return true;
 }
 
+void Mesh::releaseCollisionModel()
+{
+	if (bvh)
+		delete bvh;
+	bvh = NULL;
+	if (collision_model)
+		delete (CollisionModel3D*)collision_model;
+	collision_model = NULL;
+}
+
 //help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
-bool Mesh::testRayCollision(Matrix44 model, Vector3 start, Vector3 front, Vector3& collision, Vector3& normal, float max_ray_dist, bool in_object_space )
+bool Mesh::testRayCollision(const Matrix44& model, Vector3 start, Vector3 front, Vector3& collision, Vector3& normal, float max_ray_dist, bool in_object_space )
 {
-	if (!this->collision_model)
+	if (!bvh)
 		if (!createCollisionModel())
 			return false;
 
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
+	//the ray is moved to object space, the direction is not normalized so the distance is still in world units
+	Matrix44 inv = model;
+	inv.inverse();
+	Vector3 origin = inv * start;
+	Vector3 direction = inv.rotateVector(front);
 
-	collision_model->setTransform( model.m );
-	if (collision_model->rayCollision( start.v , front.v, true,0.0, max_ray_dist) == false)
+	float t;
+	unsigned int triangle;
+	if (!bvh->testRay(origin, direction, max_ray_dist, t, triangle))
 		return false;
 
-	collision_model->getCollisionPoint( collision.v, in_object_space);
-
-	float t1[9],t2[9];
-	collision_model->getCollidingTriangles(t1,t2, in_object_space);
-
-	Vector3 v1;
-	Vector3 v2;
-	v1=Vector3(t1[3]-t1[0],t1[4]-t1[1],t1[5]-t1[2]);
-	v2=Vector3(t1[6]-t1[0],t1[7]-t1[1],t1[8]-t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+	const BVH::sTriangle& tri = bvh->triangles[triangle];
+	collision = origin + direction * t;
+	if (in_object_space)
+		normal = tri.edge1.cross(tri.edge2);
+	else
+	{
+		collision = model * collision;
+		normal = model.rotateVector(tri.edge1).cross(model.rotateVector(tri.edge2));
+	}
+	normal.normalize();
 
 	return true;
 }
 
-bool Mesh::testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal)
+bool Mesh::testSphereCollision(const Matrix44& model, Vector3 center, float radius, Vector3& collision, Vector3& normal)
 {
-	if (!this->collision_model)
+	if (!bvh)
 		if (!createCollisionModel())
 			return false;
 
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
+	//with a non uniform scale the sphere is not a sphere in object space, the smallest scale is used to not miss collisions
+	Matrix44 inv = model;
+	inv.inverse();
+	float scale = std::min(Vector3(model.m[0], model.m[1], model.m[2]).length(), std::min(Vector3(model.m[4], model.m[5], model.m[6]).length(), Vector3(model.m[8], model.m[9], model.m[10]).length()));
+	if (scale <= 0.0f)
+		return false;
 
-	collision_model->setTransform(model.m);
-	if (collision_model->sphereCollision(center.v, radius) == false)
+	unsigned int triangle;
+	if (!bvh->testSphere(inv * center, radius / scale, collision, triangle))
 		return false;
 
-	collision_model->getCollisionPoint(collision.v, false);
+	const BVH::sTriangle& tri = bvh->triangles[triangle];
+	collision = model * collision;
+	normal = model.rotateVector(tri.edge1).cross(model.rotateVector(tri.edge2));
+	normal.normalize();
+
+	return true;
+}
+
+#define RAY_PACKET_SIZE 256
+
+int Mesh::testRayCollisionBatch(const Matrix44& model, int num_rays, const Vector3* ray_origins, const Vector3* ray_directions, float* distances, Vector3* collisions, Vector3* normals, float max_ray_dist, bool in_object_space)
+{
+	if (!bvh)
+		if (!createCollisionModel())
+			return 0;
+
+	//the inverse is computed once for all the rays
+	Matrix44 inv = model;
+	inv.inverse();
+
+	std::atomic<int> num_hits(0);
+	int num_packets = (num_rays + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE;
+	parallelFor(num_packets, [&](int packet) {
+		int start = packet * RAY_PACKET_SIZE;
+		int end = std::min(start + RAY_PACKET_SIZE, num_rays);
+		int hits = 0;
+		for (int i = start; i < end; ++i)
+		{
+			Vector3 origin = inv * ray_origins[i];
+			Vector3 direction = inv.rotateVector(ray_directions[i]);
+			float t;
+			unsigned int triangle;
+			if (!bvh->testRay(origin, direction, max_ray_dist, t, triangle))
+			{
+				distances[i] = -1.0f;
+				continue;
+			}
 
-	float t1[9], t2[9];
-	collision_model->getCollidingTriangles(t1, t2, false);
+			hits++;
+			distances[i] = t;
+			const BVH::sTriangle& tri = bvh->triangles[triangle];
+			if (collisions)
+				collisions[i] = in_object_space ? origin + direction * t : model * (origin + direction * t);
+			if (normals)
+			{
+				normals[i] = in_object_space ? tri.edge1.cross(tri.edge2) : model.rotateVector(tri.edge1).cross(model.rotateVector(tri.edge2));
+				normals[i].normalize();
+			}
+		}
+		num_hits += hits;
+	});
 
-	Vector3 v1;
-	Vector3 v2;
-	v1 = Vector3(t1[3] - t1[0], t1[4] - t1[1], t1[5] - t1[2]);
-	v2 = Vector3(t1[6] - t1[0], t1[7] - t1[1], t1[8] - t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+	return num_hits;
+}
 
-	return true;
+void Mesh::benchmarkCollision(const char* filename, int num_rays)
+{
+	//the asset and the terrain plane of the scene, displaced like in height.vs
+	Mesh obj;
+	obj.loadOBJ(filename);
+	obj.weldVertices();
+
+	Mesh terrain;
+	terrain.createSubdividedPlane(100.0, 512, true);
+	terrain.weldVertices();
+	Image heightmap;
+	if (heightmap.loadTGA("data/textures/Menorca_gray.tga"))
+		terrain.displace(&heightmap, 9.0f);
+
+	Mesh* meshes[2] = { &obj, &terrain };
+	const char* names[2] = { filename, "terrain plane" };
+	for (int m = 0; m < 2; ++m)
+	{
+		Mesh* mesh = meshes[m];
+		if (!mesh->getNumVertices())
+			continue;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		mesh->createColdetModel(true);
+		double coldet_build = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		start = std::chrono::high_resolution_clock::now();
+		mesh->createCollisionModel();
+		double bvh_build = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		if (!mesh->bvh || mesh->bvh->nodes.empty())
+			continue;
+
+		//rays from the bounding sphere to random points of the box, the box of the BVH root works for every vertex format
+		Vector3 min_pos(1e10f, 1e10f, 1e10f), max_pos(-1e10f, -1e10f, -1e10f);
+		const BVH::sNode& root = mesh->bvh->nodes[0];
+		for (int i = 0; i < 4; ++i)
+		{
+			if (root.count[i] < 0)
+				continue;
+			min_pos.set(std::min(min_pos.x, root.min_x[i]), std::min(min_pos.y, root.min_y[i]), std::min(min_pos.z, root.min_z[i]));
+			max_pos.set(std::max(max_pos.x, root.max_x[i]), std::max(max_pos.y, root.max_y[i]), std::max(max_pos.z, root.max_z[i]));
+		}
+		Vector3 center = (min_pos + max_pos) * 0.5f;
+		float sphere_radius = (max_pos - min_pos).length();
+		std::vector<Vector3> origins(num_rays), directions(num_rays);
+		for (int i = 0; i < num_rays; ++i)
+		{
+			Vector3 dir = Vector3(random(2.0f, -1.0f), random(2.0f, -1.0f), random(2.0f, -1.0f));
+			if (dir.length() < 0.001f)
+				dir.set(0.0f, 1.0f, 0.0f);
+			origins[i] = center + dir.normalize() * sphere_radius;
+			Vector3 target(min_pos.x + random(max_pos.x - min_pos.x), min_pos.y + random(max_pos.y - min_pos.y), min_pos.z + random(max_pos.z - min_pos.z));
+			directions[i] = (target - origins[i]).normalize();
+		}
+
+		CollisionModel3D* coldet = (CollisionModel3D*)mesh->collision_model;
+		Matrix44 identity;
+		coldet->setTransform(identity.m);
+		int coldet_hits = 0;
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < num_rays; ++i)
+			coldet_hits += coldet->rayCollision(origins[i].v, directions[i].v, true, 0.0f, 3.4e+38F) ? 1 : 0;
+		double coldet_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		int bvh_hits = 0;
+		float t;
+		unsigned int triangle;
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < num_rays; ++i)
+			bvh_hits += mesh->bvh->testRay(origins[i], directions[i], 3.4e+38F, t, triangle) ? 1 : 0;
+		double bvh_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		std::vector<float> distances(num_rays);
+		start = std::chrono::high_resolution_clock::now();
+		int batch_hits = mesh->testRayCollisionBatch(Matrix44(), num_rays, &origins[0], &directions[0], &distances[0]);
+		double batch_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		std::cout << " + Collision benchmark: " << names[m] << " (" << mesh->getNumIndices() << " triangles, " << num_rays << " rays)" << std::endl;
+		std::cout << "   coldet: build " << coldet_build * 1000.0 << " ms, " << num_rays / coldet_time / 1000000.0 << " Mrays/s, " << coldet_hits << " hits" << std::endl;
+		std::cout << "   BVH:    build " << bvh_build * 1000.0 << " ms, " << num_rays / bvh_time / 1000000.0 << " Mrays/s, " << bvh_hits << " hits, " << mesh->bvh->nodes.size() << " nodes" << std::endl;
+		std::cout << "   batch:  " << num_rays / batch_time / 1000000.0 << " Mrays/s, " << batch_hits << " hits" << std::endl;
+	}
 }
 
 bool Mesh::interleaveBuffers()
 {
+	loadMappedStreams();
 	if (!vertices.size() || !normals.size() || !uvs.size())
 		return false;
 
@@ -644,128 +1155,1237 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
-typedef struct 
+static unsigned short floatToHalf(float value)
 {
-	int version;
-	int header_bytes;
-	int size;
-	int num_indices;
-	Vector3 aabb_min;
-	Vector3	aabb_max;
-	Vector3	center;
-	Vector3	halfsize;
-	float radius;
-	int num_bones;
-	int material_range[4];
-	Matrix44 bind_matrix;
-	char streams[8]; //Normal|Uvs|Color|Indices|Bones|Weights|Extra
-	char extra[32]; //unused
-} sMeshInfo;
+	unsigned int f;
+	memcpy(&f, &value, sizeof(float));
+	unsigned int sign = (f >> 16) & 0x8000;
+	int exponent = (int)((f >> 23) & 0xFF) - 127 + 15;
+	unsigned int mantissa = f & 0x7FFFFF;
+	if (exponent <= 0) //too small, flushed to zero
+		return sign;
+	if (exponent >= 31) //too big, clamped to infinity
+		return sign | 0x7C00;
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	return half + ((mantissa >> 12) & 1); //round to nearest
+}
 
-bool Mesh::readBin(const char* filename)
+static float halfToFloat(unsigned short half)
 {
-	FILE *f;
-	assert(filename);
-
-	struct stat stbuffer;
-
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
-		return false;
-
-	unsigned int size = stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
+	unsigned int exponent = (half >> 10) & 0x1F;
+	unsigned int f = (half & 0x8000) << 16;
+	if (exponent == 31)
+		f |= 0x7F800000 | ((half & 0x3FF) << 13);
+	else if (exponent)
+		f |= ((exponent - 15 + 127) << 23) | ((half & 0x3FF) << 13);
+	float value;
+	memcpy(&value, &f, sizeof(float));
+	return value;
+}
 
-	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+//octahedron encoding, the normal is projected on the octahedron and the lower half is folded over the upper one
+static void octEncode(Vector3 n, short* result)
+{
+	float sum = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	if (sum == 0.0f)
 	{
-		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
-		return false;
+		n.set(0.0f, 1.0f, 0.0f);
+		sum = 1.0f;
 	}
-
-	char* pos = data + 4;
-	sMeshInfo info;
-	memcpy(&info,pos,sizeof(sMeshInfo));
-	pos += sizeof(sMeshInfo);
-
-	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
+	float x = n.x / sum;
+	float y = n.y / sum;
+	if (n.z < 0.0f)
 	{
-		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
-		return false;
+		float folded_x = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = folded_x;
 	}
+	result[0] = (short)floor(clamp(x, -1.0f, 1.0f) * 32767.0f + 0.5f);
+	result[1] = (short)floor(clamp(y, -1.0f, 1.0f) * 32767.0f + 0.5f);
+}
 
-	if (info.streams[0] == 'I')
+static Vector3 octDecode(const short* e)
+{
+	Vector3 n(e[0] / 32767.0f, e[1] / 32767.0f, 0.0f);
+	n.z = 1.0f - fabs(n.x) - fabs(n.y);
+	if (n.z < 0.0f)
 	{
-		interleaved.resize(info.size);
-		memcpy((void*)&interleaved[0], pos, sizeof(tInterleaved) * info.size);
-		pos += sizeof(tInterleaved) * info.size;
+		float x = n.x;
+		n.x = (1.0f - fabs(n.y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		n.y = (1.0f - fabs(x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
 	}
+	return n.normalize();
+}
 
-	if (info.streams[0] == 'V')
-	{
-		vertices.resize(info.size);
-		memcpy((void*)&vertices[0], pos, sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
-	}
+bool Mesh::quantizeBuffers()
+{
+	loadMappedStreams();
 
-	if (info.streams[1] == 'N')
-	{
-		normals.resize(info.size);
-		memcpy((void*)&normals[0],pos,sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
-	}
+	bool is_interleaved = interleaved.size() != 0;
+	unsigned int num = getNumVertices();
+	if (!num || bones.size())
+		return false;
 
-	if (info.streams[2] == 'U')
+	//the positions are stored relative to their own box
+	Vector3 max_pos;
+	quantization_min = max_pos = is_interleaved ? interleaved[0].vertex : vertices[0];
+	for (unsigned int i = 0; i < num; ++i)
 	{
-		uvs.resize(info.size);
-		memcpy((void*)&uvs[0],pos,sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		const Vector3& v = is_interleaved ? interleaved[i].vertex : vertices[i];
+		quantization_min.set(std::min(quantization_min.x, v.x), std::min(quantization_min.y, v.y), std::min(quantization_min.z, v.z));
+		max_pos.set(std::max(max_pos.x, v.x), std::max(max_pos.y, v.y), std::max(max_pos.z, v.z));
 	}
+	quantization_size = max_pos - quantization_min;
+	Vector3 inv_size(quantization_size.x > 0.0f ? 1.0f / quantization_size.x : 0.0f, quantization_size.y > 0.0f ? 1.0f / quantization_size.y : 0.0f, quantization_size.z > 0.0f ? 1.0f / quantization_size.z : 0.0f);
 
-	if (info.streams[3] == 'C')
+	quantized.resize(num);
+	for (unsigned int i = 0; i < num; ++i)
 	{
-		colors.resize(info.size);
-		memcpy((void*)&colors[0],pos,sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		tQuantized& q = quantized[i];
+		Vector3 v = is_interleaved ? interleaved[i].vertex : vertices[i];
+		Vector3 n = is_interleaved ? interleaved[i].normal : (normals.size() ? normals[i] : Vector3(0.0f, 1.0f, 0.0f));
+		Vector2 uv = is_interleaved ? interleaved[i].uv : (uvs.size() ? uvs[i] : Vector2(0.0f, 0.0f));
+		q.vertex[0] = (unsigned short)floor(clamp((v.x - quantization_min.x) * inv_size.x, 0.0f, 1.0f) * 65535.0f + 0.5f);
+		q.vertex[1] = (unsigned short)floor(clamp((v.y - quantization_min.y) * inv_size.y, 0.0f, 1.0f) * 65535.0f + 0.5f);
+		q.vertex[2] = (unsigned short)floor(clamp((v.z - quantization_min.z) * inv_size.z, 0.0f, 1.0f) * 65535.0f + 0.5f);
+		q.vertex[3] = 0;
+		octEncode(n, q.normal);
+		q.uv[0] = floatToHalf(uv.x);
+		q.uv[1] = floatToHalf(uv.y);
 	}
 
-	if (info.streams[4] == 'I')
-	{
-		indices.resize(info.num_indices);
-		memcpy((void*)&indices[0], pos, sizeof(Vector3u) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
-	}
+	loadLog() << " + Quantized: " << (num * sizeof(tInterleaved)) / 1024 << "KB -> " << (num * sizeof(tQuantized)) / 1024 << "KB" << std::endl;
+	return true;
+}
 
-	if (info.streams[5] == 'B')
+void Mesh::dequantizeBuffers()
+{
+	interleaved.resize(quantized.size());
+	for (unsigned int i = 0; i < quantized.size(); ++i)
 	{
-		bones.resize(info.size);
-		memcpy((void*)&bones[0], pos, sizeof(Vector4ub) * info.size);
-		pos += sizeof(Vector4ub) * info.size;
+		const tQuantized& q = quantized[i];
+		tInterleaved& v = interleaved[i];
+		v.vertex.set(quantization_min.x + q.vertex[0] / 65535.0f * quantization_size.x, quantization_min.y + q.vertex[1] / 65535.0f * quantization_size.y, quantization_min.z + q.vertex[2] / 65535.0f * quantization_size.z);
+		v.normal = octDecode(q.normal);
+		v.uv.set(halfToFloat(q.uv[0]), halfToFloat(q.uv[1]));
 	}
+}
 
-	if (info.streams[6] == 'W')
-	{
-		weights.resize(info.size);
-		memcpy((void*)&weights[0], pos, sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
-	}
+bool Mesh::buildMeshlets(unsigned int max_vertices, unsigned int max_triangles)
+{
+	loadMappedStreams();
+	meshlets.clear();
 
-	if (info.num_bones)
+	unsigned int num_tris = indices.size();
+	unsigned int num = getNumVertices();
+	if (!num_tris || (!interleaved.size() && !vertices.size()))
+		return false;
+
+	const Vector3* positions = interleaved.size() ? &interleaved[0].vertex : &vertices[0];
+	unsigned int stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3);
+	#define POSITION(v) (*(const Vector3*)((const char*)positions + (v) * stride))
+
+	//the triangles are already in cache order, consecutive triangles are grouped until a limit is reached
+	std::vector<unsigned int> used_in(num, 0xFFFFFFFF);
+	unsigned int next_range = 0;
+	sMeshlet meshlet;
+	memset(&meshlet, 0, sizeof(sMeshlet));
+
+	for (unsigned int i = 0; i <= num_tris; ++i)
 	{
-		bones_info.resize(info.num_bones);
-		memcpy((void*)&bones_info[0], pos, sizeof(BoneInfo) * info.num_bones);
-		pos += sizeof(BoneInfo) * info.num_bones;
-	}
+		bool submesh_end = next_range < material_range.size() && i == material_range[next_range];
+		if (submesh_end)
+			next_range++;
 
-	aabb_max = info.aabb_max;
-	aabb_min = info.aabb_min;
+		int new_vertices = 0;
+		if (i < num_tris)
+			for (int k = 0; k < 3; ++k)
+				new_vertices += used_in[indices[i].v[k]] != meshlets.size() ? 1 : 0;
+
+		//close the current meshlet
+		if (meshlet.triangle_count && (i == num_tris || submesh_end || meshlet.vertex_count + new_vertices > max_vertices || meshlet.triangle_count == max_triangles))
+		{
+			Vector3 min_pos = POSITION(indices[meshlet.triangle_offset].x);
+			Vector3 max_pos = min_pos;
+			Vector3 axis;
+			for (unsigned int j = meshlet.triangle_offset; j < meshlet.triangle_offset + meshlet.triangle_count; ++j)
+			{
+				const Vector3& a = POSITION(indices[j].x);
+				const Vector3& b = POSITION(indices[j].y);
+				const Vector3& c = POSITION(indices[j].z);
+				for (const Vector3* p : { &a, &b, &c })
+				{
+					min_pos.set(std::min(min_pos.x, p->x), std::min(min_pos.y, p->y), std::min(min_pos.z, p->z));
+					max_pos.set(std::max(max_pos.x, p->x), std::max(max_pos.y, p->y), std::max(max_pos.z, p->z));
+				}
+				Vector3 n = (b - a).cross(c - a);
+				if (n.length() > 0.0f)
+					axis = axis + n.normalize();
+			}
+
+			meshlet.center = (min_pos + max_pos) * 0.5f;
+			meshlet.radius = 0.0f;
+			for (unsigned int j = meshlet.triangle_offset * 3; j < (meshlet.triangle_offset + meshlet.triangle_count) * 3; ++j)
+				meshlet.radius = std::max(meshlet.radius, (float)(POSITION((&indices[0].x)[j]) - meshlet.center).length());
+
+			//the cone contains all the normals, if they spread too much it cannot be used
+			meshlet.cone_axis = axis.length() > 0.0f ? axis.normalize() : Vector3(0.0f, 1.0f, 0.0f);
+			float min_dot = axis.length() > 0.0f ? 1.0f : -1.0f;
+			for (unsigned int j = meshlet.triangle_offset; j < meshlet.triangle_offset + meshlet.triangle_count; ++j)
+			{
+				const Vector3& a = POSITION(indices[j].x);
+				Vector3 n = (POSITION(indices[j].y) - a).cross(POSITION(indices[j].z) - a);
+				if (n.length() > 0.0f)
+					min_dot = std::min(min_dot, n.normalize().dot(meshlet.cone_axis));
+			}
+			meshlet.cone_cutoff = min_dot <= 0.1f ? 1.0f : sqrt(1.0f - min_dot * min_dot);
+
+			meshlets.push_back(meshlet);
+			memset(&meshlet, 0, sizeof(sMeshlet));
+			meshlet.triangle_offset = i;
+			new_vertices = 0;
+			if (i < num_tris)
+				for (int k = 0; k < 3; ++k)
+					new_vertices += used_in[indices[i].v[k]] != meshlets.size() ? 1 : 0;
+		}
+
+		if (i == num_tris)
+			break;
+
+		for (int k = 0; k < 3; ++k)
+			used_in[indices[i].v[k]] = meshlets.size();
+		meshlet.vertex_count += new_vertices;
+		meshlet.triangle_count++;
+	}
+	#undef POSITION
+
+	loadLog() << " + Meshlets: " << meshlets.size() << " (" << num_tris / (float)meshlets.size() << " triangles each)" << std::endl;
+	return true;
+}
+
+unsigned int Mesh::findVisibleMeshlets(const Matrix44& model, Camera* camera, std::vector<unsigned int>& visible, bool backface_culling)
+{
+	visible.clear();
+
+	//the cones only work if the scale is uniform
+	Vector3 scale(Vector3(model.m[0], model.m[1], model.m[2]).length(), Vector3(model.m[4], model.m[5], model.m[6]).length(), Vector3(model.m[8], model.m[9], model.m[10]).length());
+	float max_scale = std::max(scale.x, std::max(scale.y, scale.z));
+	float min_scale = std::min(scale.x, std::min(scale.y, scale.z));
+	backface_culling = backface_culling && min_scale > 0.0f && max_scale / min_scale < 1.01f;
+
+	unsigned int num_triangles = 0;
+	for (unsigned int i = 0; i < meshlets.size(); ++i)
+	{
+		const sMeshlet& meshlet = meshlets[i];
+		Vector3 center = model * meshlet.center;
+		float radius = meshlet.radius * max_scale;
+		if (camera->testSphereInFrustum(center, radius) == CLIP_OUTSIDE)
+			continue;
+
+		//all the triangles face away from the camera
+		if (backface_culling && meshlet.cone_cutoff < 1.0f)
+		{
+			Vector3 axis = model.rotateVector(meshlet.cone_axis);
+			axis.normalize();
+			Vector3 to_center = center - camera->eye;
+			if (to_center.dot(axis) >= meshlet.cone_cutoff * to_center.length() + radius)
+				continue;
+		}
+
+		visible.push_back(i);
+		num_triangles += meshlet.triangle_count;
+	}
+	return num_triangles;
+}
+
+bool Mesh::cullMeshlets(const Matrix44& model, Camera* camera, bool count_culled)
+{
+	num_visible_triangles = -1;
+	const Vector3u* tris = indices.size() ? &indices[0] : mapped.indices.data;
+	if (meshlets.size() < 2 || !tris)
+		return false;
+
+	//same view than the last time, the buffer is still valid
+	if (visible_indices_vbo_id && memcmp(last_cull_viewprojection.m, camera->viewprojection_matrix.m, sizeof(Matrix44)) == 0 && memcmp(last_cull_model.m, model.m, sizeof(Matrix44)) == 0)
+	{
+		num_visible_triangles = visible_indices.size();
+		if (count_culled)
+			num_triangles_culled += getNumIndices() - num_visible_triangles;
+		return true;
+	}
+	last_cull_viewprojection = camera->viewprojection_matrix;
+	last_cull_model = model;
+
+	GLint cull_mode = 0;
+	glGetIntegerv(GL_CULL_FACE_MODE, &cull_mode);
+	bool backface_culling = glIsEnabled(GL_CULL_FACE) && cull_mode == GL_BACK;
+
+	std::vector<unsigned int> visible;
+	visible.reserve(meshlets.size());
+	visible_indices.resize(findVisibleMeshlets(model, camera, visible, backface_culling));
+
+	//compact the triangles of the visible meshlets
+	Vector3u* dest = visible_indices.size() ? &visible_indices[0] : NULL;
+	for (unsigned int i = 0; i < visible.size(); ++i)
+	{
+		const sMeshlet& meshlet = meshlets[visible[i]];
+		memcpy(dest, tris + meshlet.triangle_offset, meshlet.triangle_count * sizeof(Vector3u));
+		dest += meshlet.triangle_count;
+	}
+
+	if (visible_indices_vbo_id == 0)
+		glGenBuffersARB(1, &visible_indices_vbo_id);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, visible_indices_vbo_id);
+	glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, visible_indices.size() * sizeof(Vector3u), dest ? &visible_indices[0] : NULL, GL_STREAM_DRAW_ARB);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	num_visible_triangles = visible_indices.size();
+	if (count_culled)
+		num_triangles_culled += getNumIndices() - num_visible_triangles;
+	return true;
+}
+
+void Mesh::reportMeshletCulling(const Matrix44& model, Camera* camera, int steps)
+{
+	if (!meshlets.size())
+		return;
+
+	//orbit around the mesh keeping the distance and the height of the camera
+	Camera orbit = *camera;
+	Vector3 target = model * box.center;
+	Vector3 offset = camera->eye - target;
+	float distance = sqrt(offset.x * offset.x + offset.z * offset.z);
+	if (distance < 0.001f)
+		distance = radius * 2.0f;
+
+	std::vector<unsigned int> visible;
+	double culled_frustum = 0.0;
+	double culled_total = 0.0;
+	for (int i = 0; i < steps; ++i)
+	{
+		float angle = i * 2.0f * (float)PI / steps;
+		orbit.lookAt(target + Vector3(sin(angle) * distance, offset.y, cos(angle) * distance), target, Vector3(0.0f, 1.0f, 0.0f));
+		culled_frustum += 1.0 - findVisibleMeshlets(model, &orbit, visible, false) / (double)getNumIndices();
+		culled_total += 1.0 - findVisibleMeshlets(model, &orbit, visible, true) / (double)getNumIndices();
+	}
+
+	std::cout << " + Meshlet culling orbit (" << meshlets.size() << " meshlets, " << steps << " views): " << 100.0 * culled_frustum / steps << "% culled by the frustum, " << 100.0 * culled_total / steps << "% with the normal cones" << std::endl;
+}
+
+bool Mesh::weldVertices(float epsilon)
+{
+	loadMappedStreams();
+
+	bool is_interleaved = interleaved.size() != 0;
+	unsigned int num = getNumVertices();
+	if (indices.size() || num == 0 || num % 3 != 0 || bones.size() || weights.size())
+		return false;
+
+	//all the attributes of a vertex as a row of floats, the welded vertices must match in all of them
+	int num_floats = 3 + (is_interleaved ? 5 : (normals.size() ? 3 : 0) + (uvs.size() ? 2 : 0)) + (colors.size() ? 4 : 0);
+	std::vector<float> attributes(num * num_floats);
+	for (unsigned int i = 0; i < num; ++i)
+	{
+		float* row = &attributes[i * num_floats];
+		if (is_interleaved)
+		{
+			memcpy(row, &interleaved[i], sizeof(tInterleaved));
+			row += 8;
+		}
+		else
+		{
+			memcpy(row, &vertices[i], sizeof(Vector3));
+			row += 3;
+			if (normals.size())
+			{
+				memcpy(row, &normals[i], sizeof(Vector3));
+				row += 3;
+			}
+			if (uvs.size())
+			{
+				memcpy(row, &uvs[i], sizeof(Vector2));
+				row += 2;
+			}
+		}
+		if (colors.size())
+			memcpy(row, &colors[i], sizeof(Vector4));
+	}
+
+	//hash of the position cell, every cell keeps a list of the welded vertices inside it.
+	//The cells are 2 epsilon wide, so a vertex within epsilon is in the same cell or in the neighbour of the closest side
+	float inv_cell = 1.0f / (2.0f * std::max(epsilon, 0.0000001f));
+	std::unordered_map<unsigned long long, unsigned int> cell_first;
+	cell_first.reserve(num);
+	std::vector<unsigned int> cell_next;
+	std::vector<unsigned int> remap(num);
+	std::vector<unsigned int> unique; //source vertex of every welded vertex
+	const unsigned int none = 0xFFFFFFFF;
+
+	for (unsigned int i = 0; i < num; ++i)
+	{
+		const float* row = &attributes[i * num_floats];
+
+		//the vertex can be in the same cell or in the neighbour one of the closest border, check the closest 8
+		long long cell[3];
+		long long neighbour[3];
+		for (int a = 0; a < 3; ++a)
+		{
+			float f = row[a] * inv_cell;
+			cell[a] = (long long)floor(f);
+			neighbour[a] = f - cell[a] < 0.5f ? cell[a] - 1 : cell[a] + 1;
+		}
+
+		unsigned int found = none;
+		for (int k = 0; k < 8 && found == none; ++k)
+		{
+			long long c[3];
+			for (int a = 0; a < 3; ++a)
+				c[a] = (k >> a) & 1 ? neighbour[a] : cell[a];
+			unsigned long long key = ((unsigned long long)(c[0] & 0x1FFFFF) << 42) | ((unsigned long long)(c[1] & 0x1FFFFF) << 21) | (unsigned long long)(c[2] & 0x1FFFFF);
+			auto it = cell_first.find(key);
+			for (unsigned int v = it == cell_first.end() ? none : it->second; v != none && found == none; v = cell_next[v])
+			{
+				const float* other = &attributes[unique[v] * num_floats];
+				int j = 0;
+				while (j < num_floats && fabs(row[j] - other[j]) <= epsilon)
+					++j;
+				if (j == num_floats)
+					found = v;
+			}
+		}
+
+		if (found == none)
+		{
+			found = unique.size();
+			unique.push_back(i);
+			unsigned long long key = ((unsigned long long)(cell[0] & 0x1FFFFF) << 42) | ((unsigned long long)(cell[1] & 0x1FFFFF) << 21) | (unsigned long long)(cell[2] & 0x1FFFFF);
+			auto it = cell_first.find(key);
+			cell_next.push_back(it == cell_first.end() ? none : it->second);
+			cell_first[key] = found;
+		}
+		remap[i] = found;
+	}
+
+	//compact the streams
+	unsigned int num_unique = unique.size();
+	if (is_interleaved)
+	{
+		std::vector<tInterleaved> welded(num_unique);
+		for (unsigned int i = 0; i < num_unique; ++i)
+			welded[i] = interleaved[unique[i]];
+		interleaved.swap(welded);
+	}
+	else
+	{
+		std::vector<Vector3> welded_vertices(num_unique);
+		std::vector<Vector3> welded_normals(normals.size() ? num_unique : 0);
+		std::vector<Vector2> welded_uvs(uvs.size() ? num_unique : 0);
+		for (unsigned int i = 0; i < num_unique; ++i)
+		{
+			welded_vertices[i] = vertices[unique[i]];
+			if (normals.size())
+				welded_normals[i] = normals[unique[i]];
+			if (uvs.size())
+				welded_uvs[i] = uvs[unique[i]];
+		}
+		vertices.swap(welded_vertices);
+		normals.swap(welded_normals);
+		uvs.swap(welded_uvs);
+	}
+	if (colors.size())
+	{
+		std::vector<Vector4> welded_colors(num_unique);
+		for (unsigned int i = 0; i < num_unique; ++i)
+			welded_colors[i] = colors[unique[i]];
+		colors.swap(welded_colors);
+	}
+	if (tangents.size())
+	{
+		std::vector<Vector4> welded_tangents(num_unique);
+		for (unsigned int i = 0; i < num_unique; ++i)
+			welded_tangents[i] = tangents[unique[i]];
+		tangents.swap(welded_tangents);
+	}
+
+	indices.resize(num / 3);
+	for (unsigned int i = 0; i < num / 3; ++i)
+		indices[i] = Vector3u(remap[i * 3], remap[i * 3 + 1], remap[i * 3 + 2]);
+
+	//the collision model has to be rebuilt with the indices
+	releaseCollisionModel();
+
+	int stride = num_floats * sizeof(float);
+	loadLog() << " + Weld: " << num << " -> " << num_unique << " vertices (" << (100.0f * num_unique / num) << "%), VRAM: " << (num * stride) / 1024 << "KB -> " << (num_unique * stride + indices.size() * sizeof(Vector3u)) / 1024 << "KB" << std::endl;
+	return true;
+}
+
+//Forsyth scoring, tuned for a 32 entries LRU cache
+#define VCACHE_SIZE 32
+#define VCACHE_FIFO_SIZE 16 //size used for the stats, similar to the hardware post-transform caches
+
+static float vcache_position_score[VCACHE_SIZE];
+static float vcache_valence_score[64];
+
+static void initVertexCacheScores()
+{
+	//the meshes can be optimized in several loader threads at the same time
+	static std::once_flag initialized;
+	std::call_once(initialized, []() {
+		for (int i = 0; i < VCACHE_SIZE; ++i)
+		{
+			if (i < 3)
+				vcache_position_score[i] = 0.75f; //the vertices of the last triangle get a fixed score so it is not reused again
+			else
+				vcache_position_score[i] = pow(1.0f - (i - 3) / (float)(VCACHE_SIZE - 3), 1.5f);
+		}
+		for (int i = 1; i < 64; ++i)
+			vcache_valence_score[i] = 2.0f * pow((float)i, -0.5f);
+	});
+}
+
+static float getVertexCacheScore(int cache_position, int valence)
+{
+	if (valence == 0)
+		return -1.0f; //no triangles left
+	float score = cache_position < 0 ? 0.0f : vcache_position_score[cache_position];
+	return score + (valence < 64 ? vcache_valence_score[valence] : 2.0f * pow((float)valence, -0.5f));
+}
+
+//reorders the triangles to maximize the hits in the post-transform cache (Tom Forsyth, "Linear-Speed Vertex Cache Optimisation")
+static void optimizeTrianglesForCache(unsigned int* tris, unsigned int num_tris, unsigned int num_vertices)
+{
+	initVertexCacheScores();
+
+	//triangles of every vertex
+	std::vector<unsigned int> valence(num_vertices, 0);
+	for (unsigned int i = 0; i < num_tris * 3; ++i)
+		valence[tris[i]]++;
+	std::vector<unsigned int> offsets(num_vertices + 1, 0);
+	for (unsigned int i = 0; i < num_vertices; ++i)
+		offsets[i + 1] = offsets[i] + valence[i];
+	std::vector<unsigned int> adjacency(num_tris * 3);
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (unsigned int i = 0; i < num_tris * 3; ++i)
+		adjacency[fill[tris[i]]++] = i / 3;
+
+	std::vector<int> cache_position(num_vertices, -1);
+	std::vector<float> vertex_score(num_vertices);
+	for (unsigned int i = 0; i < num_vertices; ++i)
+		vertex_score[i] = getVertexCacheScore(-1, valence[i]);
+	std::vector<float> tri_score(num_tris);
+	for (unsigned int i = 0; i < num_tris; ++i)
+		tri_score[i] = vertex_score[tris[i * 3]] + vertex_score[tris[i * 3 + 1]] + vertex_score[tris[i * 3 + 2]];
+	std::vector<bool> emitted(num_tris, false);
+
+	std::vector<unsigned int> result;
+	result.reserve(num_tris * 3);
+	std::vector<unsigned int> cache, new_cache;
+	unsigned int scan = 0; //used when the cache has no candidates
+	int best = -1;
+
+	for (unsigned int n = 0; n < num_tris; ++n)
+	{
+		//nothing left around the cache, continue with the next triangle not emitted
+		if (best < 0)
+		{
+			while (emitted[scan])
+				scan++;
+			best = scan;
+		}
+
+		unsigned int* tri = tris + best * 3;
+		emitted[best] = true;
+		result.insert(result.end(), tri, tri + 3);
+
+		//remove the triangle from the vertex adjacency
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = tri[k];
+			unsigned int* begin = &adjacency[offsets[v]];
+			unsigned int* end = begin + valence[v];
+			*std::find(begin, end, (unsigned int)best) = *(end - 1);
+			valence[v]--;
+		}
+
+		//LRU: the vertices of the triangle go first
+		new_cache.assign(tri, tri + 3);
+		for (size_t i = 0; i < cache.size(); ++i)
+			if (cache[i] != tri[0] && cache[i] != tri[1] && cache[i] != tri[2])
+				new_cache.push_back(cache[i]);
+		for (size_t i = VCACHE_SIZE; i < new_cache.size(); ++i)
+		{
+			cache_position[new_cache[i]] = -1;
+			vertex_score[new_cache[i]] = getVertexCacheScore(-1, valence[new_cache[i]]);
+		}
+		if (new_cache.size() > VCACHE_SIZE)
+			new_cache.resize(VCACHE_SIZE);
+		cache.swap(new_cache);
+
+		for (size_t i = 0; i < cache.size(); ++i)
+		{
+			cache_position[cache[i]] = i;
+			vertex_score[cache[i]] = getVertexCacheScore(i, valence[cache[i]]);
+		}
+
+		//only the triangles touching the cache change their score
+		best = -1;
+		float best_score = -1.0f;
+		for (size_t i = 0; i < cache.size(); ++i)
+		{
+			unsigned int v = cache[i];
+			for (unsigned int j = offsets[v]; j < offsets[v] + valence[v]; ++j)
+			{
+				unsigned int t = adjacency[j];
+				unsigned int* other = tris + t * 3;
+				tri_score[t] = vertex_score[other[0]] + vertex_score[other[1]] + vertex_score[other[2]];
+				if (tri_score[t] > best_score)
+				{
+					best_score = tri_score[t];
+					best = t;
+				}
+			}
+		}
+	}
+
+	memcpy(tris, &result[0], result.size() * sizeof(unsigned int));
+}
+
+//splits the cache ordered triangles in clusters and sorts them so the outer ones are drawn first
+//(Sander et al. "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw")
+static void optimizeTrianglesForOverdraw(unsigned int* tris, unsigned int num_tris, const Vector3* positions, unsigned int stride)
+{
+	#define POSITION(v) (*(const Vector3*)((const char*)positions + (v) * stride))
+
+	//a new cluster starts when all the vertices of a triangle miss the cache
+	std::vector<unsigned int> clusters;
+	std::vector<unsigned int> fifo(VCACHE_FIFO_SIZE, 0xFFFFFFFF);
+	unsigned int fifo_head = 0;
+	for (unsigned int i = 0; i < num_tris; ++i)
+	{
+		int misses = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = tris[i * 3 + k];
+			if (std::find(fifo.begin(), fifo.end(), v) == fifo.end())
+			{
+				fifo[fifo_head] = v;
+				fifo_head = (fifo_head + 1) % VCACHE_FIFO_SIZE;
+				misses++;
+			}
+		}
+		if (i == 0 || misses == 3)
+			clusters.push_back(i);
+	}
+	if (clusters.size() < 2)
+		return;
+	clusters.push_back(num_tris);
+
+	Vector3 mesh_center;
+	for (unsigned int i = 0; i < num_tris * 3; ++i)
+		mesh_center = mesh_center + POSITION(tris[i]);
+	mesh_center = mesh_center * (1.0f / (num_tris * 3));
+
+	//the sort key is how much the cluster faces away from the center
+	std::vector< std::pair<float, unsigned int> > keys(clusters.size() - 1);
+	for (size_t c = 0; c < keys.size(); ++c)
+	{
+		Vector3 center;
+		Vector3 normal;
+		float area = 0.0f;
+		for (unsigned int i = clusters[c]; i < clusters[c + 1]; ++i)
+		{
+			const Vector3& a = POSITION(tris[i * 3]);
+			const Vector3& b = POSITION(tris[i * 3 + 1]);
+			const Vector3& c2 = POSITION(tris[i * 3 + 2]);
+			Vector3 n = (b - a).cross(c2 - a);
+			float tri_area = n.length();
+			center = center + (a + b + c2) * (tri_area / 3.0f);
+			normal = normal + n;
+			area += tri_area;
+		}
+		if (area > 0.0f)
+			center = center * (1.0f / area);
+		if (normal.length() > 0.0f)
+			normal.normalize();
+		keys[c] = std::make_pair(-(center - mesh_center).dot(normal), (unsigned int)c);
+	}
+	std::stable_sort(keys.begin(), keys.end());
+
+	std::vector<unsigned int> result;
+	result.reserve(num_tris * 3);
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		unsigned int c = keys[i].second;
+		result.insert(result.end(), tris + clusters[c] * 3, tris + clusters[c + 1] * 3);
+	}
+	memcpy(tris, &result[0], result.size() * sizeof(unsigned int));
+
+	#undef POSITION
+}
+
+template<typename T> static void remapStream(std::vector<T>& stream, const std::vector<unsigned int>& order)
+{
+	if (stream.empty())
+		return;
+	std::vector<T> result(order.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		result[i] = stream[order[i]];
+	stream.swap(result);
+}
+
+void Mesh::computeCacheStats(float& acmr, float& atvr)
+{
+	acmr = atvr = 0.0f;
+	unsigned int num_tris = getNumIndices();
+	if (!indices.size() || !num_tris)
+		return;
+
+	std::vector<unsigned int> fifo(VCACHE_FIFO_SIZE, 0xFFFFFFFF);
+	unsigned int fifo_head = 0;
+	unsigned int misses = 0;
+	const unsigned int* tris = &indices[0].x;
+	for (unsigned int i = 0; i < num_tris * 3; ++i)
+	{
+		if (std::find(fifo.begin(), fifo.end(), tris[i]) != fifo.end())
+			continue;
+		fifo[fifo_head] = tris[i];
+		fifo_head = (fifo_head + 1) % VCACHE_FIFO_SIZE;
+		misses++;
+	}
+	acmr = misses / (float)num_tris; //transformed vertices per triangle, 0.5 is the ideal in a regular grid
+	atvr = misses / (float)getNumVertices(); //transformed vertices per vertex, 1.0 is the ideal
+}
+
+bool Mesh::optimizeVertexCache()
+{
+	loadMappedStreams();
+
+	unsigned int num_tris = indices.size();
+	unsigned int num = getNumVertices();
+	if (!num_tris || !num)
+		return false;
+
+	float acmr_before, atvr_before;
+	computeCacheStats(acmr_before, atvr_before);
+
+	bool is_interleaved = interleaved.size() != 0;
+	const Vector3* positions = is_interleaved ? &interleaved[0].vertex : &vertices[0];
+	unsigned int stride = is_interleaved ? sizeof(tInterleaved) : sizeof(Vector3);
+
+	//every submesh is optimized on its own so the ranges stay valid
+	unsigned int* tris = &indices[0].x;
+	unsigned int start = 0;
+	for (size_t i = 0; i <= material_range.size(); ++i)
+	{
+		unsigned int end = i < material_range.size() ? std::min(material_range[i], num_tris) : num_tris;
+		if (end <= start)
+			continue;
+		optimizeTrianglesForCache(tris + start * 3, end - start, num);
+		optimizeTrianglesForOverdraw(tris + start * 3, end - start, positions, stride);
+		start = end;
+	}
+
+	//vertices in the order they are fetched
+	std::vector<unsigned int> remap(num, 0xFFFFFFFF);
+	std::vector<unsigned int> order;
+	order.reserve(num);
+	for (unsigned int i = 0; i < num_tris * 3; ++i)
+	{
+		if (remap[tris[i]] == 0xFFFFFFFF)
+		{
+			remap[tris[i]] = order.size();
+			order.push_back(tris[i]);
+		}
+		tris[i] = remap[tris[i]];
+	}
+
+	//unreferenced vertices are dropped
+	remapStream(interleaved, order);
+	remapStream(vertices, order);
+	remapStream(normals, order);
+	remapStream(uvs, order);
+	remapStream(colors, order);
+	remapStream(bones, order);
+	remapStream(weights, order);
+	remapStream(tangents, order);
+
+	releaseCollisionModel();
+
+	float acmr, atvr;
+	computeCacheStats(acmr, atvr);
+	loadLog() << " + Vertex cache: ACMR " << acmr_before << " -> " << acmr << ", ATVR " << atvr_before << " -> " << atvr << std::endl;
+	return true;
+}
+
+//sum of squared distances to a set of planes, as a symmetric 4x4 matrix (Garland and Heckbert)
+struct sQuadric
+{
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+	sQuadric() { memset(this, 0, sizeof(sQuadric)); }
+
+	void addPlane(const Vector3& n, double d)
+	{
+		a2 += n.x * n.x; ab += n.x * n.y; ac += n.x * n.z; ad += n.x * d;
+		b2 += n.y * n.y; bc += n.y * n.z; bd += n.y * d;
+		c2 += n.z * n.z; cd += n.z * d;
+		d2 += d * d;
+	}
+
+	void add(const sQuadric& q)
+	{
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+		b2 += q.b2; bc += q.bc; bd += q.bd;
+		c2 += q.c2; cd += q.cd;
+		d2 += q.d2;
+	}
+
+	double evaluate(const Vector3& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double error = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x + b2 * y * y + 2 * bc * y * z + 2 * bd * y + c2 * z * z + 2 * cd * z + d2;
+		return error > 0.0 ? error : 0.0;
+	}
+};
+
+//a connected part of the mesh, with its own local vertex ids so it can be simplified in its own thread
+struct sSimplifyComponent
+{
+	std::vector<unsigned int> vertices; //local to mesh ids
+	std::vector<unsigned int> triangles; //local ids
+	std::vector< std::vector<unsigned int> > levels; //mesh ids
+	std::vector<float> errors;
+};
+
+//removes vertices collapsing them into a neighbour (so no new vertices are needed) until the target is reached
+//every pass collapses the cheapest edges that do not touch each other
+static float simplifyTriangles(const std::vector<Vector3>& positions, const std::vector<char>& locked, std::vector<sQuadric>& quadrics, std::vector<unsigned int>& tris, unsigned int target_triangles)
+{
+	unsigned int num = positions.size();
+	double max_error = 0.0;
+
+	struct sCollapse {
+		double cost;
+		unsigned int from;
+		unsigned int to;
+		bool operator < (const sCollapse& c) const { return cost < c.cost; }
+	};
+
+	std::vector<unsigned int> offsets(num + 1);
+	std::vector<unsigned int> adjacency;
+	std::vector<unsigned long long> edges;
+	std::vector<sCollapse> collapses;
+	std::vector<char> touched(num);
+	std::vector<unsigned int> remap(num);
+
+	while (tris.size() / 3 > target_triangles)
+	{
+		unsigned int num_tris = tris.size() / 3;
+
+		//triangles of every vertex
+		std::fill(offsets.begin(), offsets.end(), 0);
+		for (unsigned int i = 0; i < num_tris * 3; ++i)
+			offsets[tris[i] + 1]++;
+		for (unsigned int i = 0; i < num; ++i)
+			offsets[i + 1] += offsets[i];
+		adjacency.resize(num_tris * 3);
+		std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+		for (unsigned int i = 0; i < num_tris * 3; ++i)
+			adjacency[fill[tris[i]]++] = i / 3;
+
+		//every edge once
+		edges.clear();
+		for (unsigned int i = 0; i < num_tris; ++i)
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int a = tris[i * 3 + k];
+				unsigned int b = tris[i * 3 + (k + 1) % 3];
+				edges.push_back(((unsigned long long)std::min(a, b) << 32) | std::max(a, b));
+			}
+		std::sort(edges.begin(), edges.end());
+		edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+		collapses.clear();
+		for (size_t i = 0; i < edges.size(); ++i)
+		{
+			unsigned int a = (unsigned int)(edges[i] >> 32);
+			unsigned int b = (unsigned int)(edges[i] & 0xFFFFFFFF);
+			sQuadric q = quadrics[a];
+			q.add(quadrics[b]);
+			double cost_ab = locked[a] ? -1.0 : q.evaluate(positions[b]);
+			double cost_ba = locked[b] ? -1.0 : q.evaluate(positions[a]);
+			if (cost_ab >= 0.0 && (cost_ba < 0.0 || cost_ab <= cost_ba))
+				collapses.push_back({ cost_ab, a, b });
+			else if (cost_ba >= 0.0)
+				collapses.push_back({ cost_ba, b, a });
+		}
+		std::sort(collapses.begin(), collapses.end());
+
+		//every collapse removes around two triangles
+		unsigned int max_collapses = (num_tris - target_triangles) / 2 + 1;
+		unsigned int num_collapses = 0;
+		std::fill(touched.begin(), touched.end(), 0);
+		for (unsigned int i = 0; i < num; ++i)
+			remap[i] = i;
+
+		for (size_t i = 0; i < collapses.size() && num_collapses < max_collapses; ++i)
+		{
+			const sCollapse& c = collapses[i];
+			if (touched[c.from] || touched[c.to])
+				continue;
+
+			//the remaining triangles cannot flip
+			bool flips = false;
+			for (unsigned int j = offsets[c.from]; j < offsets[c.from + 1] && !flips; ++j)
+			{
+				const unsigned int* t = &tris[adjacency[j] * 3];
+				if (t[0] == c.to || t[1] == c.to || t[2] == c.to)
+					continue;
+				Vector3 p[3];
+				Vector3 moved[3];
+				for (int k = 0; k < 3; ++k)
+				{
+					p[k] = positions[t[k]];
+					moved[k] = t[k] == c.from ? positions[c.to] : p[k];
+				}
+				Vector3 before = (p[1] - p[0]).cross(p[2] - p[0]);
+				Vector3 after = (moved[1] - moved[0]).cross(moved[2] - moved[0]);
+				flips = before.dot(after) <= 0.2f * before.length() * after.length();
+			}
+			if (flips)
+				continue;
+
+			//the neighbourhood changes, its collapses wait for the next pass
+			for (unsigned int j = offsets[c.from]; j < offsets[c.from + 1]; ++j)
+				for (int k = 0; k < 3; ++k)
+					touched[tris[adjacency[j] * 3 + k]] = 1;
+			for (unsigned int j = offsets[c.to]; j < offsets[c.to + 1]; ++j)
+				for (int k = 0; k < 3; ++k)
+					touched[tris[adjacency[j] * 3 + k]] = 1;
+
+			remap[c.from] = c.to;
+			quadrics[c.to].add(quadrics[c.from]);
+			max_error = std::max(max_error, c.cost);
+			num_collapses++;
+		}
+
+		if (!num_collapses)
+			break;
+
+		//apply the collapses and remove the degenerated triangles
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < num_tris; ++i)
+		{
+			unsigned int a = remap[tris[i * 3]], b = remap[tris[i * 3 + 1]], c = remap[tris[i * 3 + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			tris[count++] = a;
+			tris[count++] = b;
+			tris[count++] = c;
+		}
+		tris.resize(count);
+	}
+
+	return (float)sqrt(max_error);
+}
+
+bool Mesh::buildLODs(int num_levels, float ratio)
+{
+	loadMappedStreams();
+	lods.clear();
+	lod_indices.clear();
+
+	unsigned int num_tris = indices.size();
+	unsigned int num = getNumVertices();
+	if (!num_tris || material_range.size() > 1 || (!interleaved.size() && !vertices.size()))
+		return false; //the levels do not keep the submeshes
+
+	std::vector<Vector3> positions(num);
+	for (unsigned int i = 0; i < num; ++i)
+		positions[i] = interleaved.size() ? interleaved[i].vertex : vertices[i];
+
+	//the seams (same position, different normal or uv) and the borders are locked so they do not open
+	std::vector<char> locked(num, 0);
+	std::vector<unsigned int> by_position(num);
+	for (unsigned int i = 0; i < num; ++i)
+		by_position[i] = i;
+	std::sort(by_position.begin(), by_position.end(), [&](unsigned int a, unsigned int b) {
+		const Vector3& pa = positions[a];
+		const Vector3& pb = positions[b];
+		return pa.x != pb.x ? pa.x < pb.x : pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z;
+	});
+	for (unsigned int i = 1; i < num; ++i)
+	{
+		const Vector3& pa = positions[by_position[i - 1]];
+		const Vector3& pb = positions[by_position[i]];
+		if (pa.x == pb.x && pa.y == pb.y && pa.z == pb.z)
+			locked[by_position[i - 1]] = locked[by_position[i]] = 1;
+	}
+
+	std::vector<unsigned long long> edges;
+	edges.reserve(num_tris * 3);
+	for (unsigned int i = 0; i < num_tris; ++i)
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int a = indices[i].v[k];
+			unsigned int b = indices[i].v[(k + 1) % 3];
+			edges.push_back(((unsigned long long)std::min(a, b) << 32) | std::max(a, b));
+		}
+	std::sort(edges.begin(), edges.end());
+	for (size_t i = 0; i < edges.size(); ++i)
+	{
+		bool shared = (i > 0 && edges[i - 1] == edges[i]) || (i + 1 < edges.size() && edges[i + 1] == edges[i]);
+		if (!shared)
+			locked[edges[i] >> 32] = locked[edges[i] & 0xFFFFFFFF] = 1;
+	}
+
+	//connected components with an union-find over the triangles
+	std::vector<unsigned int> parent(num);
+	for (unsigned int i = 0; i < num; ++i)
+		parent[i] = i;
+	std::function<unsigned int(unsigned int)> find = [&](unsigned int v) {
+		while (parent[v] != v)
+			v = parent[v] = parent[parent[v]];
+		return v;
+	};
+	for (unsigned int i = 0; i < num_tris; ++i)
+	{
+		parent[find(indices[i].y)] = find(indices[i].x);
+		parent[find(indices[i].z)] = find(indices[i].x);
+	}
+
+	std::vector<sSimplifyComponent> components;
+	std::vector<unsigned int> component_of(num, 0xFFFFFFFF);
+	std::vector<unsigned int> local_id(num, 0xFFFFFFFF);
+	for (unsigned int i = 0; i < num_tris; ++i)
+	{
+		unsigned int root = find(indices[i].x);
+		if (component_of[root] == 0xFFFFFFFF)
+		{
+			component_of[root] = components.size();
+			components.push_back(sSimplifyComponent());
+		}
+		sSimplifyComponent& component = components[component_of[root]];
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = indices[i].v[k];
+			if (local_id[v] == 0xFFFFFFFF)
+			{
+				local_id[v] = component.vertices.size();
+				component.vertices.push_back(v);
+			}
+			component.triangles.push_back(local_id[v]);
+		}
+	}
+
+	//every component is simplified on its own, each level starts from the previous one
+	parallelFor((int)components.size(), [&](int c) {
+		sSimplifyComponent& component = components[c];
+		unsigned int component_num = component.vertices.size();
+		std::vector<Vector3> local_positions(component_num);
+		std::vector<char> local_locked(component_num);
+		for (unsigned int i = 0; i < component_num; ++i)
+		{
+			local_positions[i] = positions[component.vertices[i]];
+			local_locked[i] = locked[component.vertices[i]];
+		}
+
+		std::vector<sQuadric> quadrics(component_num);
+		for (size_t i = 0; i < component.triangles.size(); i += 3)
+		{
+			const Vector3& a = local_positions[component.triangles[i]];
+			Vector3 n = (local_positions[component.triangles[i + 1]] - a).cross(local_positions[component.triangles[i + 2]] - a);
+			if (n.length() == 0.0f)
+				continue;
+			n.normalize();
+			for (int k = 0; k < 3; ++k)
+				quadrics[component.triangles[i + k]].addPlane(n, -n.dot(a));
+		}
+
+		std::vector<unsigned int> tris = component.triangles;
+		float target = tris.size() / 3.0f;
+		float error = 0.0f;
+		for (int level = 0; level < num_levels; ++level)
+		{
+			target *= ratio;
+			error = std::max(error, simplifyTriangles(local_positions, local_locked, quadrics, tris, (unsigned int)target));
+			component.levels.push_back(std::vector<unsigned int>(tris.size()));
+			for (size_t i = 0; i < tris.size(); ++i)
+				component.levels.back()[i] = component.vertices[tris[i]];
+			component.errors.push_back(error);
+		}
+	});
+
+	//join the components of every level in one range of lod_indices
+	for (int level = 0; level < num_levels; ++level)
+	{
+		sMeshLOD lod;
+		lod.triangle_offset = lod_indices.size();
+		lod.error = 0.0f;
+		for (size_t c = 0; c < components.size(); ++c)
+		{
+			const std::vector<unsigned int>& tris = components[c].levels[level];
+			for (size_t i = 0; i < tris.size(); i += 3)
+				lod_indices.push_back(Vector3u(tris[i], tris[i + 1], tris[i + 2]));
+			lod.error = std::max(lod.error, components[c].errors[level]);
+		}
+		lod.triangle_count = lod_indices.size() - lod.triangle_offset;
+		if (lod.triangle_count)
+			optimizeTrianglesForCache(&lod_indices[lod.triangle_offset].x, lod.triangle_count, num);
+
+		//a level that could not be reduced is useless
+		unsigned int previous = lods.size() ? lods.back().triangle_count : num_tris;
+		if (lod.triangle_count >= previous)
+		{
+			lod_indices.resize(lod.triangle_offset);
+			break;
+		}
+		lods.push_back(lod);
+		loadLog() << " + LOD " << lods.size() << ": " << lod.triangle_count << " triangles (" << 100.0f * lod.triangle_count / num_tris << "%), error " << lod.error << std::endl;
+	}
+
+	loadLog() << " + LODs: " << lods.size() << " levels from " << components.size() << " components" << std::endl;
+	return lods.size() != 0;
+}
+
+int Mesh::selectLOD(const Matrix44& model, Camera* camera, float window_height) const
+{
+	//the coarsest level whose error is not visible
+	Vector3 center = model * box.center;
+	float scale = std::max(Vector3(model.m[0], model.m[1], model.m[2]).length(), std::max(Vector3(model.m[4], model.m[5], model.m[6]).length(), Vector3(model.m[8], model.m[9], model.m[10]).length()));
+	for (int i = lods.size(); i > 0; --i)
+		if (camera->getProjectedPixels(center, lods[i - 1].error * scale, window_height) <= lod_pixel_error)
+			return i;
+	return 0;
+}
+
+typedef struct 
+{
+	int version;
+	int header_bytes;
+	int size;
+	int num_indices;
+	Vector3 aabb_min;
+	Vector3	aabb_max;
+	Vector3	center;
+	Vector3	halfsize;
+	float radius;
+	int num_bones;
+	int material_range[4];
+	Matrix44 bind_matrix;
+	Vector3 quantization_min;
+	Vector3 quantization_size;
+	int num_meshlets;
+	int num_lods;
+	int num_lod_indices;
+	char streams[10]; //Vertex|Normal|Uvs|Color|Indices|Bones|Weights|Meshlets|Tangents|Positions
+	char extra[30]; //unused
+} sMeshInfo;
+
+template<typename T> static void mapStream(Mesh::tStreamView<T>& view, const char*& pos, unsigned int count)
+{
+	view.data = (const T*)pos;
+	view.size = count;
+	pos += sizeof(T) * count;
+}
+
+bool Mesh::readBin(const char* filename)
+{
+	assert(filename);
+
+	//the file is mapped instead of read, the streams are used in place until something needs them in the vectors
+	MappedFile* file = new MappedFile();
+	if (!file->open(filename))
+	{
+		delete file;
+		return false;
+	}
+
+	//watermark
+	if ( file->size < 4 + sizeof(sMeshInfo) || memcmp(file->data,"MBIN",4) != 0 )
+	{
+		loadLog() << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		delete file;
+		return false;
+	}
+
+	const char* pos = file->data + 4;
+	sMeshInfo info;
+	memcpy(&info,pos,sizeof(sMeshInfo));
+	pos += sizeof(sMeshInfo);
+
+	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
+	{
+		loadLog() << "[WARN] loading BIN: old version: " << filename << std::endl;
+		delete file;
+		return false;
+	}
+
+	releaseMappedFile();
+	tMappedStreams streams;
+
+	if (info.streams[0] == 'I')
+		mapStream(streams.interleaved, pos, info.size);
+	if (info.streams[0] == 'Q')
+		mapStream(streams.quantized, pos, info.size);
+	if (info.streams[0] == 'V')
+		mapStream(streams.vertices, pos, info.size);
+	if (info.streams[1] == 'N')
+		mapStream(streams.normals, pos, info.size);
+	if (info.streams[2] == 'U')
+		mapStream(streams.uvs, pos, info.size);
+	if (info.streams[3] == 'C')
+		mapStream(streams.colors, pos, info.size);
+	if (info.streams[4] == 'I')
+		mapStream(streams.indices, pos, info.num_indices);
+	if (info.streams[5] == 'B')
+		mapStream(streams.bones, pos, info.size);
+	if (info.streams[6] == 'W')
+		mapStream(streams.weights, pos, info.size);
+	if (info.streams[8] == 'T')
+		mapStream(streams.tangents, pos, info.size);
+	if (info.streams[9] == 'P')
+		mapStream(streams.vertices, pos, info.size);
+
+	if (pos + sizeof(BoneInfo) * info.num_bones + sizeof(sMeshlet) * info.num_meshlets + sizeof(sMeshLOD) * info.num_lods + sizeof(Vector3u) * info.num_lod_indices > file->data + file->size)
+	{
+		loadLog() << "[ERROR] loading BIN: truncated file: " << filename << std::endl;
+		delete file;
+		return false;
+	}
+
+	if (info.num_bones)
+	{
+		bones_info.resize(info.num_bones);
+		memcpy((void*)&bones_info[0], pos, sizeof(BoneInfo) * info.num_bones);
+		pos += sizeof(BoneInfo) * info.num_bones;
+	}
+
+	//meshlets are small and used every frame, they are always copied
+	if (info.streams[7] == 'M')
+	{
+		meshlets.resize(info.num_meshlets);
+		memcpy((void*)&meshlets[0], pos, sizeof(sMeshlet) * info.num_meshlets);
+		pos += sizeof(sMeshlet) * info.num_meshlets;
+	}
+
+	//simplified levels, their indices are used from the file like the other streams
+	if (info.num_lods)
+	{
+		lods.resize(info.num_lods);
+		memcpy((void*)&lods[0], pos, sizeof(sMeshLOD) * info.num_lods);
+		pos += sizeof(sMeshLOD) * info.num_lods;
+		mapStream(streams.lod_indices, pos, info.num_lod_indices);
+	}
+
+	aabb_max = info.aabb_max;
+	aabb_min = info.aabb_min;
 	box.center = info.center;
 	box.halfsize = info.halfsize;
 	radius = info.radius;
 	bind_matrix = info.bind_matrix;
+	quantization_min = info.quantization_min;
+	quantization_size = info.quantization_size;
 
 	for (int i = 0; i < 4; i++)
 		if (info.material_range[i] != -1)
@@ -773,15 +2393,72 @@ bool Mesh::readBin(const char* filename)
 		else
 			break;
 
-	delete[] data;
+	mapped = streams;
+	bin_file = file;
+	num_vertices = info.size;
+	num_indices = streams.indices.size;
 
-	createCollisionModel();
+	//the collision model is created the first time a collision is tested, it needs the vertices in RAM
 	return true;
 }
 
+void Mesh::loadMappedStreams()
+{
+	//a quantized mesh without the floats, see applyResidency
+	if (!bin_file)
+	{
+		if (quantized.size() && interleaved.empty() && vertices.empty())
+			dequantizeBuffers();
+		return;
+	}
+
+	if (mapped.interleaved.size)
+		interleaved.assign(mapped.interleaved.data, mapped.interleaved.data + mapped.interleaved.size);
+	if (mapped.quantized.size)
+	{
+		quantized.assign(mapped.quantized.data, mapped.quantized.data + mapped.quantized.size);
+		dequantizeBuffers(); //the CPU always works with floats
+	}
+	if (mapped.vertices.size && interleaved.size())
+	{
+		//full precision positions of a quantized mesh, the decoded ones are only for the GPU
+		for (unsigned int i = 0; i < interleaved.size(); ++i)
+			interleaved[i].vertex = mapped.vertices.data[i];
+	}
+	else if (mapped.vertices.size)
+		vertices.assign(mapped.vertices.data, mapped.vertices.data + mapped.vertices.size);
+	if (mapped.normals.size)
+		normals.assign(mapped.normals.data, mapped.normals.data + mapped.normals.size);
+	if (mapped.uvs.size)
+		uvs.assign(mapped.uvs.data, mapped.uvs.data + mapped.uvs.size);
+	if (mapped.colors.size)
+		colors.assign(mapped.colors.data, mapped.colors.data + mapped.colors.size);
+	if (mapped.indices.size)
+		indices.assign(mapped.indices.data, mapped.indices.data + mapped.indices.size);
+	if (mapped.lod_indices.size)
+		lod_indices.assign(mapped.lod_indices.data, mapped.lod_indices.data + mapped.lod_indices.size);
+	if (mapped.bones.size)
+		bones.assign(mapped.bones.data, mapped.bones.data + mapped.bones.size);
+	if (mapped.weights.size)
+		weights.assign(mapped.weights.data, mapped.weights.data + mapped.weights.size);
+	if (mapped.tangents.size)
+		tangents.assign(mapped.tangents.data, mapped.tangents.data + mapped.tangents.size);
+
+	releaseMappedFile();
+}
+
+void Mesh::releaseMappedFile()
+{
+	if (bin_file)
+		delete bin_file;
+	bin_file = NULL;
+	mapped = tMappedStreams();
+}
+
 bool Mesh::writeBin(const char* filename)
 {
-	assert( vertices.size() || interleaved.size() );
+	loadMappedStreams();
+	assert( vertices.size() || interleaved.size() || quantized.size() );
 	std::string s_filename = filename;
 	s_filename += ".mbin";
 
@@ -799,7 +2476,7 @@ bool Mesh::writeBin(const char* filename)
 	memset(&info, 0, sizeof(info));
 	info.version = MESH_BIN_VERSION;
 	info.header_bytes = sizeof(sMeshInfo);
-	info.size = interleaved.size() ? interleaved.size() : vertices.size();
+	info.size = quantized.size() ? quantized.size() : interleaved.size() ? interleaved.size() : vertices.size();
 	info.num_indices = indices.size();
 	info.aabb_max = aabb_max;
 	info.aabb_min = aabb_min;
@@ -808,14 +2485,24 @@ bool Mesh::writeBin(const char* filename)
 	info.radius = radius;
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
-
-	info.streams[0] = interleaved.size() ? 'I' : 'V';
-	info.streams[1] = normals.size() ? 'N' : ' ';
-	info.streams[2] = uvs.size() ? 'U' : ' ';
+	info.quantization_min = quantization_min;
+	info.quantization_size = quantization_size;
+	info.num_meshlets = meshlets.size();
+	info.num_lods = lods.size();
+	info.num_lod_indices = lod_indices.size();
+
+	//the compact stream replaces the float ones, they are decoded when loading
+	info.streams[0] = quantized.size() ? 'Q' : interleaved.size() ? 'I' : 'V';
+	info.streams[1] = normals.size() && !quantized.size() ? 'N' : ' ';
+	info.streams[2] = uvs.size() && !quantized.size() ? 'U' : ' ';
 	info.streams[3] = colors.size() ? 'C' : ' ';
 	info.streams[4] = indices.size() ? 'I' : ' ';
 	info.streams[5] = bones.size() ? 'B' : ' ';
 	info.streams[6] = weights.size() ? 'W' : ' ';
+	info.streams[7] = meshlets.size() ? 'M' : ' ';
+	info.streams[8] = tangents.size() ? 'T' : ' ';
+	bool write_positions = quantized.size() && (interleaved.size() || vertices.size()); //the collisions need them exact
+	info.streams[9] = write_positions ? 'P' : ' ';
 
 	for (unsigned int i = 0; i < 4; i++)
 		info.material_range[i] = material_range.size() > i ? material_range[i] : -1;
@@ -824,7 +2511,9 @@ bool Mesh::writeBin(const char* filename)
 	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
 
 	//write streams
-	if (interleaved.size())
+	if (quantized.size())
+		fwrite((void*)&quantized[0], quantized.size() * sizeof(tQuantized), 1, f);
+	else if (interleaved.size())
 		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
 	else
 	{
@@ -845,8 +2534,24 @@ bool Mesh::writeBin(const char* filename)
 		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
 	if (weights.size())
 		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
+	if (tangents.size())
+		fwrite((void*)&tangents[0], tangents.size() * sizeof(Vector4), 1, f);
+	if (write_positions)
+	{
+		std::vector<Vector3> positions(info.size);
+		for (unsigned int i = 0; i < positions.size(); ++i)
+			positions[i] = interleaved.size() ? interleaved[i].vertex : vertices[i];
+		fwrite((void*)&positions[0], positions.size() * sizeof(Vector3), 1, f);
+	}
 	if (bones_info.size())
 		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
+	if (meshlets.size())
+		fwrite((void*)&meshlets[0], meshlets.size() * sizeof(sMeshlet), 1, f);
+	if (lods.size())
+	{
+		fwrite((void*)&lods[0], lods.size() * sizeof(sMeshLOD), 1, f);
+		fwrite((void*)&lod_indices[0], lod_indices.size() * sizeof(Vector3u), 1, f);
+	}
 
 	fclose(f);
 	return true;
@@ -880,102 +2585,419 @@ bool Mesh::loadASE(const char* filename)
 	aabb_min.set(max_float,max_float,max_float);
 	aabb_max.set(min_float,min_float,min_float);
 
-	//load unique vertices
-	for(count=0;count<nVtx;count++)
+	//load unique vertices
+	for(count=0;count<nVtx;count++)
+	{
+		t.seek("*MESH_VERTEX");
+		vId = t.getint();
+		vtxX=(float)t.getfloat();
+		vtxY= (float)t.getfloat();
+		vtxZ= (float)t.getfloat();
+		Vector3 v(-vtxX,vtxZ,vtxY);
+		unique_vertices[count] = v;
+		aabb_min.setMin( v );
+		aabb_max.setMax( v );
+	}
+	box.center = (aabb_max + aabb_min) * 0.5;
+	box.halfsize = (aabb_max - box.center);
+	radius = (float)fmax( aabb_max.length(), aabb_min.length() );
+	
+	int prev_mat = 0;
+
+	//load faces
+	for(count=0;count<nFcs;count++)
+	{
+		t.seek("*MESH_FACE");
+		t.seek("A:");
+		aId = t.getint();
+		t.seek("B:");
+		bId = t.getint();
+		t.seek("C:");
+		cId = t.getint();
+		vertices[count*3 + 0] = unique_vertices[aId];
+		vertices[count*3 + 1] = unique_vertices[bId];
+		vertices[count*3 + 2] = unique_vertices[cId];
+
+		t.seek("*MESH_MTLID");
+		int current_mat = t.getint();
+		if (current_mat != prev_mat)
+		{
+			material_range.push_back( count );
+			prev_mat = current_mat;
+		}
+	}
+
+	material_range.push_back(nFcs);
+
+	t.seek("*MESH_NUMTVERTEX");
+	nVtx = t.getint();
+	std::vector<Vector2> unique_uvs;
+	unique_uvs.resize(nVtx);
+
+	for(count=0;count<nVtx;count++)
+	{
+		t.seek("*MESH_TVERT");
+		vId = t.getint();
+		vtxX= (float)t.getfloat();
+		vtxY= (float)t.getfloat();
+		unique_uvs[count]=Vector2(vtxX,vtxY);
+	}
+
+	t.seek("*MESH_NUMTVFACES");
+	nFcs = t.getint();
+	for(count=0;count<nFcs;count++)
+	{
+		t.seek("*MESH_TFACE");
+		t.getint(); //num face
+		uvs[count*3] = unique_uvs[ t.getint() ];
+		uvs[count*3+1] = unique_uvs[ t.getint() ];
+		uvs[count*3+2] = unique_uvs[ t.getint() ];
+	}
+
+	//normals
+	for(count=0;count<nFcs;count++)
+	{
+		t.seek("*MESH_VERTEXNORMAL");
+		aId = t.getint();
+		nX = (float)t.getfloat();
+		nY = (float)t.getfloat();
+		nZ = (float)t.getfloat();
+		normals[count*3]=Vector3(-nX,nZ,nY);
+		t.seek("*MESH_VERTEXNORMAL");
+		aId = t.getint();
+		nX = (float)t.getfloat();
+		nY = (float)t.getfloat();
+		nZ = (float)t.getfloat();
+		normals[count*3+1]=Vector3(-nX,nZ,nY);
+		t.seek("*MESH_VERTEXNORMAL");
+		aId = t.getint();
+		nX = (float)t.getfloat();
+		nY = (float)t.getfloat();
+		nZ = (float)t.getfloat();
+		normals[count*3+2]=Vector3(-nX,nZ,nY);
+	}
+
+	return true;
+}
+
+//OBJ parsing helpers, they work in place over the file without allocating
+static inline const char* skipSpaces(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+	return p;
+}
+
+//returns the position after the number, or p if there was no number
+static const char* parseFloatFast(const char* p, const char* end, float& value)
+{
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	double mantissa = 0.0;
+	int digits = 0;
+	int exponent = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		mantissa = mantissa * 10.0 + (*p++ - '0');
+		digits++;
+	}
+	if (p < end && *p == '.')
+	{
+		++p;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			mantissa = mantissa * 10.0 + (*p++ - '0');
+			exponent--;
+			digits++;
+		}
+	}
+	if (!digits)
+		return start;
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* exp_start = p++;
+		bool exp_negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			exp_negative = *p++ == '-';
+		if (p < end && *p >= '0' && *p <= '9')
+		{
+			int e = 0;
+			while (p < end && *p >= '0' && *p <= '9')
+				e = e * 10 + (*p++ - '0');
+			exponent += exp_negative ? -e : e;
+		}
+		else
+			p = exp_start;
+	}
+
+	int abs_exponent = exponent < 0 ? -exponent : exponent;
+	double scale = abs_exponent <= 18 ? powers[abs_exponent] : pow(10.0, abs_exponent);
+	double result = exponent < 0 ? mantissa / scale : mantissa * scale;
+	value = (float)(negative ? -result : result);
+	return p;
+}
+
+static const char* parseIntFast(const char* p, const char* end, int& value)
+{
+	const char* start = p;
+	bool negative = false;
+	if (p < end && *p == '-')
+		negative = *p++ == '-';
+	int result = 0;
+	const char* digits_start = p;
+	while (p < end && *p >= '0' && *p <= '9')
+		result = result * 10 + (*p++ - '0');
+	if (p == digits_start)
+		return start;
+	value = negative ? -result : result;
+	return p;
+}
+
+//one face corner "v", "v/t", "v//n" or "v/t/n", missing indices are 0
+static const char* parseOBJCorner(const char* p, const char* end, int* corner)
+{
+	corner[0] = corner[1] = corner[2] = 0;
+	const char* next = parseIntFast(p, end, corner[0]);
+	if (next == p)
+		return p;
+	p = next;
+	for (int i = 1; i < 3 && p < end && *p == '/'; ++i)
+		p = parseIntFast(p + 1, end, corner[i]);
+	return p;
+}
+
+//what a chunk of the file contains, the face indices are still the ones of the file
+struct sOBJChunk {
+	std::vector<Vector3> positions;
+	std::vector<Vector2> uvs;
+	std::vector<Vector3> normals;
+	std::vector<int> corners; //3 ints (position, uv, normal) per triangle corner
+	Vector3 aabb_min;
+	Vector3 aabb_max;
+};
+
+static void parseOBJChunk(const char* p, const char* end, sOBJChunk& chunk)
+{
+	const float max_float = 10000000;
+	const float min_float = -10000000;
+	chunk.aabb_min.set(max_float, max_float, max_float);
+	chunk.aabb_max.set(min_float, min_float, min_float);
+
+	while (p < end)
+	{
+		const char* line_end = p;
+		while (line_end < end && *line_end != '\n' && *line_end != '\r')
+			++line_end;
+
+		const char* q = skipSpaces(p, line_end);
+		if (q + 1 < line_end)
+		{
+			char c0 = q[0];
+			char c1 = q[1];
+			if (c0 == 'v' && (c1 == ' ' || c1 == '\t'))
+			{
+				Vector3 v;
+				q = skipSpaces(parseFloatFast(skipSpaces(q + 1, line_end), line_end, v.x), line_end);
+				q = skipSpaces(parseFloatFast(q, line_end, v.y), line_end);
+				if (parseFloatFast(q, line_end, v.z) != q)
+				{
+					chunk.positions.push_back(v);
+					chunk.aabb_min.setMin(v);
+					chunk.aabb_max.setMax(v);
+				}
+			}
+			else if (c0 == 'v' && c1 == 't' && q + 2 < line_end)
+			{
+				Vector2 v;
+				q = skipSpaces(parseFloatFast(skipSpaces(q + 2, line_end), line_end, v.x), line_end);
+				if (parseFloatFast(q, line_end, v.y) != q)
+					chunk.uvs.push_back(v);
+			}
+			else if (c0 == 'v' && c1 == 'n' && q + 2 < line_end)
+			{
+				Vector3 v;
+				q = skipSpaces(parseFloatFast(skipSpaces(q + 2, line_end), line_end, v.x), line_end);
+				q = skipSpaces(parseFloatFast(q, line_end, v.y), line_end);
+				if (parseFloatFast(q, line_end, v.z) != q)
+					chunk.normals.push_back(v);
+			}
+			else if (c0 == 'f' && (c1 == ' ' || c1 == '\t'))
+			{
+				//polygons are triangulated as a fan around the first corner
+				int first[3], prev[3], current[3];
+				int num_corners = 0;
+				q = skipSpaces(q + 1, line_end);
+				while (q < line_end)
+				{
+					const char* next = parseOBJCorner(q, line_end, current);
+					if (next == q)
+						break;
+					q = skipSpaces(next, line_end);
+
+					if (num_corners == 0)
+						memcpy(first, current, sizeof(first));
+					else if (num_corners >= 2)
+					{
+						chunk.corners.insert(chunk.corners.end(), first, first + 3);
+						chunk.corners.insert(chunk.corners.end(), prev, prev + 3);
+						chunk.corners.insert(chunk.corners.end(), current, current + 3);
+					}
+					memcpy(prev, current, sizeof(prev));
+					num_corners++;
+				}
+			}
+		}
+
+		p = line_end;
+		while (p < end && (*p == '\n' || *p == '\r'))
+			++p;
+	}
+}
+
+template<typename T> static const T& fetchIndexed(const std::vector<T>& values, int index)
+{
+	static const T zero;
+	return index > 0 && index <= (int)values.size() ? values[index - 1] : zero;
+}
+
+//The file is split in chunks at line boundaries that are parsed in parallel and merged in the order of the file
+bool Mesh::loadOBJ(const char* filename)
+{
+	MappedFile file;
+	if (!file.open(filename))
+	{
+		std::cerr << "File not found: " << filename << std::endl;
+		return false;
+	}
+
+	const char* data = file.data;
+	const char* data_end = file.data + file.size;
+
+	const int min_chunk_size = 64 * 1024;
+	int num_chunks = (int)(file.size / min_chunk_size) + 1;
+	int max_chunks = (int)std::thread::hardware_concurrency() * 4;
+	num_chunks = num_chunks < max_chunks ? num_chunks : (max_chunks > 0 ? max_chunks : 1);
+
+	std::vector<const char*> boundaries(num_chunks + 1);
+	boundaries[0] = data;
+	boundaries[num_chunks] = data_end;
+	for (int i = 1; i < num_chunks; ++i)
+	{
+		const char* p = data + (file.size * i) / num_chunks;
+		p = p > boundaries[i - 1] ? p : boundaries[i - 1];
+		while (p < data_end && *p != '\n')
+			++p;
+		boundaries[i] = p < data_end ? p + 1 : data_end;
+	}
+
+	std::vector<sOBJChunk> chunks(num_chunks);
+	parallelFor(num_chunks, [&](int i) { parseOBJChunk(boundaries[i], boundaries[i + 1], chunks[i]); });
+
+	//the indexed values of all the chunks, in order
+	std::vector<Vector3> indexed_positions;
+	std::vector<Vector3> indexed_normals;
+	std::vector<Vector2> indexed_uvs;
+	std::vector<size_t> corner_offsets(num_chunks + 1, 0);
+
+	const float max_float = 10000000;
+	const float min_float = -10000000;
+	aabb_min.set(max_float,max_float,max_float);
+	aabb_max.set(min_float,min_float,min_float);
+
+	for (int i = 0; i < num_chunks; ++i)
 	{
-		t.seek("*MESH_VERTEX");
-		vId = t.getint();
-		vtxX=(float)t.getfloat();
-		vtxY= (float)t.getfloat();
-		vtxZ= (float)t.getfloat();
-		Vector3 v(-vtxX,vtxZ,vtxY);
-		unique_vertices[count] = v;
-		aabb_min.setMin( v );
-		aabb_max.setMax( v );
+		sOBJChunk& chunk = chunks[i];
+		indexed_positions.insert(indexed_positions.end(), chunk.positions.begin(), chunk.positions.end());
+		indexed_uvs.insert(indexed_uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+		indexed_normals.insert(indexed_normals.end(), chunk.normals.begin(), chunk.normals.end());
+		if (chunk.positions.size())
+		{
+			aabb_min.setMin(chunk.aabb_min);
+			aabb_max.setMax(chunk.aabb_max);
+		}
+		corner_offsets[i + 1] = corner_offsets[i] + chunk.corners.size() / 3;
 	}
-	box.center = (aabb_max + aabb_min) * 0.5;
-	box.halfsize = (aabb_max - box.center);
-	radius = (float)fmax( aabb_max.length(), aabb_min.length() );
-	
-	int prev_mat = 0;
 
-	//load faces
-	for(count=0;count<nFcs;count++)
-	{
-		t.seek("*MESH_FACE");
-		t.seek("A:");
-		aId = t.getint();
-		t.seek("B:");
-		bId = t.getint();
-		t.seek("C:");
-		cId = t.getint();
-		vertices[count*3 + 0] = unique_vertices[aId];
-		vertices[count*3 + 1] = unique_vertices[bId];
-		vertices[count*3 + 2] = unique_vertices[cId];
+	//expand the triangles, every chunk writes its own range of the vectors
+	size_t num_corners = corner_offsets[num_chunks];
+	vertices.resize(num_corners);
+	if (indexed_uvs.size())
+		uvs.resize(num_corners);
+	if (indexed_normals.size())
+		normals.resize(num_corners);
 
-		t.seek("*MESH_MTLID");
-		int current_mat = t.getint();
-		if (current_mat != prev_mat)
+	parallelFor(num_chunks, [&](int i) {
+		const std::vector<int>& corners = chunks[i].corners;
+		size_t offset = corner_offsets[i];
+		for (size_t j = 0; j < corners.size() / 3; ++j)
 		{
-			material_range.push_back( count );
-			prev_mat = current_mat;
+			const int* corner = &corners[j * 3];
+			vertices[offset + j] = fetchIndexed(indexed_positions, corner[0]);
+			if (uvs.size())
+				uvs[offset + j] = fetchIndexed(indexed_uvs, corner[1]);
+			if (normals.size())
+				normals[offset + j] = fetchIndexed(indexed_normals, corner[2]);
 		}
-	}
+	});
 
-	material_range.push_back(nFcs);
+	box.center = (aabb_max + aabb_min) * 0.5;
+	box.halfsize = (aabb_max - box.center);
+	radius = (float)fmax( aabb_max.length(), aabb_min.length() );
 
-	t.seek("*MESH_NUMTVERTEX");
-	nVtx = t.getint();
-	std::vector<Vector2> unique_uvs;
-	unique_uvs.resize(nVtx);
+	material_range.push_back( (unsigned int)(vertices.size() / 3.0) );
+	return true;
+}
 
-	for(count=0;count<nVtx;count++)
+void Mesh::benchmarkOBJ(const char* filename, int iterations)
+{
+	struct stat stbuffer;
+	if (stat(filename, &stbuffer) != 0)
 	{
-		t.seek("*MESH_TVERT");
-		vId = t.getint();
-		vtxX= (float)t.getfloat();
-		vtxY= (float)t.getfloat();
-		unique_uvs[count]=Vector2(vtxX,vtxY);
+		std::cout << "[ERROR] OBJ benchmark: file not found: " << filename << std::endl;
+		return;
 	}
+	double megabytes = stbuffer.st_size / (1024.0 * 1024.0);
 
-	t.seek("*MESH_NUMTVFACES");
-	nFcs = t.getint();
-	for(count=0;count<nFcs;count++)
-	{
-		t.seek("*MESH_TFACE");
-		t.getint(); //num face
-		uvs[count*3] = unique_uvs[ t.getint() ];
-		uvs[count*3+1] = unique_uvs[ t.getint() ];
-		uvs[count*3+2] = unique_uvs[ t.getint() ];
-	}
+	double best_serial = 1e10;
+	double best_parallel = 1e10;
+	Mesh serial, parallel;
 
-	//normals
-	for(count=0;count<nFcs;count++)
+	for (int i = 0; i < iterations; ++i)
 	{
-		t.seek("*MESH_VERTEXNORMAL");
-		aId = t.getint();
-		nX = (float)t.getfloat();
-		nY = (float)t.getfloat();
-		nZ = (float)t.getfloat();
-		normals[count*3]=Vector3(-nX,nZ,nY);
-		t.seek("*MESH_VERTEXNORMAL");
-		aId = t.getint();
-		nX = (float)t.getfloat();
-		nY = (float)t.getfloat();
-		nZ = (float)t.getfloat();
-		normals[count*3+1]=Vector3(-nX,nZ,nY);
-		t.seek("*MESH_VERTEXNORMAL");
-		aId = t.getint();
-		nX = (float)t.getfloat();
-		nY = (float)t.getfloat();
-		nZ = (float)t.getfloat();
-		normals[count*3+2]=Vector3(-nX,nZ,nY);
+		serial.clear();
+		serial.material_range.clear();
+		auto start = std::chrono::high_resolution_clock::now();
+		serial.loadOBJSerial(filename);
+		best_serial = std::min(best_serial, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+
+		parallel.clear();
+		parallel.material_range.clear();
+		start = std::chrono::high_resolution_clock::now();
+		parallel.loadOBJ(filename);
+		best_parallel = std::min(best_parallel, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
 	}
 
-	return true;
+	//the positions must be the same, only the rounding of the float parsing may differ
+	float max_difference = serial.vertices.size() == parallel.vertices.size() ? 0.0f : -1.0f;
+	for (size_t i = 0; max_difference >= 0.0f && i < serial.vertices.size(); ++i)
+		max_difference = std::max(max_difference, (float)(serial.vertices[i] - parallel.vertices[i]).length());
+
+	std::cout << " + OBJ benchmark: " << filename << " (" << megabytes << " MB, best of " << iterations << ")" << std::endl;
+	std::cout << "   serial:   " << best_serial * 1000.0 << " ms, " << megabytes / best_serial << " MB/s, " << serial.vertices.size() / 3 << " triangles" << std::endl;
+	std::cout << "   parallel: " << best_parallel * 1000.0 << " ms, " << megabytes / best_parallel << " MB/s, " << parallel.vertices.size() / 3 << " triangles" << std::endl;
+	if (max_difference < 0.0f)
+		std::cout << "   [WARN] different number of vertices" << std::endl;
+	else
+		std::cout << "   speedup: " << best_serial / best_parallel << "x, max position difference: " << max_difference << std::endl;
 }
 
-bool Mesh::loadOBJ(const char* filename)
+bool Mesh::loadOBJSerial(const char* filename)
 {
 	struct stat stbuffer;
 
@@ -1311,29 +3333,308 @@ void Mesh::createSubdividedPlane(float size, int subdivisions, bool centered )
 	radius = box.halfsize.length();
 }
 
+#define VERTEX_BLOCK_SIZE 4096
+
 void Mesh::displace(Image* heightmap, float altitude)
 {
 	assert(heightmap && heightmap->data && "image without data");
-	assert(uvs.size() && "cannot displace without uvs");
+	loadMappedStreams();
 
 	bool is_interleaved = interleaved.size() != 0;
 	int num = is_interleaved ? interleaved.size() : vertices.size();
 	assert(num && "no vertices found");
 
-	for (int i = 0; i < num; ++i)
+	//interleaved meshes have the uvs inside the interleaved buffer, the uvs stream can be empty
+	const Vector2* uv_data = is_interleaved ? &interleaved[0].uv : (uvs.size() ? &uvs[0] : NULL);
+	assert(uv_data && "cannot displace without uvs");
+	if (!uv_data)
+		return;
+	unsigned int uv_stride = is_interleaved ? sizeof(tInterleaved) : sizeof(Vector2);
+	char* position_data = is_interleaved ? (char*)&interleaved[0].vertex : (char*)&vertices[0];
+	unsigned int position_stride = is_interleaved ? sizeof(tInterleaved) : sizeof(Vector3);
+
+	//the pixels are converted to heights once and sampled like the GPU samples the texture
+	HeightField field;
+	field.create(heightmap, 1.0f, altitude);
+
+	//every block samples its heights with SSE and keeps its own bounds, they are merged at the end
+	int num_blocks = (num + VERTEX_BLOCK_SIZE - 1) / VERTEX_BLOCK_SIZE;
+	std::vector<Vector3> block_min(num_blocks), block_max(num_blocks);
+	parallelFor(num_blocks, [&](int block) {
+		int start = block * VERTEX_BLOCK_SIZE;
+		int count = std::min(VERTEX_BLOCK_SIZE, num - start);
+		float heights[VERTEX_BLOCK_SIZE];
+		field.getHeightsAtUVs((const Vector2*)((const char*)uv_data + start * uv_stride), uv_stride, heights, count);
+
+		Vector3 min_pos(1e10f, 1e10f, 1e10f), max_pos(-1e10f, -1e10f, -1e10f);
+		for (int i = 0; i < count; ++i)
+		{
+			Vector3& v = *(Vector3*)(position_data + (start + i) * position_stride);
+			v.y = heights[i];
+			min_pos.set(std::min(min_pos.x, v.x), std::min(min_pos.y, v.y), std::min(min_pos.z, v.z));
+			max_pos.set(std::max(max_pos.x, v.x), std::max(max_pos.y, v.y), std::max(max_pos.z, v.z));
+		}
+		block_min[block] = min_pos;
+		block_max[block] = max_pos;
+	});
+
+	Vector3 min_pos = block_min[0], max_pos = block_max[0];
+	for (int i = 1; i < num_blocks; ++i)
 	{
-		Vector2& uv = uvs[i];
-		Color c = heightmap->getPixelInterpolated(uv.x * heightmap->width, uv.y * heightmap->height);
-		if (is_interleaved)
-			interleaved[i].vertex.y = (c.x / 255.0f) * altitude;
-		else
-			vertices[i].y = (c.x / 255.0f) * altitude;
+		min_pos.set(std::min(min_pos.x, block_min[i].x), std::min(min_pos.y, block_min[i].y), std::min(min_pos.z, block_min[i].z));
+		max_pos.set(std::max(max_pos.x, block_max[i].x), std::max(max_pos.y, block_max[i].y), std::max(max_pos.z, block_max[i].z));
 	}
-	box.center.y += altitude*0.5f;
-	box.halfsize.y += altitude*0.5f;
+	box.center = (min_pos + max_pos) * 0.5f;
+	box.halfsize = (max_pos - min_pos) * 0.5f;
 	radius = box.halfsize.length();
+
+	computeNormals();
+	if (tangents.size())
+		computeTangents();
+	releaseCollisionModel(); //the triangles have moved
+
+	//the compact stream and its box must follow the new positions and normals
+	if (quantized.size())
+		quantizeBuffers();
+	if (quantized_vbo_id || interleaved_vbo_id || vertices_vbo_id)
+		uploadToVRAM();
+}
+
+//corners (3 per triangle) sorted by a key like the vertex they use, first[key] is the first corner with that key
+static void buildCornerLists(const std::vector<unsigned int>& corner_keys, unsigned int num_keys, std::vector<unsigned int>& first, std::vector<unsigned int>& corners)
+{
+	first.assign(num_keys + 1, 0);
+	for (size_t i = 0; i < corner_keys.size(); ++i)
+		first[corner_keys[i] + 1]++;
+	for (unsigned int i = 0; i < num_keys; ++i)
+		first[i + 1] += first[i];
+	corners.resize(corner_keys.size());
+	std::vector<unsigned int> cursor(first.begin(), first.end() - 1);
+	for (size_t i = 0; i < corner_keys.size(); ++i)
+		corners[cursor[corner_keys[i]]++] = (unsigned int)i;
+}
+
+//smooth normals weighted by the angle of every corner, only across the edges flatter than crease_angle (degrees)
+//vertices shared by triangles at both sides of a crease are split
+void Mesh::computeNormals(float crease_angle)
+{
+	loadMappedStreams();
+
+	bool is_interleaved = interleaved.size() != 0;
+	unsigned int num = is_interleaved ? interleaved.size() : vertices.size();
+	if (!num)
+		return;
+	const char* position_data = is_interleaved ? (const char*)&interleaved[0].vertex : (const char*)&vertices[0];
+	unsigned int stride = is_interleaved ? sizeof(tInterleaved) : sizeof(Vector3);
+	auto position = [&](unsigned int i) -> const Vector3& { return *(const Vector3*)(position_data + i * stride); };
+
+	unsigned int num_triangles = indices.size() ? indices.size() : num / 3;
+	std::vector<unsigned int> corner_vertices(num_triangles * 3);
+	for (unsigned int i = 0; i < num_triangles * 3; ++i)
+		corner_vertices[i] = indices.size() ? indices[i / 3].v[i % 3] : i;
+
+	//unit normal of every triangle and the angle of each corner
+	std::vector<Vector3> face_normals(num_triangles);
+	std::vector<float> corner_angles(num_triangles * 3);
+	parallelFor((num_triangles + VERTEX_BLOCK_SIZE - 1) / VERTEX_BLOCK_SIZE, [&](int block) {
+		unsigned int end = std::min((block + 1) * VERTEX_BLOCK_SIZE, (int)num_triangles);
+		for (unsigned int i = block * VERTEX_BLOCK_SIZE; i < end; ++i)
+		{
+			const Vector3& a = position(corner_vertices[i * 3]);
+			const Vector3& b = position(corner_vertices[i * 3 + 1]);
+			const Vector3& c = position(corner_vertices[i * 3 + 2]);
+			Vector3 normal = (b - a).cross(c - a);
+			face_normals[i] = normal.length() > 0.0 ? normal.normalize() : Vector3(0.0f, 0.0f, 0.0f);
+			const Vector3* corner[3] = { &a, &b, &c };
+			for (int k = 0; k < 3; ++k)
+			{
+				Vector3 e1 = *corner[(k + 1) % 3] - *corner[k], e2 = *corner[(k + 2) % 3] - *corner[k];
+				float l = (float)(e1.length() * e2.length());
+				corner_angles[i * 3 + k] = l > 0.0f ? (float)acos(clamp(e1.dot(e2) / l, -1.0f, 1.0f)) : 0.0f;
+			}
+		}
+	});
+
+	//the corners are grouped by position, so the vertices split by the uvs (or the triangle soups) are smoothed together
+	std::vector<unsigned int> order(num);
+	for (unsigned int i = 0; i < num; ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		const Vector3& pa = position(a), &pb = position(b);
+		return pa.x < pb.x || (pa.x == pb.x && (pa.y < pb.y || (pa.y == pb.y && pa.z < pb.z)));
+	});
+	std::vector<unsigned int> position_ids(num);
+	unsigned int num_positions = 0;
+	for (unsigned int i = 0; i < num; ++i)
+	{
+		if (i && memcmp(&position(order[i]), &position(order[i - 1]), sizeof(Vector3)) != 0)
+			num_positions++;
+		position_ids[order[i]] = num_positions;
+	}
+	num_positions++;
+
+	std::vector<unsigned int> corner_keys(num_triangles * 3);
+	for (unsigned int i = 0; i < num_triangles * 3; ++i)
+		corner_keys[i] = position_ids[corner_vertices[i]];
+	std::vector<unsigned int> first, corners;
+	buildCornerLists(corner_keys, num_positions, first, corners);
+
+	//every corner gathers the triangles around its position, so two threads never write the same normal
+	float min_dot = (float)cos(crease_angle * DEG2RAD);
+	std::vector<Vector3> corner_normals(num_triangles * 3);
+	parallelFor((num_triangles * 3 + VERTEX_BLOCK_SIZE - 1) / VERTEX_BLOCK_SIZE, [&](int block) {
+		unsigned int end = std::min((block + 1) * VERTEX_BLOCK_SIZE, (int)num_triangles * 3);
+		for (unsigned int i = block * VERTEX_BLOCK_SIZE; i < end; ++i)
+		{
+			const Vector3& face_normal = face_normals[i / 3];
+			unsigned int key = corner_keys[i];
+			Vector3 normal(0.0f, 0.0f, 0.0f);
+			for (unsigned int j = first[key]; j < first[key + 1]; ++j)
+			{
+				unsigned int other = corners[j];
+				if (crease_angle >= 180.0f || face_normal.dot(face_normals[other / 3]) >= min_dot)
+					normal = normal + face_normals[other / 3] * corner_angles[other];
+			}
+			corner_normals[i] = normal.length() > 0.0 ? normal.normalize() : (face_normal.length() > 0.0 ? face_normal : Vector3(0.0f, 1.0f, 0.0f));
+		}
+	});
+
+	if (!indices.size())
+	{
+		if (!is_interleaved)
+			normals.resize(num);
+		for (unsigned int i = 0; i < num; ++i)
+			if (is_interleaved)
+				interleaved[i].normal = corner_normals[i];
+			else
+				normals[i] = corner_normals[i];
+		return;
+	}
+
+	//the corners of a vertex can end with different normals at a crease, every different one gets a copy of the vertex
+	std::vector<unsigned int> source(num);
+	std::vector<unsigned int> next_copy(num, 0xFFFFFFFF);
+	std::vector<Vector3> vertex_normals(num);
+	std::vector<bool> assigned(num, false);
+	for (unsigned int i = 0; i < num; ++i)
+		source[i] = i;
+	for (unsigned int i = 0; i < num_triangles * 3; ++i)
+	{
+		unsigned int v = corner_vertices[i];
+		const Vector3& normal = corner_normals[i];
+		if (!assigned[v])
+		{
+			vertex_normals[v] = normal;
+			assigned[v] = true;
+			continue;
+		}
+		while (vertex_normals[v].dot(normal) < 0.9999f && next_copy[v] != 0xFFFFFFFF)
+			v = next_copy[v];
+		if (vertex_normals[v].dot(normal) < 0.9999f)
+		{
+			next_copy[v] = source.size();
+			v = source.size();
+			source.push_back(corner_vertices[i]);
+			next_copy.push_back(0xFFFFFFFF);
+			vertex_normals.push_back(normal);
+		}
+		indices[i / 3].v[i % 3] = v;
+	}
+
+	if (source.size() > num)
+	{
+		remapStream(interleaved, source);
+		remapStream(vertices, source);
+		remapStream(uvs, source);
+		remapStream(colors, source);
+		remapStream(bones, source);
+		remapStream(weights, source);
+		remapStream(tangents, source);
+		releaseCollisionModel();
+	}
+	if (is_interleaved)
+		for (size_t i = 0; i < interleaved.size(); ++i)
+			interleaved[i].normal = vertex_normals[i];
+	else
+		normals.swap(vertex_normals);
 }
 
+//tangent in the direction of the u of the uvs with the MikkTSpace conventions: the triangle tangents are weighted by
+//the angle of the corner and projected to the plane of the normal, w is the sign of the bitangent (cross(normal, tangent) * w)
+bool Mesh::computeTangents()
+{
+	loadMappedStreams();
+
+	bool is_interleaved = interleaved.size() != 0;
+	unsigned int num = is_interleaved ? interleaved.size() : vertices.size();
+	if (!num || (!is_interleaved && (uvs.size() != num || normals.size() != num)))
+		return false;
+
+	unsigned int num_triangles = indices.size() ? indices.size() : num / 3;
+	std::vector<unsigned int> corner_vertices(num_triangles * 3);
+	for (unsigned int i = 0; i < num_triangles * 3; ++i)
+		corner_vertices[i] = indices.size() ? indices[i / 3].v[i % 3] : i;
+	auto position = [&](unsigned int i) -> const Vector3& { return is_interleaved ? interleaved[i].vertex : vertices[i]; };
+	auto normal = [&](unsigned int i) -> const Vector3& { return is_interleaved ? interleaved[i].normal : normals[i]; };
+	auto uv = [&](unsigned int i) -> const Vector2& { return is_interleaved ? interleaved[i].uv : uvs[i]; };
+
+	//tangent and bitangent of every triangle from the derivatives of its uvs
+	std::vector<Vector3> face_tangents(num_triangles), face_bitangents(num_triangles);
+	parallelFor((num_triangles + VERTEX_BLOCK_SIZE - 1) / VERTEX_BLOCK_SIZE, [&](int block) {
+		unsigned int end = std::min((block + 1) * VERTEX_BLOCK_SIZE, (int)num_triangles);
+		for (unsigned int i = block * VERTEX_BLOCK_SIZE; i < end; ++i)
+		{
+			unsigned int a = corner_vertices[i * 3], b = corner_vertices[i * 3 + 1], c = corner_vertices[i * 3 + 2];
+			Vector3 e1 = position(b) - position(a), e2 = position(c) - position(a);
+			Vector2 duv1 = uv(b) - uv(a), duv2 = uv(c) - uv(a);
+			float det = duv1.x * duv2.y - duv2.x * duv1.y;
+			if (fabs(det) < 1e-12f)
+			{
+				face_tangents[i] = face_bitangents[i] = Vector3(0.0f, 0.0f, 0.0f);
+				continue;
+			}
+			face_tangents[i] = (e1 * duv2.y - e2 * duv1.y) * (1.0f / det);
+			face_bitangents[i] = (e2 * duv1.x - e1 * duv2.x) * (1.0f / det);
+		}
+	});
+
+	std::vector<unsigned int> first, corners;
+	buildCornerLists(corner_vertices, num, first, corners);
+
+	tangents.resize(num);
+	parallelFor((num + VERTEX_BLOCK_SIZE - 1) / VERTEX_BLOCK_SIZE, [&](int block) {
+		unsigned int end = std::min((block + 1) * VERTEX_BLOCK_SIZE, (int)num);
+		for (unsigned int i = block * VERTEX_BLOCK_SIZE; i < end; ++i)
+		{
+			const Vector3& n = normal(i);
+			Vector3 tangent(0.0f, 0.0f, 0.0f), bitangent(0.0f, 0.0f, 0.0f);
+			for (unsigned int j = first[i]; j < first[i + 1]; ++j)
+			{
+				unsigned int corner = corners[j], tri = corner / 3;
+				Vector3 e1 = position(corner_vertices[tri * 3 + (corner + 1) % 3]) - position(i);
+				Vector3 e2 = position(corner_vertices[tri * 3 + (corner + 2) % 3]) - position(i);
+				float l = (float)(e1.length() * e2.length());
+				float angle = l > 0.0f ? (float)acos(clamp(e1.dot(e2) / l, -1.0f, 1.0f)) : 0.0f;
+
+				Vector3 t = face_tangents[tri] - n * n.dot(face_tangents[tri]);
+				Vector3 b = face_bitangents[tri] - n * n.dot(face_bitangents[tri]);
+				if (t.length() > 0.0)
+					tangent = tangent + t.normalize() * angle;
+				if (b.length() > 0.0)
+					bitangent = bitangent + b.normalize() * angle;
+			}
+
+			//degenerated uvs, any direction in the plane of the normal
+			if (tangent.length() < 1e-6)
+				tangent = fabs(n.x) < 0.9f ? Vector3(1.0f, 0.0f, 0.0f).cross(n) : Vector3(0.0f, 1.0f, 0.0f).cross(n);
+			tangent = tangent - n * n.dot(tangent);
+			tangent.normalize();
+			float sign = n.cross(tangent).dot(bitangent) < 0.0f ? -1.0f : 1.0f;
+			tangents[i] = Vector4(tangent, sign);
+		}
+	});
+	return true;
+}
 
 void Mesh::createGrid(float dist)
 {
@@ -1406,15 +3707,171 @@ Mesh* Mesh::getQuad()
 	return quad;
 }
 
+//the loads run in as many threads as cores, they live until shutdownLoaders
+static std::vector<std::thread> loader_threads;
+static std::deque<std::function<void()>> loader_jobs;
+static std::mutex loader_mutex;
+static std::condition_variable loader_condition;
+static bool loader_exit = false;
+
+static void loaderWorker()
+{
+	in_loader_thread = true;
+	while (true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(loader_mutex);
+			loader_condition.wait(lock, []() { return loader_exit || !loader_jobs.empty(); });
+			if (loader_jobs.empty())
+				return; //the pending loads are finished before exiting
+			job = loader_jobs.front();
+			loader_jobs.pop_front();
+		}
+		job();
+	}
+}
+
+static double elapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+//reads all the pages of the file so it is in the cache of the OS and the parsing doesn't wait for the disk
+static bool prefetchFile(const char* filename)
+{
+	MappedFile file;
+	if (!file.open(filename))
+		return false;
+	volatile char sum = 0;
+	for (size_t i = 0; i < file.size; i += 4096)
+		sum += file.data[i];
+	return true;
+}
+
 Mesh* Mesh::Get(const char* filename)
+{
+	Mesh* m = GetAsync(filename).get();
+	processUploads();
+	return m;
+}
+
+std::shared_future<Mesh*> Mesh::GetAsync(const char* filename)
 {
 	assert(filename);
-	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
+	std::string name = filename;
+	std::lock_guard<std::recursive_mutex> lock(sMutex);
+
+	//already loaded
+	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(name);
 	if (it != sMeshesLoaded.end())
-		return it->second;
+	{
+		std::promise<Mesh*> loaded;
+		loaded.set_value(it->second);
+		return loaded.get_future().share();
+	}
 
-	Mesh* m = new Mesh();
-	std::string name = filename;
+	//somebody else asked for it, only one load per file
+	std::map<std::string, std::shared_future<Mesh*>>::iterator loading = sMeshesLoading.find(name);
+	if (loading != sMeshesLoading.end())
+		return loading->second;
+
+	std::shared_ptr<std::promise<Mesh*>> promise = std::make_shared<std::promise<Mesh*>>();
+	std::shared_future<Mesh*> future = promise->get_future().share();
+	sMeshesLoading[name] = future;
+	num_loads_in_flight++;
+
+	{
+		std::lock_guard<std::mutex> pool_lock(loader_mutex);
+		if (loader_threads.empty())
+		{
+			loader_exit = false;
+			int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+			for (int i = 0; i < num_threads; ++i)
+				loader_threads.push_back(std::thread(loaderWorker));
+		}
+		loader_jobs.push_back([name, promise]() {
+			Mesh* m = load(name);
+			num_loads_in_flight--;
+			promise->set_value(m);
+		});
+	}
+	loader_condition.notify_one();
+
+	return future;
+}
+
+void Mesh::shutdownLoaders()
+{
+	{
+		std::lock_guard<std::mutex> pool_lock(loader_mutex);
+		loader_exit = true;
+	}
+	loader_condition.notify_all();
+	for (size_t i = 0; i < loader_threads.size(); ++i)
+		loader_threads[i].join();
+	loader_threads.clear();
+}
+
+std::vector<Mesh*> Mesh::GetMany(const std::vector<std::string>& filenames)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	std::vector<std::shared_future<Mesh*>> futures;
+	for (size_t i = 0; i < filenames.size(); ++i)
+		futures.push_back(GetAsync(filenames[i].c_str()));
+
+	//the meshes are uploaded as they arrive, while the rest are still being parsed
+	std::vector<Mesh*> meshes;
+	for (size_t i = 0; i < futures.size(); ++i)
+	{
+		while (futures[i].wait_for(std::chrono::milliseconds(1)) != std::future_status::ready)
+			processUploads();
+		meshes.push_back(futures[i].get());
+	}
+	processUploads();
+
+	std::cout << " + Meshes loaded: " << filenames.size() << " in " << elapsedMs(start) << " ms" << std::endl;
+	return meshes;
+}
+
+int Mesh::processUploads()
+{
+	std::vector<Mesh*> queue;
+	{
+		std::lock_guard<std::recursive_mutex> lock(sMutex);
+		queue.swap(sUploadQueue);
+	}
+
+	for (size_t i = 0; i < queue.size(); ++i)
+	{
+		Mesh* m = queue[i];
+		auto start = std::chrono::high_resolution_clock::now();
+		if (auto_upload_to_vram)
+		{
+			m->load_log += "[VRAM] ";
+			m->uploadToVRAM();
+		}
+
+		//only what the CPU needs stays in memory
+		m->residency = default_residency;
+		m->applyResidency();
+		m->load_times.upload = elapsedMs(start);
+
+		const sLoadTimes& t = m->load_times;
+		std::cout << m->load_log << "[OK]  Faces: " << (m->getNumIndices() ? m->getNumIndices() : m->getNumVertices() / 3);
+		std::cout << " I/O: " << t.io << "ms Parse: " << t.parse << "ms Process: " << t.process << "ms Interleave: " << t.interleave << "ms Upload: " << t.upload << "ms" << std::endl;
+		std::cout << m->load_details;
+		m->load_log.clear();
+		m->load_details.clear();
+	}
+	return (int)queue.size();
+}
+
+//all the loading except the GL calls, in a worker thread. The mesh is registered and queued for processUploads
+Mesh* Mesh::load(const std::string& name)
+{
+	const char* filename = name.c_str();
 
 	//detect format
 	char file_format = 0;
@@ -1430,38 +3887,44 @@ Mesh* Mesh::Get(const char* filename)
 	else
 	{
 		std::cerr << "Unknown mesh format: " << filename << std::endl;
-		return NULL;
+		return finishLoad(name, NULL);
 	}
 
-	//stats
-	long time = getTime();
-	std::cout << " + Mesh loading: " << filename << " ... ";
+	Mesh* m = new Mesh();
+	m->load_log = " + Mesh loading: " + name + " ... ";
 	std::string binfilename = filename;
 
 	if (file_format != FORMAT_MBIN)
 		binfilename = binfilename + ".mbin";
 
 	//try loading the binary version
-	if ( m->readBin(binfilename.c_str()) && use_binary )
+	auto start = std::chrono::high_resolution_clock::now();
+	if (use_binary && prefetchFile(binfilename.c_str()) && m->readBin(binfilename.c_str()))
 	{
-		if(interleave_meshes && m->interleaved.size() == 0)
+		m->load_times.io = elapsedMs(start);
+		m->load_log += "[BIN] ";
+
+		start = std::chrono::high_resolution_clock::now();
+		if(interleave_meshes && m->interleaved.size() == 0 && m->mapped.interleaved.size == 0 && m->mapped.quantized.size == 0)
 		{
-			std::cout << "[INTERL] ";
+			m->load_log += "[INTERL] ";
 			m->interleaveBuffers();
 		}
 
-		if (auto_upload_to_vram)
-		{
-			std::cout << "[VRAM] ";
-			m->uploadToVRAM();
-		}
+		//straight from the mapped file to the VRAM, otherwise the vectors are needed to render
+		if (!auto_upload_to_vram)
+			m->loadMappedStreams();
+		m->load_times.interleave = elapsedMs(start);
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-		sMeshesLoaded[filename] = m;
-		return m;
+		return finishLoad(name, m);
 	}
 
 	//load the ascii version
+	start = std::chrono::high_resolution_clock::now();
+	prefetchFile(filename);
+	m->load_times.io = elapsedMs(start);
+
+	start = std::chrono::high_resolution_clock::now();
 	bool loaded = false;
 	if (file_format == FORMAT_OBJ)
 		loaded = m->loadOBJ(filename);
@@ -1469,42 +3932,147 @@ Mesh* Mesh::Get(const char* filename)
 		loaded = m->loadASE(filename);
 	else if (file_format == FORMAT_MESH)
 		loaded = m->loadMESH(filename);
+	m->load_times.parse = elapsedMs(start);
 
 	if (!loaded)
 	{
 		delete m;
-		std::cout << "[ERROR]: Mesh not found" << std::endl;
-		return NULL;
+		std::cout << " + Mesh loading: " << filename << " [ERROR]: Mesh not found" << std::endl;
+		return finishLoad(name, NULL);
 	}
 
+	start = std::chrono::high_resolution_clock::now();
+
+	//share the repeated vertices of the triangle soup
+	if (weld_meshes)
+	{
+		m->load_log += "[WELD] ";
+		m->weldVertices();
+	}
+
+	//meshes without normals get smooth ones, split at the creases
+	if (m->normals.size() == 0 && m->interleaved.size() == 0)
+	{
+		m->load_log += "[NORMALS] ";
+		m->computeNormals(crease_angle);
+	}
+
+	//for normal mapping, stored in the .mbin
+	if (generate_tangents && (m->uvs.size() || m->interleaved.size()))
+	{
+		m->load_log += "[TANGENTS] ";
+		m->computeTangents();
+	}
+
+	//reorder the triangles and vertices for the GPU caches, the result is stored in the .mbin
+	if (optimize_meshes && m->indices.size())
+	{
+		m->load_log += "[OPTIM] ";
+		m->optimizeVertexCache();
+	}
+
+	//simplified versions of the mesh for the distance
+	if (build_lods && m->indices.size())
+	{
+		m->load_log += "[LODS] ";
+		m->buildLODs();
+	}
+
+	//clusters for the culling, they need the final order of the triangles
+	if (build_meshlets && m->indices.size())
+	{
+		m->load_log += "[MESHLETS] ";
+		m->buildMeshlets();
+	}
+	m->load_times.process = elapsedMs(start);
+
+	start = std::chrono::high_resolution_clock::now();
+
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
 	{
-		std::cout << "[INTERL] ";
+		m->load_log += "[INTERL] ";
 		m->interleaveBuffers();
 	}
 
-	//and upload them to VRAM
-	if (auto_upload_to_vram)
+	//compact vertex format for the VRAM and the .mbin
+	if (quantize_meshes)
 	{
-		std::cout << "[VRAM] ";
-		m->uploadToVRAM();
+		m->load_log += "[QUANT] ";
+		m->quantizeBuffers();
 	}
+	m->load_times.interleave = elapsedMs(start);
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	if (use_binary)
 	{
-		std::cout << "\t\t Writing .BIN ... ";
+		start = std::chrono::high_resolution_clock::now();
+		m->load_log += "[WRITE BIN] ";
 		m->writeBin(filename);
-		std::cout << "[OK]" << std::endl;
+		m->load_times.io += elapsedMs(start);
+	}
+
+	return finishLoad(name, m);
+}
+
+Mesh* Mesh::finishLoad(const std::string& name, Mesh* m)
+{
+	if (in_loader_thread)
+	{
+		if (m)
+			m->load_details = loader_log.str();
+		else
+			std::cout << loader_log.str();
+		loader_log.str("");
 	}
 
-	m->registerMesh(name);
+	std::lock_guard<std::recursive_mutex> lock(sMutex);
+	sMeshesLoading.erase(name);
+	if (m)
+	{
+		m->registerMesh(name);
+		if (std::find(sInstances.begin(), sInstances.end(), m) == sInstances.end())
+			sInstances.push_back(m); //only now the memory report can read it
+		sUploadQueue.push_back(m);
+	}
 	return m;
 }
 
+void Mesh::benchmarkLoading(const std::vector<std::string>& filenames)
+{
+	//only the CPU part, there is no GL context, and always from the source files
+	bool prev_upload = auto_upload_to_vram;
+	bool prev_binary = use_binary;
+	auto_upload_to_vram = false;
+	use_binary = false;
+
+	//one after the other, like the old Mesh::Get
+	auto start = std::chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < filenames.size(); ++i)
+		if (!sMeshesLoaded.count(filenames[i]))
+			load(filenames[i]);
+	double serial = elapsedMs(start);
+	processUploads();
+
+	//forget them so they are loaded again
+	for (std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.begin(); it != sMeshesLoaded.end(); ++it)
+		delete it->second;
+	sMeshesLoaded.clear();
+
+	start = std::chrono::high_resolution_clock::now();
+	GetMany(filenames);
+	double parallel = elapsedMs(start);
+
+	std::cout << " + Load benchmark: " << filenames.size() << " files" << std::endl;
+	std::cout << "   serial:   " << serial << " ms" << std::endl;
+	std::cout << "   parallel: " << parallel << " ms, speedup: " << serial / parallel << "x" << std::endl;
+
+	auto_upload_to_vram = prev_upload;
+	use_binary = prev_binary;
+}
+
 void Mesh::registerMesh( std::string name )
 {
+	std::lock_guard<std::recursive_mutex> lock(sMutex);
 	this->name = name;
 	sMeshesLoaded[name] = this;
 }
@@ -3,15 +3,21 @@
 
 #include <vector>
 #include "framework.h"
+#include "residency.h"
 
 #include <map>
 #include <string>
+#include <mutex>
+#include <future>
 
 class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
+class MappedFile; //for binary meshes
+class Camera; //for culling
+class BVH; //for collisions
 
-#define MESH_BIN_VERSION 7 //this is used to regenerate bins if the format changes
+#define MESH_BIN_VERSION 13 //this is used to regenerate bins if the format changes
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -22,11 +28,27 @@ class Mesh
 {
 public:
 	static std::map<std::string, Mesh*> sMeshesLoaded;
+	static std::vector<Mesh*> sInstances; //all the meshes alive, for the memory report
+	static std::map<std::string, std::shared_future<Mesh*>> sMeshesLoading; //being parsed by a worker
+	static std::vector<Mesh*> sUploadQueue; //parsed, waiting for the GL thread
+	static std::recursive_mutex sMutex; //guards the four above
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool weld_meshes; //loaded meshes will be converted to indexed meshes without duplicated vertices
+	static bool optimize_meshes; //loaded meshes will be reordered for the vertex cache and overdraw
+	static bool quantize_meshes; //loaded meshes will be stored in the VRAM with the compact vertex format
+	static bool build_meshlets; //loaded meshes will be split in clusters to cull them
+	static bool meshlet_culling; //only the visible clusters are rendered
+	static bool build_lods; //loaded meshes will get simplified levels of detail
+	static float lod_pixel_error; //max error in pixels allowed when choosing a level of detail
+	static bool generate_tangents; //loaded meshes with uvs will get tangents for normal mapping
+	static float crease_angle; //loaded meshes without normals only smooth the edges flatter than this (degrees)
+	static bool position_streams; //uploaded meshes also get a stream with only the positions for the depth pre-pass
+	static eResidency default_residency; //what the loaded meshes keep in the CPU after the upload
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static long num_triangles_culled;
 
 	std::string name;
 
@@ -37,6 +59,7 @@ public:
 	std::vector< Vector3 > normals;	 //here we store the normals
 	std::vector< Vector2 > uvs;	 //here we store the texture coordinates
 	std::vector< Vector4 > colors; //here we store the colors
+	std::vector< Vector4 > tangents; //xyz tangent and w the sign of the bitangent, not interleaved
 
 	struct tInterleaved {
 		Vector3 vertex;
@@ -46,20 +69,88 @@ public:
 
 	std::vector< tInterleaved > interleaved; //to render interleaved
 
+	//compact vertex (16 bytes): position normalized to the quantization box, oct-encoded normal and half float uv
+	struct tQuantized {
+		unsigned short vertex[4]; //w is padding
+		short normal[2];
+		unsigned short uv[2];
+	};
+
+	std::vector< tQuantized > quantized; //only used by the GPU, the float streams are kept for the CPU
+	Vector3 quantization_min;
+	Vector3 quantization_size;
+
 	std::vector< Vector3u > indices; //for indexed meshes
 
+	//cluster of consecutive triangles with its bounds, used to cull parts of the mesh
+	struct sMeshlet {
+		unsigned int triangle_offset;
+		unsigned int triangle_count;
+		unsigned int vertex_count;
+		float radius;
+		Vector3 center;
+		float cone_cutoff; //sin of the aperture of the normals cone, 1 when it cannot be used
+		Vector3 cone_axis;
+	};
+	std::vector< sMeshlet > meshlets;
+
+	//index buffer with only the visible meshlets, rebuilt when the view changes
+	std::vector< Vector3u > visible_indices;
+	unsigned int visible_indices_vbo_id;
+	int num_visible_triangles; //-1 renders the whole mesh
+	Matrix44 last_cull_viewprojection;
+	Matrix44 last_cull_model;
+
+	//simplified levels of detail, the full detail one (0) uses the indices
+	struct sMeshLOD {
+		unsigned int triangle_offset; //in lod_indices
+		unsigned int triangle_count;
+		float error; //max distance to the original surface, in object units
+	};
+	std::vector< sMeshLOD > lods;
+	std::vector< Vector3u > lod_indices;
+	unsigned int lod_indices_vbo_id;
+	int current_lod; //level used when rendering the whole mesh, SceneNode sets it only for its own draw
+
 	//for animated meshes
 	std::vector< Vector4ub > bones; //tells which bones afect the vertex (4 max)
 	std::vector< Vector4 > weights; //tells how much affect every bone
 	std::vector< BoneInfo > bones_info; //tells 
 	Matrix44 bind_matrix;
 
+	//streams of a binary mesh used in place from the mapped file, they are copied to the vectors only when needed
+	template<typename T> struct tStreamView {
+		const T* data = NULL;
+		unsigned int size = 0;
+	};
+	struct tMappedStreams {
+		tStreamView<tInterleaved> interleaved;
+		tStreamView<tQuantized> quantized;
+		tStreamView<Vector3> vertices;
+		tStreamView<Vector3> normals;
+		tStreamView<Vector2> uvs;
+		tStreamView<Vector4> colors;
+		tStreamView<Vector3u> indices;
+		tStreamView<Vector3u> lod_indices;
+		tStreamView<Vector4ub> bones;
+		tStreamView<Vector4> weights;
+		tStreamView<Vector4> tangents;
+	} mapped;
+	MappedFile* bin_file;
+
+	//counts of the streams, valid also when they are only in the mapped file or in the VRAM
+	unsigned int num_vertices;
+	unsigned int num_indices;
+
 	Vector3 aabb_min;
 	Vector3	aabb_max;
 	BoundingBox box;
 
 	float radius;
 
+	eResidency residency; //applied by applyResidency, after the upload
+	size_t vram_bytes; //sent to the VRAM in the last upload
+
 	unsigned int vertices_vbo_id;
 	unsigned int uvs_vbo_id;
 	unsigned int normals_vbo_id;
@@ -67,8 +158,11 @@ public:
 
 	unsigned int indices_vbo_id;
 	unsigned int interleaved_vbo_id;
+	unsigned int quantized_vbo_id;
 	unsigned int bones_vbo_id;
 	unsigned int weights_vbo_id;
+	unsigned int tangents_vbo_id;
+	unsigned int positions_vbo_id; //only the positions, tightly packed (the vertices stream is used when there is no interleaved or compact one)
 
 	Mesh();
 	~Mesh();
@@ -80,6 +174,7 @@ public:
 	void renderBounding( const Matrix44& model, bool world_bounding = true );
 	void renderFixedPipeline(int primitive); //sloooooooow
 	void renderAnimated(unsigned int primitive, Skeleton *sk);
+	void renderDepth(unsigned int primitive, int submesh_id = 0); //only binds the positions, for the depth pre-pass
 
 	void enableBuffers(Shader* shader);
 	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
@@ -87,20 +182,42 @@ public:
 
 	bool readBin(const char* filename);
 	bool writeBin(const char* filename);
+	void loadMappedStreams(); //copies the mapped streams to the vectors and releases the file
+	void releaseMappedFile();
 
 	unsigned int getNumSubmaterials() { return material_name.size(); }
 	unsigned int getNumSubmeshes() { return material_range.size(); }
-	unsigned int getNumVertices() { return interleaved.size() ? interleaved.size() : vertices.size(); }
+	unsigned int getNumVertices() { return interleaved.size() ? interleaved.size() : vertices.size() ? vertices.size() : num_vertices; }
+	unsigned int getNumIndices() { return indices.size() ? indices.size() : num_indices; }
 
 	//collision testing
-	void* collision_model;
-	bool createCollisionModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
+	BVH* bvh;
+	void* collision_model; //coldet, only used by the benchmark
+	bool createCollisionModel(bool is_static = false); //builds the BVH, is_static is only used by coldet
+	bool createColdetModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
+	void releaseCollisionModel();
 	//help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
-	bool testRayCollision( Matrix44 model, Vector3 ray_origin, Vector3 ray_direction, Vector3& collision, Vector3& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false );
-	bool testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal);
+	bool testRayCollision( const Matrix44& model, Vector3 ray_origin, Vector3 ray_direction, Vector3& collision, Vector3& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false );
+	bool testSphereCollision(const Matrix44& model, Vector3 center, float radius, Vector3& collision, Vector3& normal);
+	//many rays at once split in packets between threads, distances is -1 for the misses, collisions and normals can be NULL. Returns the number of hits
+	int testRayCollisionBatch(const Matrix44& model, int num_rays, const Vector3* ray_origins, const Vector3* ray_directions, float* distances, Vector3* collisions = NULL, Vector3* normals = NULL, float max_ray_dist = 3.4e+38F, bool in_object_space = false);
+
+	//time of every step of the last load in ms, and its log
+	struct sLoadTimes {
+		double io = 0, parse = 0, process = 0, interleave = 0, upload = 0;
+	} load_times;
+	std::string load_log;
+	std::string load_details; //lines printed by the steps of a load in a worker, processUploads shows them after the log
 
 	//loader
-	static Mesh* Get(const char* filename);
+	static Mesh* Get(const char* filename); //waits for the load and the upload, call it from the GL thread
+	static std::shared_future<Mesh*> GetAsync(const char* filename); //parsed in a worker thread, processUploads sends it to the VRAM
+	static std::vector<Mesh*> GetMany(const std::vector<std::string>& filenames); //all at once in parallel, call it from the GL thread
+	static int processUploads(); //uploads the meshes the workers finished, call it from the GL thread
+	static void shutdownLoaders(); //finishes the pending loads and joins the worker threads, call it before exiting
+	static void benchmarkLoading(const std::vector<std::string>& filenames); //serial loading against GetMany
+	static void benchmarkOBJ(const char* filename, int iterations = 5); //compares the parallel OBJ parser with the old one
+	static void benchmarkCollision(const char* filename, int num_rays = 100000); //compares the BVH with coldet on the mesh and the terrain plane
 	void registerMesh(std::string name);
 
 	//create help meshes
@@ -110,16 +227,35 @@ public:
 	void createCube();
 	void createWireBox();
 	void createGrid(float dist);
-	void displace(Image* heightmap, float altitude);
+	void displace(Image* heightmap, float altitude); //moves the vertices up with the height map, recomputes the normals and the box
+	void computeNormals(float crease_angle = 180.0f); //angle weighted, the vertices at the creases are split
+	bool computeTangents();
 	static Mesh* getQuad(); //get global quad
 
 
 	//optimize meshes
 	void uploadToVRAM();
+	void applyResidency(); //frees the CPU streams the residency doesn't keep, call it after uploadToVRAM
+	size_t getCPUMemory();
 	bool interleaveBuffers();
+	bool weldVertices(float epsilon = 0.00001f); //merges the vertices with the same attributes (within epsilon) and creates the indices
+	bool quantizeBuffers(); //creates the compact vertex stream, call it after any change to the vertices
+	void dequantizeBuffers(); //fills the interleaved stream from the compact one
+	bool buildLODs(int num_levels = 3, float ratio = 0.5f); //quadric simplification, every level has ratio times the triangles of the previous one
+	int selectLOD(const Matrix44& model, Camera* camera, float window_height) const; //level for the size on the screen, render uses current_lod
+	bool buildMeshlets(unsigned int max_vertices = 64, unsigned int max_triangles = 124);
+	unsigned int findVisibleMeshlets(const Matrix44& model, Camera* camera, std::vector<unsigned int>& visible, bool backface_culling); //returns the visible triangles
+	bool cullMeshlets(const Matrix44& model, Camera* camera, bool count_culled = true); //the next render will only draw the visible meshlets
+	void endMeshletCulling() { num_visible_triangles = -1; }
+	void reportMeshletCulling(const Matrix44& model, Camera* camera, int steps = 36); //culled triangles while orbiting the mesh
+	bool optimizeVertexCache(); //reorders triangles for the post-transform cache and overdraw, and vertices for fetch locality
+	void computeCacheStats(float& acmr, float& atvr); //average transformed vertices per triangle and per vertex
 
 private:
+	static Mesh* load(const std::string& filename); //everything except the GL calls
+	static Mesh* finishLoad(const std::string& filename, Mesh* mesh);
 	bool loadOBJ(const char* filename);
+	bool loadOBJSerial(const char* filename); //old line by line parser, kept for the benchmark
 	bool loadASE(const char* filename);
 	bool loadMESH(const char* filename); //personal format used for animations
 };
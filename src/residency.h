@@ -0,0 +1,11 @@
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+//What a resource keeps in the CPU memory once its data is in the VRAM
+enum eResidency {
+	RESIDENCY_KEEP, //all the CPU copies stay (needed to modify and upload it again)
+	RESIDENCY_DROP, //everything is freed after the upload
+	RESIDENCY_COLLISION //only what the CPU queries need (the positions and indices of a mesh)
+};
+
+#endif
@@ -23,8 +23,22 @@ SceneNode::~SceneNode()
 
 void SceneNode::render(Camera* camera)
 {
+	//simplified versions for the meshes far away
+	if (mesh && mesh->lods.size())
+		mesh->current_lod = mesh->selectLOD(model, camera, Application::instance->window_height);
+
+	//big meshes only send the clusters that can be seen (only the full detail level has them)
+	bool culled = mesh && Mesh::meshlet_culling && mesh->current_lod == 0 && mesh->cullMeshlets(model, camera);
+
 	if (material)
 		material->render(mesh, model, camera);
+
+	if (culled)
+		mesh->endMeshletCulling();
+
+	//the wireframe and the debug draws that follow use the full mesh
+	if (mesh)
+		mesh->current_lod = 0;
 }
 
 void SceneNode::renderWireframe(Camera* camera)
@@ -33,6 +47,28 @@ void SceneNode::renderWireframe(Camera* camera)
 	mat.render(mesh, model, camera);
 }
 
+void SceneNode::renderDepth(Camera* camera)
+{
+	if (!mesh)
+		return;
+
+	//same level and clusters than the main pass, or GL_EQUAL would discard its fragments
+	if (mesh->lods.size())
+		mesh->current_lod = mesh->selectLOD(model, camera, Application::instance->window_height);
+	bool culled = Mesh::meshlet_culling && mesh->current_lod == 0 && mesh->cullMeshlets(model, camera, false); //counted in the main pass
+
+	Shader* shader = Shader::Get("data/shaders/depth.vs", "data/shaders/depth.fs");
+	shader->enable();
+	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setUniform("u_model", model);
+	mesh->renderDepth(GL_TRIANGLES);
+	shader->disable();
+
+	if (culled)
+		mesh->endMeshletCulling();
+	mesh->current_lod = 0;
+}
+
 void SceneNode::renderInMenu()
 {
 	//Model edit
@@ -48,6 +84,14 @@ void SceneNode::renderInMenu()
 		ImGui::TreePop();
 	}
 
+	//Levels of detail
+	if (mesh && mesh->lods.size())
+		ImGui::Text("LOD: %d / %d", mesh->selectLOD(model, Application::instance->camera, Application::instance->window_height), (int)mesh->lods.size());
+
+	//Meshlets
+	if (mesh && mesh->meshlets.size() && ImGui::Button("Meshlet culling orbit"))
+		mesh->reportMeshletCulling(model, Application::instance->camera);
+
 	//Material
 	if (material && ImGui::TreeNode("Material"))
 	{
@@ -30,6 +30,7 @@ public:
 
 	virtual void render(Camera* camera);
 	virtual void renderWireframe(Camera* camera);
+	virtual void renderDepth(Camera* camera); //only the depth with a trivial shader, for the pre-pass of the opaque nodes
 	virtual void renderInMenu();
 };
 
@@ -0,0 +1,507 @@
+#include "terrain.h"
+#include "texture.h"
+#include "utils.h"
+#include "application.h"
+
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+
+Terrain::Terrain(const char* heightmap_filename, float size, float altitude, int patch_size)
+{
+	this->name = "Terrain";
+	this->size = size;
+	this->altitude = altitude;
+	this->patch_size = patch_size;
+	skirt_depth = altitude * 0.01f;
+	this->heightmap_filename = heightmap_filename;
+
+	if (!loadHeightmap(heightmap_filename))
+		return;
+	createPatch();
+	buildChunks();
+}
+
+Terrain::~Terrain()
+{
+	if (patch)
+		delete patch;
+	if (baked_mesh)
+		delete baked_mesh;
+}
+
+bool Terrain::loadHeightmap(const char* filename)
+{
+	Image image;
+	if (!image.loadTGA(filename))
+	{
+		std::cout << "[ERROR] Terrain heightmap not found: " << filename << std::endl;
+		return false;
+	}
+
+	return heightfield.create(&image, size, altitude);
+}
+
+//grid of (patch_size + 1)^2 vertices in [0,1] with a skirt around it, a_vertex.y is 1 for the vertices of the skirt
+void Terrain::createPatch()
+{
+	if (patch)
+		delete patch;
+	patch = new Mesh();
+
+	int n = patch_size + 1;
+	for (int z = 0; z < n; ++z)
+		for (int x = 0; x < n; ++x)
+			patch->vertices.push_back(Vector3(x / (float)patch_size, 0.0f, z / (float)patch_size));
+
+	//same winding than Mesh::createSubdividedPlane
+	for (int z = 0; z < patch_size; ++z)
+		for (int x = 0; x < patch_size; ++x)
+		{
+			unsigned int v00 = z * n + x, v10 = v00 + 1, v01 = v00 + n, v11 = v01 + 1;
+			patch->indices.push_back(Vector3u(v11, v10, v00));
+			patch->indices.push_back(Vector3u(v11, v00, v01));
+		}
+
+	//the border is walked counterclockwise (seen from above) so the skirt faces outside
+	std::vector<unsigned int> border;
+	for (int x = 0; x < patch_size; ++x)
+		border.push_back(x);
+	for (int z = 0; z < patch_size; ++z)
+		border.push_back(z * n + patch_size);
+	for (int x = patch_size; x > 0; --x)
+		border.push_back(patch_size * n + x);
+	for (int z = patch_size; z > 0; --z)
+		border.push_back(z * n);
+
+	unsigned int first_skirt = (unsigned int)patch->vertices.size();
+	for (size_t i = 0; i < border.size(); ++i)
+	{
+		Vector3 v = patch->vertices[border[i]];
+		patch->vertices.push_back(Vector3(v.x, 1.0f, v.z));
+	}
+	for (size_t i = 0; i < border.size(); ++i)
+	{
+		size_t next = (i + 1) % border.size();
+		unsigned int a = border[i], b = border[next];
+		unsigned int a_skirt = first_skirt + (unsigned int)i, b_skirt = first_skirt + (unsigned int)next;
+		patch->indices.push_back(Vector3u(a, b_skirt, a_skirt));
+		patch->indices.push_back(Vector3u(a, b, b_skirt));
+	}
+
+	patch->box.center.set(0.5f, 0.0f, 0.5f);
+	patch->box.halfsize.set(0.5f, 0.5f, 0.5f);
+	patch->radius = patch->box.halfsize.length();
+	patch->optimizeVertexCache();
+	patch->uploadToVRAM();
+	patch->residency = RESIDENCY_DROP;
+	patch->applyResidency();
+}
+
+//the same plane the scene used before the chunks, displaced on the CPU
+bool Terrain::createBakedMesh(int subdivisions)
+{
+	Image image;
+	if (!image.loadTGA(heightmap_filename.c_str()))
+		return false;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	if (baked_mesh)
+		delete baked_mesh;
+	baked_mesh = new Mesh();
+	baked_mesh->createSubdividedPlane(size, subdivisions, true);
+	baked_mesh->weldVertices();
+	baked_mesh->displace(&image, altitude);
+	baked_mesh->optimizeVertexCache();
+	baked_mesh->uploadToVRAM();
+	baked_mesh->residency = RESIDENCY_DROP; //the collisions of the terrain use the height field
+	baked_mesh->applyResidency();
+	double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << " + Terrain baked: " << baked_mesh->getNumIndices() << " triangles in " << elapsed * 1000.0 << " ms" << std::endl;
+	return true;
+}
+
+//max difference between the pixels of the chunk and the grid of the patch
+float Terrain::computeChunkError(const sChunk& chunk)
+{
+	int n = patch_size + 1;
+	std::vector<float> grid(n * n);
+	for (int j = 0; j < n; ++j)
+		for (int i = 0; i < n; ++i)
+		{
+			float u = chunk.uv.x + chunk.uv_size * i / patch_size;
+			float v = chunk.uv.y + chunk.uv_size * j / patch_size;
+			grid[j * n + i] = heightfield.getPixelHeight(u * heightfield.width - 0.5f, v * heightfield.height - 0.5f);
+		}
+
+	float error = 0.0f;
+	int min_x = std::max(0, (int)ceil(chunk.uv.x * heightfield.width - 0.5f));
+	int max_x = std::min(heightfield.width - 1, (int)floor((chunk.uv.x + chunk.uv_size) * heightfield.width - 0.5f));
+	int min_y = std::max(0, (int)ceil(chunk.uv.y * heightfield.height - 0.5f));
+	int max_y = std::min(heightfield.height - 1, (int)floor((chunk.uv.y + chunk.uv_size) * heightfield.height - 0.5f));
+	for (int y = min_y; y <= max_y; ++y)
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			float gx = (((x + 0.5f) / heightfield.width - chunk.uv.x) / chunk.uv_size) * patch_size;
+			float gy = (((y + 0.5f) / heightfield.height - chunk.uv.y) / chunk.uv_size) * patch_size;
+			int i = std::max(0, std::min((int)gx, patch_size - 1)), j = std::max(0, std::min((int)gy, patch_size - 1));
+			float fx = clamp(gx - i, 0.0f, 1.0f), fy = clamp(gy - j, 0.0f, 1.0f);
+			float h0 = grid[j * n + i] * (1.0f - fx) + grid[j * n + i + 1] * fx;
+			float h1 = grid[(j + 1) * n + i] * (1.0f - fx) + grid[(j + 1) * n + i + 1] * fx;
+			error = std::max(error, (float)fabs(heightfield.getPixel(x, y) - (h0 * (1.0f - fy) + h1 * fy)));
+		}
+	return error;
+}
+
+void Terrain::buildChunks()
+{
+	chunks.clear();
+	sChunk root;
+	root.uv.set(0.0f, 0.0f);
+	root.uv_size = 1.0f;
+	root.skirt = 0.0f;
+	chunks.push_back(root);
+	buildChunk(0, 0);
+
+	//the root has no parent, its skirt is only seen in the border of the terrain
+	chunks[0].skirt = std::max(skirt_depth, chunks[0].error);
+
+	int num_leaves = 0;
+	for (size_t i = 0; i < chunks.size(); ++i)
+		num_leaves += chunks[i].children == -1 ? 1 : 0;
+	std::cout << " + Terrain: " << chunks.size() << " chunks, " << num_leaves << " leaves of " << patch->getNumIndices() << " triangles" << std::endl;
+}
+
+void Terrain::buildChunk(int index, int depth)
+{
+	sChunk chunk = chunks[index]; //the vector grows while building the children
+
+	//pixels touching the chunk, the interpolated heights are between them
+	int min_x = std::max(0, (int)floor(chunk.uv.x * heightfield.width - 0.5f));
+	int max_x = std::min(heightfield.width - 1, (int)ceil((chunk.uv.x + chunk.uv_size) * heightfield.width - 0.5f));
+	int min_y = std::max(0, (int)floor(chunk.uv.y * heightfield.height - 0.5f));
+	int max_y = std::min(heightfield.height - 1, (int)ceil((chunk.uv.y + chunk.uv_size) * heightfield.height - 0.5f));
+	chunk.min_height = 1e10f;
+	chunk.max_height = -1e10f;
+	for (int y = min_y; y <= max_y; ++y)
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			chunk.min_height = std::min(chunk.min_height, heightfield.getPixel(x, y));
+			chunk.max_height = std::max(chunk.max_height, heightfield.getPixel(x, y));
+		}
+	chunk.error = computeChunkError(chunk);
+	chunk.children = -1;
+	chunk.level = depth;
+
+	//leaves have around one vertex per pixel
+	float pixels = chunk.uv_size * std::max(heightfield.width, heightfield.height);
+	if (pixels >= patch_size * 2 && depth < 10)
+	{
+		chunk.children = (int)chunks.size();
+		float half = chunk.uv_size * 0.5f;
+		for (int i = 0; i < 4; ++i)
+		{
+			sChunk child;
+			child.uv.set(chunk.uv.x + (i & 1) * half, chunk.uv.y + (i >> 1) * half);
+			child.uv_size = half;
+			child.skirt = std::max(skirt_depth, chunk.error); //long enough for a neighbour one level coarser
+			chunks.push_back(child);
+		}
+		for (int i = 0; i < 4; ++i)
+		{
+			buildChunk(chunk.children + i, depth + 1);
+			chunk.error = std::max(chunk.error, chunks[chunk.children + i].error);
+		}
+	}
+
+	float skirt = chunks[index].skirt;
+	chunks[index] = chunk;
+	chunks[index].skirt = skirt;
+}
+
+//the chunks are laid like the subdivided plane, x goes with v and z with u
+void Terrain::getChunkBox(const sChunk& chunk, Vector3& center, Vector3& halfsize)
+{
+	float half = chunk.uv_size * size * 0.5f;
+	float bottom = chunk.min_height - chunk.skirt;
+	center.set((chunk.uv.y - 0.5f) * size + half, (bottom + chunk.max_height) * 0.5f, (chunk.uv.x - 0.5f) * size + half);
+	halfsize.set(half, (chunk.max_height - bottom) * 0.5f, half);
+}
+
+void Terrain::selectChunks(Camera* camera)
+{
+	if (freeze_lod && visible_chunks.size())
+		return;
+	visible_chunks.clear();
+	num_culled_chunks = 0;
+	if (chunks.size())
+	{
+		selectChunk(0, camera);
+		balanceChunks(camera);
+	}
+}
+
+//the box of the chunk in world space, false if it is outside the frustum
+bool Terrain::testChunkInFrustum(const sChunk& chunk, Camera* camera, Vector3& center, Vector3& halfsize)
+{
+	//the terrain is only moved and scaled, so the box stays aligned
+	getChunkBox(chunk, center, halfsize);
+	Vector3 scale(Vector3(model.m[0], model.m[1], model.m[2]).length(), Vector3(model.m[4], model.m[5], model.m[6]).length(), Vector3(model.m[8], model.m[9], model.m[10]).length());
+	center = model * center;
+	halfsize.set(halfsize.x * scale.x, halfsize.y * scale.y, halfsize.z * scale.z);
+	return camera->testBoxInFrustum(center, halfsize) != CLIP_OUTSIDE;
+}
+
+void Terrain::selectChunk(int index, Camera* camera)
+{
+	const sChunk& chunk = chunks[index];
+
+	Vector3 center, halfsize;
+	if (!testChunkInFrustum(chunk, camera, center, halfsize))
+	{
+		num_culled_chunks++;
+		return;
+	}
+	Vector3 scale(Vector3(model.m[0], model.m[1], model.m[2]).length(), Vector3(model.m[4], model.m[5], model.m[6]).length(), Vector3(model.m[8], model.m[9], model.m[10]).length());
+
+	if (chunk.children != -1)
+	{
+		//error of the chunk seen from the closest point of its box
+		Vector3 closest(clamp(camera->eye.x, center.x - halfsize.x, center.x + halfsize.x),
+			clamp(camera->eye.y, center.y - halfsize.y, center.y + halfsize.y),
+			clamp(camera->eye.z, center.z - halfsize.z, center.z + halfsize.z));
+		float pixel_error = camera->getProjectedScale(closest, chunk.error * scale.y);
+		if (pixel_error > max_pixel_error)
+		{
+			for (int i = 0; i < 4; ++i)
+				selectChunk(chunk.children + i, camera);
+			return;
+		}
+	}
+
+	visible_chunks.push_back(index);
+}
+
+static long long chunkKey(int level, float u, float v)
+{
+	int cells = 1 << level;
+	return ((long long)level << 48) | ((long long)(int)floor(u * cells) << 24) | (long long)(int)floor(v * cells);
+}
+
+//The skirts only hide the cracks with a neighbour one level coarser, so the chunks next to a finer one
+//by two levels or more are split until the selection is balanced
+void Terrain::balanceChunks(Camera* camera)
+{
+	while (true)
+	{
+		std::unordered_map<long long, int> selected; //chunk of every selected cell
+		for (size_t i = 0; i < visible_chunks.size(); ++i)
+		{
+			const sChunk& chunk = chunks[visible_chunks[i]];
+			float half = chunk.uv_size * 0.5f;
+			selected[chunkKey(chunk.level, chunk.uv.x + half, chunk.uv.y + half)] = visible_chunks[i];
+		}
+
+		//a coarser neighbour covers the whole edge, its cell is found from a point just outside the middle of the edge
+		std::unordered_set<int> to_split;
+		for (size_t i = 0; i < visible_chunks.size(); ++i)
+		{
+			const sChunk& chunk = chunks[visible_chunks[i]];
+			float half = chunk.uv_size * 0.5f;
+			Vector2 edges[4] = { Vector2(-half * 1.5f, 0.0f), Vector2(half * 1.5f, 0.0f), Vector2(0.0f, -half * 1.5f), Vector2(0.0f, half * 1.5f) };
+			for (int e = 0; e < 4; ++e)
+			{
+				float u = chunk.uv.x + half + edges[e].x;
+				float v = chunk.uv.y + half + edges[e].y;
+				if (u < 0.0f || v < 0.0f || u >= 1.0f || v >= 1.0f)
+					continue;
+				for (int level = 0; level < chunk.level - 1; ++level)
+				{
+					std::unordered_map<long long, int>::iterator it = selected.find(chunkKey(level, u, v));
+					if (it != selected.end() && chunks[it->second].children != -1)
+						to_split.insert(it->second);
+				}
+			}
+		}
+		if (to_split.empty())
+			break;
+
+		std::vector<int> balanced;
+		for (size_t i = 0; i < visible_chunks.size(); ++i)
+		{
+			int index = visible_chunks[i];
+			if (!to_split.count(index))
+			{
+				balanced.push_back(index);
+				continue;
+			}
+			Vector3 center, halfsize;
+			for (int j = 0; j < 4; ++j)
+			{
+				int child = chunks[index].children + j;
+				if (testChunkInFrustum(chunks[child], camera, center, halfsize))
+					balanced.push_back(child);
+				else
+					num_culled_chunks++;
+			}
+		}
+		visible_chunks.swap(balanced);
+	}
+}
+
+float Terrain::getHeight(const Vector3& position)
+{
+	Matrix44 inv = model;
+	inv.inverse();
+	Vector3 local = inv * position;
+	return (model * Vector3(local.x, heightfield.getHeight(local.x, local.z), local.z)).y;
+}
+
+bool Terrain::testRay(const Vector3& origin, const Vector3& direction, Vector3& collision, float max_ray_dist)
+{
+	Matrix44 inv = model;
+	inv.inverse();
+	Vector3 local_origin = inv * origin;
+	Vector3 local_direction = inv.rotateVector(direction);
+	float t;
+	if (!heightfield.testRay(local_origin, local_direction, max_ray_dist, t))
+		return false;
+	collision = model * (local_origin + local_direction * t);
+	return true;
+}
+
+//moves the camera up when it is closer than distance to the ground
+bool Terrain::followGround(Camera* camera, float distance)
+{
+	Matrix44 inv = model;
+	inv.inverse();
+	Vector3 local = inv * camera->eye;
+	if (fabs(local.x) > size * 0.5f || fabs(local.z) > size * 0.5f)
+		return false;
+
+	float ground = getHeight(camera->eye);
+	if (camera->eye.y >= ground + distance)
+		return false;
+
+	Vector3 delta(0.0f, ground + distance - camera->eye.y, 0.0f);
+	camera->lookAt(camera->eye + delta, camera->center + delta, camera->up);
+	return true;
+}
+
+void Terrain::drawChunks(Shader* shader, bool depth_only)
+{
+	shader->setUniform("u_terrain_size", size);
+	shader->setUniform("u_altitude", altitude);
+	for (size_t i = 0; i < visible_chunks.size(); ++i)
+	{
+		const sChunk& chunk = chunks[visible_chunks[i]];
+		shader->setUniform("u_chunk", Vector4(chunk.uv.x, chunk.uv.y, chunk.uv_size, chunk.skirt));
+		if (depth_only)
+			patch->renderDepth(GL_TRIANGLES);
+		else
+			patch->render(GL_TRIANGLES);
+	}
+}
+
+void Terrain::render(Camera* camera)
+{
+	if (!material || !material->shader || !patch)
+		return;
+
+	if (baked && baked_mesh)
+	{
+		Shader* shader = Shader::Get("data/shaders/basic.vs", "data/shaders/texture.fs");
+		shader->enable();
+		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+		shader->setUniform("u_model", model);
+		shader->setUniform("u_color", material->color);
+		if (material->beauty)
+			shader->setUniform("u_texture_beauty", material->beauty);
+		baked_mesh->render(GL_TRIANGLES);
+		shader->disable();
+		return;
+	}
+
+	selectChunks(camera);
+
+	Shader* shader = material->shader;
+	shader->enable();
+	material->setUniforms(camera, model);
+	drawChunks(shader);
+	shader->disable();
+}
+
+void Terrain::renderWireframe(Camera* camera)
+{
+	if (!material || !patch)
+		return;
+
+	if (baked && baked_mesh)
+	{
+		WireframeMaterial wireframe;
+		wireframe.render(baked_mesh, model, camera);
+		return;
+	}
+
+	Shader* shader = Shader::Get("data/shaders/terrain.vs", "data/shaders/flat.fs");
+	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	shader->enable();
+	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setUniform("u_model", model);
+	shader->setUniform("u_color", Vector4(1.0f, 1.0f, 1.0f, 1.0f));
+	if (material->texture)
+		shader->setUniform("u_texture", material->texture);
+	drawChunks(shader);
+	shader->disable();
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+}
+
+void Terrain::renderDepth(Camera* camera)
+{
+	if (!material || !patch)
+		return;
+
+	if (baked && baked_mesh)
+	{
+		Shader* shader = Shader::Get("data/shaders/depth.vs", "data/shaders/depth.fs");
+		shader->enable();
+		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+		shader->setUniform("u_model", model);
+		baked_mesh->renderDepth(GL_TRIANGLES);
+		shader->disable();
+		return;
+	}
+
+	//the chunks are selected again with the same camera, so they are the same ones of the main pass
+	selectChunks(camera);
+
+	Shader* shader = Shader::Get("data/shaders/terrain.vs", "data/shaders/depth.fs");
+	shader->enable();
+	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setUniform("u_model", model);
+	if (material->texture)
+		shader->setUniform("u_texture", material->texture);
+	drawChunks(shader, true);
+	shader->disable();
+}
+
+void Terrain::renderInMenu()
+{
+	SceneNode::renderInMenu();
+
+	ImGui::Text("Chunks: %d (culled %d), triangles: %d", (int)visible_chunks.size(), num_culled_chunks, (int)visible_chunks.size() * (patch ? patch->getNumIndices() : 0));
+	ImGui::SliderFloat("Max pixel error", &max_pixel_error, 0.25f, 16.0f);
+	ImGui::Checkbox("Freeze LOD", &freeze_lod);
+	if (ImGui::Checkbox("Baked on the CPU", &baked) && baked && !baked_mesh)
+		baked = createBakedMesh();
+
+	//ground under the center of the view
+	Camera* camera = Application::instance->camera;
+	Vector3 collision;
+	if (testRay(camera->eye, (camera->center - camera->eye).normalize(), collision))
+		ImGui::Text("Ground at view center: %.2f, %.2f, %.2f (%.2f away)", collision.x, collision.y, collision.z, camera->eye.distance(collision));
+	else
+		ImGui::Text("Ground at view center: none");
+}
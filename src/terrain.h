@@ -0,0 +1,72 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include "framework.h"
+#include "scenenode.h"
+#include "heightfield.h"
+
+//Height map terrain split in a quadtree of chunks. Every chunk is drawn with the same grid patch, placed and
+//displaced in terrain.vs, and the chunks are refined until their error on screen is small enough
+class Terrain : public SceneNode {
+public:
+
+	struct sChunk {
+		Vector2 uv; //corner of the chunk in the height map
+		float uv_size;
+		float min_height;
+		float max_height;
+		float error; //max height difference with the full detail, in object units
+		float skirt; //depth of the skirt, the error of the parent
+		int children; //first of the 4 children, -1 for leaves
+		int level; //depth in the quadtree, the root is 0
+	};
+
+	std::vector<sChunk> chunks; //the root is the first one
+	HeightField heightfield; //the heights in the CPU for the chunks and the collisions
+
+	float size; //side of the terrain, centered in the origin like Mesh::createSubdividedPlane
+	float altitude;
+	int patch_size; //quads per side of every chunk
+	float skirt_depth; //hides the cracks between chunks with different detail
+	Mesh* patch = NULL;
+	std::string heightmap_filename;
+
+	//the whole terrain displaced on the CPU once, instead of the chunks displaced in the shader every frame
+	bool baked = false;
+	Mesh* baked_mesh = NULL;
+
+	float max_pixel_error = 2.0f;
+	bool freeze_lod = false; //keeps the selected chunks to look at them from outside
+	std::vector<int> visible_chunks;
+	int num_culled_chunks = 0;
+
+	Terrain(const char* heightmap_filename, float size = 100.0f, float altitude = 9.0f, int patch_size = 32);
+	~Terrain();
+
+	bool loadHeightmap(const char* filename);
+	void createPatch();
+	void buildChunks();
+	void selectChunks(Camera* camera);
+	bool createBakedMesh(int subdivisions = 512);
+
+	//queries in world space
+	float getHeight(const Vector3& position);
+	bool testRay(const Vector3& origin, const Vector3& direction, Vector3& collision, float max_ray_dist = 3.4e+38F);
+	bool followGround(Camera* camera, float distance);
+
+	void render(Camera* camera);
+	void renderWireframe(Camera* camera);
+	void renderDepth(Camera* camera);
+	void renderInMenu();
+
+private:
+	float computeChunkError(const sChunk& chunk);
+	void buildChunk(int index, int depth);
+	void selectChunk(int index, Camera* camera);
+	void balanceChunks(Camera* camera);
+	bool testChunkInFrustum(const sChunk& chunk, Camera* camera, Vector3& center, Vector3& halfsize);
+	void getChunkBox(const sChunk& chunk, Vector3& center, Vector3& halfsize);
+	void drawChunks(Shader* shader, bool depth_only = false);
+};
+
+#endif
@@ -4,6 +4,7 @@
 
 #include <iostream> //to output
 #include <cmath>
+#include <algorithm>
 
 #include "mesh.h"
 #include "shader.h"
@@ -41,6 +42,8 @@ Vector4 Image::getPixelInterpolatedHigh(float x, float y, bool repeat) {
 
 
 std::map<std::string, Texture*> Texture::sTexturesLoaded;
+std::vector<Texture*> Texture::sInstances;
+eResidency Texture::default_residency = RESIDENCY_DROP;
 int Texture::default_mag_filter = GL_LINEAR;
 int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 FBO* Texture::global_fbo = NULL;
@@ -55,23 +58,30 @@ Texture::Texture()
 	format = 0;
 	type = 0;
 	texture_type = GL_TEXTURE_2D;
+	residency = default_residency;
+	sInstances.push_back(this);
 }
 
 Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
 	texture_id = 0;
+	residency = default_residency;
+	sInstances.push_back(this);
 	create(width, height, format, type, mipmaps, data, internal_format);
 }
 
 Texture::Texture(Image* img)
 {
 	texture_id = 0;
+	residency = default_residency;
+	sInstances.push_back(this);
 	create(img->width, img->height, img->bytes_per_pixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
 }
 
 Texture::~Texture()
 {
 	clear();
+	sInstances.erase(std::find(sInstances.begin(), sInstances.end(), this));
 }
 
 void Texture::clear()
@@ -113,8 +123,8 @@ void Texture::create(unsigned int width, unsigned int height, unsigned int forma
 
 	assert(checkGLErrors() && "Error creating texture");
 
-	if (data != NULL)
-		upload(format, type, mipmaps, data, internal_format);
+	//upload even without data so the storage is allocated (render targets need it)
+	upload(format, type, mipmaps, data, internal_format);
 }
 
 void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
@@ -140,8 +150,8 @@ void Texture::create3D(unsigned int width, unsigned int height, unsigned int dep
 
 	assert(checkGLErrors() && "Error creating texture");
 
-	if (data != NULL)
-		upload3D(format, type, mipmaps, data, internal_format);
+	//upload even without data so the storage is allocated, it can be filled later with upload3DRegion
+	upload3D(format, type, mipmaps, data, internal_format);
 }
 
 void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
@@ -208,12 +218,14 @@ bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int t
 	else
 	{
 		std::cout << "[ERROR]: unsupported format" << std::endl;
+		delete image;
 		return false; //unsupported file type
 	}
 
 	if (!found) //file not found
 	{
 		std::cout << " [ERROR]: Texture not found " << std::endl;
+		delete image;
 		return false;
 	}
 
@@ -232,12 +244,38 @@ bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int t
 	if (mipmaps)
 		generateMipmaps();
 
+	//the pixels stay in the CPU only if they will be read or uploaded again
 	this->image.clear();
+	if (residency == RESIDENCY_KEEP)
+	{
+		this->image.width = image->width;
+		this->image.height = image->height;
+		this->image.bytes_per_pixel = image->bytes_per_pixel;
+		this->image.origin_topleft = image->origin_topleft;
+		this->image.data = image->data;
+		image->data = NULL;
+	}
+	delete image;
+
 	std::cout << "[OK] Size: " << width << "x" << height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	setName(filename);
 	return true;
 }
 
+size_t Texture::getGPUMemory()
+{
+	if (!texture_id)
+		return 0;
+	int channels = format == GL_RED || format == GL_DEPTH_COMPONENT ? 1 : format == GL_RG ? 2 : format == GL_RGB ? 3 : 4;
+	int bytes_per_channel = type == GL_FLOAT || type == GL_UNSIGNED_INT ? 4 : type == GL_HALF_FLOAT || type == GL_UNSIGNED_SHORT ? 2 : 1;
+	size_t bytes = (size_t)width * (size_t)height * (depth > 0 ? (size_t)depth : 1) * channels * bytes_per_channel;
+	if (texture_type == GL_TEXTURE_CUBE_MAP)
+		bytes *= 6;
+	if (mipmaps)
+		bytes += bytes / 3;
+	return bytes;
+}
+
 void Texture::upload(Image* img)
 {
 	create(img->width, img->height, img->bytes_per_pixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
@@ -287,6 +325,36 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
+void Texture::upload3DRegion(unsigned int format, unsigned int type, Uint8* data, int data_width, int data_height, int x, int y, int z, int w, int h, int d)
+{
+	assert(texture_id && "Must create texture before uploading data.");
+	assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
+	if (w <= 0 || h <= 0 || d <= 0)
+		return;
+
+	glBindTexture(this->texture_type, texture_id);
+
+	//the rows and slices of the box are strided inside the full volume
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, data_width);
+	glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, data_height);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+	glPixelStorei(GL_UNPACK_SKIP_IMAGES, z);
+
+	glTexSubImage3D(this->texture_type, 0, x, y, z, w, h, d, format, type, data);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+	glPixelStorei(GL_UNPACK_SKIP_IMAGES, 0);
+
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading texture region");
+}
+
 void Texture::uploadCubemap(unsigned int format, unsigned int type, bool mipmaps, Uint8** data, unsigned int internal_format) {
 	
 	assert(texture_id && "Must create texture before uploading data.");
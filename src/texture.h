@@ -6,7 +6,9 @@
 
 #include "includes.h"
 #include "framework.h"
+#include "residency.h"
 #include <map>
+#include <vector>
 #include <string>
 #include <cassert>
 
@@ -67,6 +69,8 @@ public:
 
 	//textures manager
 	static std::map<std::string, Texture*> sTexturesLoaded;
+	static std::vector<Texture*> sInstances; //all the textures alive, for the memory report
+	static eResidency default_residency; //if the loaded textures keep their image in the CPU
 
 	GLuint texture_id; // GL id to identify the texture in opengl, every texture must have its own id
 	float width;
@@ -83,8 +87,9 @@ public:
 	unsigned int wrapS;
 	unsigned int wrapT;
 
-	//original data info
+	//original data info, only kept with RESIDENCY_KEEP
 	Image image;
+	eResidency residency;
 
 	Texture();
 	Texture(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
@@ -100,6 +105,7 @@ public:
 	void upload(Image* img);
 	void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+	void upload3DRegion(unsigned int format, unsigned int type, Uint8* data, int data_width, int data_height, int x, int y, int z, int w, int h, int d); //data is the whole volume, only the box is sent
 	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0);
 	void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
@@ -121,6 +127,9 @@ public:
 
 	void generateMipmaps();
 
+	size_t getCPUMemory() { return image.data ? image.width * image.height * image.bytes_per_pixel : 0; }
+	size_t getGPUMemory(); //estimated from the format
+
 	//show the texture on the current viewport
 	void toViewport( Shader* shader = NULL );
 	void blit(Texture* destination, Shader* shader = NULL);
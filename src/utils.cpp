@@ -2,8 +2,14 @@
 
 #ifdef WIN32
 	#include <windows.h>
+	#include <psapi.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/resource.h>
+	#include <fcntl.h>
+	#include <unistd.h>
 #endif
 
 #include "includes.h"
@@ -12,9 +18,14 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
+#include "texture.h"
+#include "volume.h"
 
 #include "extra/stb_easy_font.h"
 
+#include <thread>
+#include <atomic>
+
 long getTime()
 {
 	#ifdef WIN32
@@ -26,6 +37,139 @@ long getTime()
 	#endif
 }
 
+size_t getPeakMemoryUsage()
+{
+	#ifdef WIN32
+		PROCESS_MEMORY_COUNTERS counters;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return 0;
+		return counters.PeakWorkingSetSize;
+	#else
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		#ifdef __APPLE__
+			return usage.ru_maxrss; //already in bytes
+		#else
+			return usage.ru_maxrss * 1024;
+		#endif
+	#endif
+}
+
+thread_local bool in_loader_thread = false;
+std::atomic<int> num_loads_in_flight(0);
+
+void parallelFor(int count, const std::function<void(int)>& task)
+{
+	if (count <= 0)
+		return;
+
+	//one thread per core per loader would be cores^2 threads, a load alone still uses them all
+	int num_threads = in_loader_thread && num_loads_in_flight > 1 ? 1 : (int)std::thread::hardware_concurrency();
+	num_threads = num_threads < 1 ? 1 : (num_threads > count ? count : num_threads);
+
+	//every thread takes the next task until there are no more, so uneven tasks are balanced
+	std::atomic<int> next_task(0);
+	auto worker = [&]() {
+		for (int i = next_task++; i < count; i = next_task++)
+			task(i);
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < num_threads; ++i)
+		threads.push_back(std::thread(worker));
+	worker(); //the calling thread also works
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+#ifdef WIN32
+	file_handle = mapping_handle = NULL;
+#else
+	file_descriptor = -1;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	mapping_handle = mapping;
+	size = (size_t)file_size.QuadPart;
+#else
+	int fd = ::open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat stbuffer;
+	if (fstat(fd, &stbuffer) != 0 || stbuffer.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	void* ptr = mmap(NULL, stbuffer.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		::close(fd);
+		return false;
+	}
+	madvise(ptr, stbuffer.st_size, MADV_SEQUENTIAL); //it is going to be read once from start to end
+	file_descriptor = fd;
+	data = (const char*)ptr;
+	size = stbuffer.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (!data)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mapping_handle);
+	CloseHandle(file_handle);
+	file_handle = mapping_handle = NULL;
+#else
+	munmap((void*)data, size);
+	::close(file_descriptor);
+	file_descriptor = -1;
+#endif
+	data = NULL;
+	size = 0;
+}
+
 float * snapshot()
 {
 	GLint viewport[4];
@@ -308,12 +452,54 @@ std::string getGPUStats()
 		nCurAvailMemoryInKB = 0;
 	}
 
-	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB-nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks Culled: " + std::to_string(long(Mesh::num_triangles_culled * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB-nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
 	Mesh::num_meshes_rendered = 0;
 	Mesh::num_triangles_rendered = 0;
+	Mesh::num_triangles_culled = 0;
 	return str;
 }
 
+static std::string toMB(size_t bytes)
+{
+	char str[32];
+	sprintf(str, "%.1fMB", bytes / (1024.0 * 1024.0));
+	return str;
+}
+
+std::string getMemoryStats()
+{
+	size_t mesh_cpu = 0, mesh_gpu = 0, texture_cpu = 0, texture_gpu = 0, volume_cpu = 0;
+	std::lock_guard<std::recursive_mutex> lock(Mesh::sMutex);
+	for (Mesh* mesh : Mesh::sInstances)
+	{
+		mesh_cpu += mesh->getCPUMemory();
+		mesh_gpu += mesh->vram_bytes;
+	}
+	for (Texture* texture : Texture::sInstances)
+	{
+		texture_cpu += texture->getCPUMemory();
+		texture_gpu += texture->getGPUMemory();
+	}
+	for (Volume* volume : Volume::sInstances)
+		volume_cpu += volume->getCPUMemory();
+
+	return "CPU: meshes " + toMB(mesh_cpu) + " textures " + toMB(texture_cpu) + " volumes " + toMB(volume_cpu) + "  VRAM: meshes " + toMB(mesh_gpu) + " textures " + toMB(texture_gpu);
+}
+
+void printMemoryReport()
+{
+	static const char* residency_names[] = { "keep", "drop", "collision" };
+
+	std::cout << " + Memory report: " << getMemoryStats() << std::endl;
+	std::lock_guard<std::recursive_mutex> lock(Mesh::sMutex);
+	for (Mesh* mesh : Mesh::sInstances)
+		std::cout << "\t Mesh " << (mesh->name.size() ? mesh->name : "(unnamed)") << " [" << residency_names[mesh->residency] << "] CPU: " << toMB(mesh->getCPUMemory()) << " VRAM: " << toMB(mesh->vram_bytes) << std::endl;
+	for (Texture* texture : Texture::sInstances)
+		std::cout << "\t Texture " << (texture->filename.size() ? texture->filename : "(unnamed)") << " " << (int)texture->width << "x" << (int)texture->height << " [" << residency_names[texture->residency] << "] CPU: " << toMB(texture->getCPUMemory()) << " VRAM: " << toMB(texture->getGPUMemory()) << std::endl;
+	for (Volume* volume : Volume::sInstances)
+		std::cout << "\t Volume " << volume->width << "x" << volume->height << "x" << volume->depth << " [" << residency_names[volume->residency] << "] CPU: " << toMB(volume->getCPUMemory()) << std::endl;
+}
+
 Mesh* grid = NULL;
 
 void drawGrid()
@@ -7,6 +7,8 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <functional>
+#include <atomic>
 
 #include "includes.h"
 #include "framework.h"
@@ -15,6 +17,32 @@
 long getTime();
 float * snapshot();
 bool readFile(const std::string& filename, std::string& content);
+size_t getPeakMemoryUsage(); //peak resident memory of the process in bytes
+void parallelFor(int count, const std::function<void(int)>& task); //runs task(0..count-1) spread over all the cores, returns when all are done
+extern thread_local bool in_loader_thread; //set in the threads of the mesh loader
+extern std::atomic<int> num_loads_in_flight; //queued or running, when there are several each loader runs its parallelFor serially
+
+//read only mapping of a whole file, the pages are loaded by the OS when they are accessed
+class MappedFile
+{
+public:
+	const char* data;
+	size_t size;
+
+	MappedFile();
+	~MappedFile();
+
+	bool open(const char* filename);
+	void close();
+
+private:
+#ifdef WIN32
+	void* file_handle;
+	void* mapping_handle;
+#else
+	int file_descriptor;
+#endif
+};
 
 //generic purposes fuctions
 void drawGrid();
@@ -33,6 +61,8 @@ std::vector<std::string>& split(const std::string &s, char delim, std::vector<st
 std::vector<std::string> split(const std::string &s, char delim);
 
 std::string getGPUStats();
+std::string getMemoryStats(); //CPU and VRAM of all the meshes, textures and volumes
+void printMemoryReport(); //the same for every resource
 void drawGrid();
 
 //Used in the MESH and ANIM parsers
@@ -1,8 +1,15 @@
 #include "volume.h"
 #include "extra/pvmparser.h"
 #include "extra/PerlinNoise.hpp"
+#include <cassert>
+#include <algorithm>
+
+std::vector<Volume*> Volume::sInstances;
+eResidency Volume::default_residency = RESIDENCY_DROP;
 
 Volume::Volume() {
+	sInstances.push_back(this);
+	residency = default_residency;
 	width = height = depth = 0;
 	widthSpacing = heightSpacing = depthSpacing = 1.0; 
 	data = NULL;
@@ -11,6 +18,8 @@ Volume::Volume() {
 }
 
 Volume::Volume(int w, int h, int d, int channels, int bytes_per_channel) {
+	sInstances.push_back(this);
+	residency = default_residency;
 	widthSpacing = heightSpacing = depthSpacing = 1.0;
 	data = NULL;
 	resize(w, h, d, channels, bytes_per_channel);
@@ -19,6 +28,7 @@ Volume::Volume(int w, int h, int d, int channels, int bytes_per_channel) {
 Volume::~Volume() {
 	if (data) delete[]data;
 	data = NULL;
+	sInstances.erase(std::find(sInstances.begin(), sInstances.end(), this));
 }
 
 void Volume::resize(int w, int h, int d, int channels, int bytes_per_channel) {
@@ -38,6 +48,76 @@ void Volume::clear() {
 	width = height = depth = 0;
 }
 
+void Volume::applyResidency() {
+	if (residency != RESIDENCY_DROP || !data)
+		return;
+	delete[] data;
+	data = NULL;
+}
+
+float Volume::getVoxelInterpolated(float u, float v, float w) {
+	assert(data && "volume without data");
+
+	//move to texel space, texel centers are at +0.5
+	float x = clamp(u * width - 0.5f, 0.0f, width - 1.0f);
+	float y = clamp(v * height - 0.5f, 0.0f, height - 1.0f);
+	float z = clamp(w * depth - 0.5f, 0.0f, depth - 1.0f);
+
+	int x0 = (int)x, y0 = (int)y, z0 = (int)z;
+	int x1 = x0 + 1 < (int)width ? x0 + 1 : x0;
+	int y1 = y0 + 1 < (int)height ? y0 + 1 : y0;
+	int z1 = z0 + 1 < (int)depth ? z0 + 1 : z0;
+	float fx = x - x0, fy = y - y0, fz = z - z0;
+
+	int c = channels * bytes_per_channel;
+	float c000 = data[VOLPOS(x0, y0, z0, width, height, depth, c)];
+	float c100 = data[VOLPOS(x1, y0, z0, width, height, depth, c)];
+	float c010 = data[VOLPOS(x0, y1, z0, width, height, depth, c)];
+	float c110 = data[VOLPOS(x1, y1, z0, width, height, depth, c)];
+	float c001 = data[VOLPOS(x0, y0, z1, width, height, depth, c)];
+	float c101 = data[VOLPOS(x1, y0, z1, width, height, depth, c)];
+	float c011 = data[VOLPOS(x0, y1, z1, width, height, depth, c)];
+	float c111 = data[VOLPOS(x1, y1, z1, width, height, depth, c)];
+
+	float c00 = lerp(c000, c100, fx);
+	float c10 = lerp(c010, c110, fx);
+	float c01 = lerp(c001, c101, fx);
+	float c11 = lerp(c011, c111, fx);
+	return lerp(lerp(c00, c10, fy), lerp(c01, c11, fy), fz) / 255.0f;
+}
+
+Volume* Volume::createMinMaxVolume(int brick_size) {
+	assert(data && brick_size > 0);
+
+	int bw = (width + brick_size - 1) / brick_size;
+	int bh = (height + brick_size - 1) / brick_size;
+	int bd = (depth + brick_size - 1) / brick_size;
+	Volume* bricks = new Volume(bw, bh, bd, 2, 1);
+	int c = channels * bytes_per_channel;
+
+	for (int k = 0; k < bd; k++) {
+		for (int j = 0; j < bh; j++) {
+			for (int i = 0; i < bw; i++) {
+				Uint8 min_value = 255;
+				Uint8 max_value = 0;
+				//one voxel of apron on each side, VOLPOS clamps to the borders
+				for (int z = k * brick_size - 1; z <= (k + 1) * brick_size; z++)
+					for (int y = j * brick_size - 1; y <= (j + 1) * brick_size; y++)
+						for (int x = i * brick_size - 1; x <= (i + 1) * brick_size; x++) {
+							Uint8 value = data[VOLPOS(x, y, z, (int)width, (int)height, (int)depth, c)];
+							min_value = value < min_value ? value : min_value;
+							max_value = value > max_value ? value : max_value;
+						}
+				Uint8* brick = &bricks->data[VOLPOS(i, j, k, bw, bh, bd, 2)];
+				brick[0] = min_value;
+				brick[1] = max_value;
+			}
+		}
+	}
+
+	return bricks;
+}
+
 void Volume::fillSphere() {
 	for (int i = 0; i < width; i++) {
 		for (int j = 0; j < height; j++) {
@@ -4,6 +4,8 @@
 
 #include "includes.h"
 #include "framework.h"
+#include "residency.h"
+#include <vector>
 
 #define VOLPOS(x,y,z,w,h,d,c) (c*((x>0?x<w?x:w-1:0)+(y>0?y<h?y:h-1:0)*w+(z>0?z<d?z:d-1:0)*w*h))
 
@@ -22,12 +24,25 @@ public:
 
 	Uint8* data; //bytes with the pixel information
 
+	static std::vector<Volume*> sInstances; //all the volumes alive, for the memory report
+	static eResidency default_residency; //DROP frees the voxels after the upload, KEEP is needed by the CPU raymarcher, the stats and the region of interest
+	eResidency residency;
+
 	Volume();
 	Volume(int w, int h, int d, int channels = 1, int bytes_per_channel = 1);
 	~Volume();
 
 	void resize(int w, int h, int d, int channels = 1, int bytes_per_channel = 1);
 	void clear();
+	void applyResidency(); //frees the voxels once they are all in the texture, keeps the size
+	size_t getCPUMemory() { return data ? (size_t)width * height * depth * channels * bytes_per_channel : 0; }
+
+	//trilinear sample of the first channel in [0,1] using texture coordinates, matches GL_LINEAR + GL_CLAMP_TO_EDGE
+	float getVoxelInterpolated(float u, float v, float w);
+
+	//coarse volume storing the min and max value (2 channels) of every brick of brick_size^3 voxels,
+	//bricks include the neighbour voxels so they are conservative under trilinear filtering
+	Volume* createMinMaxVolume(int brick_size);
 
 	void fillSphere();
 	void fillNoise(float frequency, int octaves, unsigned int seed);
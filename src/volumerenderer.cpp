@@ -0,0 +1,131 @@
+#include "volumerenderer.h"
+#include "texture.h"
+#include "application.h"
+
+#include <algorithm>
+
+MultiVolumeRenderer::MultiVolumeRenderer()
+{
+	shader = Shader::Get("data/shaders/basic.vs", "data/shaders/volume_multi.fs");
+}
+
+struct sVolumeCandidate {
+	SceneNode* node;
+	VolumeMaterial* material;
+	float distance;
+};
+
+void MultiVolumeRenderer::render(std::vector<SceneNode*>& nodes, Camera* camera)
+{
+	num_rendered = 0;
+	if (!shader)
+		return;
+
+	//collect the visible volumes, the box of every node is the cube [-1,1] in local space
+	std::vector<sVolumeCandidate> candidates;
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		VolumeMaterial* material = dynamic_cast<VolumeMaterial*>(nodes[i]->material);
+		if (!material || !material->texture)
+			continue;
+
+		Matrix44& model = nodes[i]->model;
+		Vector3 center = model * Vector3(0, 0, 0);
+		Vector3 halfsize;
+		for (int j = 0; j < 3; ++j)
+			halfsize.v[j] = fabs(model.m[j]) + fabs(model.m[4 + j]) + fabs(model.m[8 + j]);
+		if (camera->testBoxInFrustum(center, halfsize) == CLIP_OUTSIDE)
+			continue;
+
+		sVolumeCandidate candidate = { nodes[i], material, (center - camera->eye).length() };
+		candidates.push_back(candidate);
+	}
+
+	//front to back, if there are too many the closest ones are kept
+	std::sort(candidates.begin(), candidates.end(), [](const sVolumeCandidate& a, const sVolumeCandidate& b) { return a.distance < b.distance; });
+	if (candidates.size() > MAX_PASS_VOLUMES)
+	{
+		static bool warned = false; //this runs every frame
+		if (!warned)
+			std::cout << " + Multi volume pass: only the " << MAX_PASS_VOLUMES << " closest of " << candidates.size() << " volumes are rendered" << std::endl;
+		warned = true;
+		candidates.resize(MAX_PASS_VOLUMES);
+	}
+	if (candidates.empty())
+		return;
+
+	std::vector<Matrix44> inverse_models;
+	float colors[MAX_PASS_VOLUMES * 4];
+	float brightness[MAX_PASS_VOLUMES];
+	float clip_mins[MAX_PASS_VOLUMES * 3];
+	float clip_maxs[MAX_PASS_VOLUMES * 3];
+	float clip_planes[MAX_PASS_VOLUMES * 8];
+	float step = 1.0e10f;
+
+	for (size_t i = 0; i < candidates.size(); ++i)
+	{
+		Matrix44 inverse_model = candidates[i].node->model;
+		inverse_model.inverse();
+		inverse_models.push_back(inverse_model);
+
+		VolumeMaterial* material = candidates[i].material;
+		material->updateResidentRegion();
+		memcpy(colors + i * 4, &material->color, sizeof(float) * 4);
+		brightness[i] = material->brightness;
+
+		//only the region of interest is resident, the rest of the texture must not be sampled
+		Vector3 clip_min = material->clipping ? material->clip_min : Vector3(-1, -1, -1);
+		Vector3 clip_max = material->clipping ? material->clip_max : Vector3(1, 1, 1);
+		memcpy(clip_mins + i * 3, &clip_min, sizeof(float) * 3);
+		memcpy(clip_maxs + i * 3, &clip_max, sizeof(float) * 3);
+		for (int j = 0; j < 2; ++j)
+		{
+			if (material->clipping && material->clip_plane_enabled[j])
+				memcpy(clip_planes + i * 8 + j * 4, &material->clip_planes[j], sizeof(float) * 4);
+			else
+				memset(clip_planes + i * 8 + j * 4, 0, sizeof(float) * 4);
+		}
+
+		//the step is shared, in world units: the finest step of all the volumes
+		Matrix44& model = candidates[i].node->model;
+		for (int j = 0; j < 3; ++j)
+		{
+			float axis_scale = Vector3(model.m[j * 4], model.m[j * 4 + 1], model.m[j * 4 + 2]).length();
+			step = std::min(step, material->quality * axis_scale);
+		}
+	}
+
+	Matrix44 inverse_viewprojection = camera->viewprojection_matrix;
+	inverse_viewprojection.inverse();
+
+	shader->enable();
+	shader->setUniform("u_model", Matrix44());
+	shader->setUniform("u_viewprojection", Matrix44());
+	shader->setUniform("u_inverse_viewprojection", inverse_viewprojection);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform1("u_num_volumes", (int)candidates.size());
+	shader->setMatrix44Array("u_inverse_models", &inverse_models[0], (int)candidates.size());
+	shader->setUniform4Array("u_colors", colors, (int)candidates.size());
+	shader->setUniform1Array("u_brightness", brightness, (int)candidates.size());
+	shader->setUniform3Array("u_clip_mins", clip_mins, (int)candidates.size());
+	shader->setUniform3Array("u_clip_maxs", clip_maxs, (int)candidates.size());
+	shader->setUniform4Array("u_clip_planes", clip_planes, (int)candidates.size() * 2);
+	shader->setUniform("u_step", step);
+	shader->setUniform("u_jittering", jittering);
+	shader->setUniform("u_resolution", Vector2(Application::instance->window_width, Application::instance->window_height));
+
+	//one texture unit per volume, the unused samplers point to the first one
+	const char* sampler_names[MAX_PASS_VOLUMES] = { "u_texture0", "u_texture1", "u_texture2", "u_texture3" };
+	for (int i = 0; i < MAX_PASS_VOLUMES; ++i)
+		shader->setUniform(sampler_names[i], candidates[i < (int)candidates.size() ? i : 0].material->texture, i);
+
+	//a single quad covering the screen, the rays that miss every box are discarded
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	glEnable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_TEST);
+
+	shader->disable();
+	num_rendered = (int)candidates.size();
+}
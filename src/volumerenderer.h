@@ -0,0 +1,24 @@
+#ifndef VOLUMERENDERER_H
+#define VOLUMERENDERER_H
+
+#include "framework.h"
+#include "shader.h"
+#include "camera.h"
+#include "scenenode.h"
+
+#define MAX_PASS_VOLUMES 4
+
+//Renders several volume nodes in a single raymarch over the screen, so overlapping volumes are blended in the right order
+class MultiVolumeRenderer
+{
+public:
+	Shader* shader = NULL;
+	bool jittering = false;
+	int num_rendered = 0; //volumes drawn in the last frame
+
+	MultiVolumeRenderer();
+
+	void render(std::vector<SceneNode*>& nodes, Camera* camera);
+};
+
+#endif